@@ -0,0 +1,207 @@
+//----------------------------------------------------------------------------//
+// -*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-  //
+//                                                                            //
+// batteryinfo-shm.h - layout of the snapshot which `batteryinfo --daemon     //
+// --shm <path>' publishes, and routines for reading it.                      //
+//                                                                            //
+// The daemon maps a file (normally under /dev/shm) holding a struct          //
+// batteryinfo_shm, and rewrites it after every scan. Readers map the same    //
+// file read-only, and copy batteries out of it with batteryinfo_shm_read,    //
+// which takes no locks and makes no syscalls: the header's sequence number   //
+// is odd while the daemon is writing, and changes with every write, so a     //
+// copy taken while it was even and unchanged is consistent. A daemon killed  //
+// mid-write leaves it odd for good, so readers retry only so many times.     //
+//                                                                            //
+// String fields are indices into the snapshot's string table (0 meaning      //
+// that the battery doesn't have that field). Strings are only ever added to  //
+// the table, so an index keeps meaning the same string for as long as the    //
+// file exists, and strings can be read with batteryinfo_shm_string at any    //
+// time. A daemon which is restarted creates a new file rather than           //
+// rewriting the old one; readers which care can reopen it when sample_time   //
+// stops moving.                                                              //
+//                                                                            //
+// *-,_,-*'^^'*-,_,-*'^^'*-,_,-*'^^'*-,_,-*'^^'*-,_,-*'^^'*-,_,-*'^^'*-,_,-*  //
+//                                                                            //
+// Copyright (c) 2016 Joe Glancy.                                             //
+//                                                                            //
+// This program is free software: you can redistribute it and/or modify       //
+// it under the terms of the GNU General Public License as published by       //
+// the Free Software Foundation, either version 3 of the License, or          //
+// (at your option) any later version.                                        //
+//                                                                            //
+// This program is distributed in the hope that it will be useful,            //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of             //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              //
+// GNU General Public License for more details.                               //
+//                                                                            //
+// You should have received a copy of the GNU General Public License          //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.      //
+//                                                                            //
+//----------------------------------------------------------------------------//
+
+#ifndef BATTERYINFO_SHM_H
+#define BATTERYINFO_SHM_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BATTERYINFO_SHM_MAGIC                   0x6d687362U ///< First word of every snapshot ("bshm").
+#define BATTERYINFO_SHM_VERSION                 1 ///< Version of the layout below. Changes whenever it does.
+#define BATTERYINFO_SHM_MAX_BATTERIES           32 ///< Most batteries a snapshot holds; any more aren't published.
+#define BATTERYINFO_SHM_STRINGS                 512 ///< Size of the string table, including the unused index 0.
+#define BATTERYINFO_SHM_STRING_MAX              64 ///< Size of each string table entry; longer strings are truncated.
+#define BATTERYINFO_SHM_CACHE_LINE              64 ///< Alignment of the header and of each battery.
+#define BATTERYINFO_SHM_READ_TRIES              100000 ///< Times batteryinfo_shm_read retries a half-written snapshot before giving up.
+
+/** A battery, as published in a snapshot. Unknown numbers are NaN, and unknown
+ * flags are -1. The first cache line holds what's read most often. */
+struct batteryinfo_shm_battery {
+        double charge;                  ///< Current battery charge (0-100%, or more: it isn't capped).
+        double max_charge;              ///< Maximum possible battery charge (0-100%).
+        double voltage;                 ///< Current battery voltage.
+        double current;                 ///< Current battery current.
+        double temperature;             ///< Current battery temperature.
+        double etd;                     ///< Estimated Time until Discharge.
+        uint16_t status;                ///< String index of the current battery status.
+        int8_t present;                 ///< Is the battery present?
+        int8_t online;                  ///< Is the battery online?
+        int8_t charging_enabled;        ///< Does the battery have charging enabled?
+        uint8_t reserved0[11];          ///< Zero.
+
+        uint16_t name;                  ///< String index of the battery name.
+        uint16_t model;                 ///< String index of the battery model.
+        uint16_t manufacturer;          ///< String index of the battery manufacturer.
+        uint16_t technology;            ///< String index of the battery technology.
+        uint16_t driver;                ///< String index of the battery driver.
+        uint16_t health;                ///< String index of the current battery health.
+        uint16_t serial_number;         ///< String index of the battery serial number.
+        uint16_t charge_type;           ///< String index of the battery charge type.
+        uint16_t charge_rate;           ///< String index of the battery charge rate.
+        uint8_t reserved1[46];          ///< Zero.
+} __attribute__((aligned(BATTERYINFO_SHM_CACHE_LINE)));
+
+/** A snapshot's header. magic, version and size never change once the file
+ * has been created; the rest is covered by seq. */
+struct batteryinfo_shm_header {
+        uint32_t magic;                 ///< BATTERYINFO_SHM_MAGIC.
+        uint32_t version;               ///< BATTERYINFO_SHM_VERSION.
+        uint32_t size;                  ///< sizeof(struct batteryinfo_shm).
+        uint32_t n;                     ///< Amount of batteries in the snapshot.
+        uint64_t seq;                   ///< Sequence number: odd while the snapshot is being written.
+        uint64_t sample_time;           ///< When the batteries were read, in CLOCK_MONOTONIC nanoseconds.
+        uint32_t strings_n;             ///< Amount of string table entries in use, including index 0.
+        uint32_t dropped;               ///< Batteries which didn't fit, plus strings which didn't fit (published as 0).
+} __attribute__((aligned(BATTERYINFO_SHM_CACHE_LINE)));
+
+/** A snapshot. */
+struct batteryinfo_shm {
+        struct batteryinfo_shm_header header; ///< The header.
+        struct batteryinfo_shm_battery batteries[BATTERYINFO_SHM_MAX_BATTERIES]; ///< The batteries, in directory order.
+        char strings[BATTERYINFO_SHM_STRINGS][BATTERYINFO_SHM_STRING_MAX]; ///< The string table (each entry NUL-terminated).
+};
+
+/** Routine to map a snapshot for reading.
+ * \param path The snapshot's path.
+ * \return A pointer to the snapshot, or NULL on error (errno is set to EPROTO
+ * if it isn't a snapshot of this version). Unmap it with munmap when done.
+ */
+static inline const struct batteryinfo_shm *
+batteryinfo_shm_open(const char *path)
+{
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return NULL;
+        }
+
+        struct stat st;
+        void *p = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(struct batteryinfo_shm)) {
+                p = mmap(NULL, sizeof(struct batteryinfo_shm), PROT_READ, MAP_SHARED, fd, 0);
+        } else {
+                errno = EPROTO;
+        }
+        close(fd);
+        if (p == MAP_FAILED) {
+                return NULL;
+        }
+
+        const struct batteryinfo_shm *shm = (const struct batteryinfo_shm*) p;
+        if (shm->header.magic != BATTERYINFO_SHM_MAGIC ||
+                shm->header.version != BATTERYINFO_SHM_VERSION ||
+                shm->header.size != sizeof(struct batteryinfo_shm)) {
+                munmap(p, sizeof(struct batteryinfo_shm));
+                errno = EPROTO;
+                return NULL;
+        }
+
+        return shm;
+}
+
+/** Routine to copy a consistent set of batteries out of a snapshot.
+ * \param shm A pointer to the snapshot.
+ * \param batteries The array to copy the batteries into.
+ * \param max The size of batteries.
+ * \param sample_time If not NULL, a pointer to where to place when the
+ * batteries were read.
+ * \return The amount of batteries copied, or UINT32_MAX if the snapshot was
+ * still half-written after BATTERYINFO_SHM_READ_TRIES attempts (the daemon
+ * was probably killed while writing it).
+ */
+static inline uint32_t
+batteryinfo_shm_read(const struct batteryinfo_shm *shm,
+                     struct batteryinfo_shm_battery *batteries,
+                     uint32_t max,
+                     uint64_t *sample_time)
+{
+        uint32_t tries;
+
+        for (tries = 0; tries < BATTERYINFO_SHM_READ_TRIES; tries++) {
+                uint64_t seq = __atomic_load_n(&shm->header.seq, __ATOMIC_ACQUIRE);
+                if (seq & 1) {
+                        continue; // being written
+                }
+
+                uint32_t n = __atomic_load_n(&shm->header.n, __ATOMIC_RELAXED);
+                uint64_t t = __atomic_load_n(&shm->header.sample_time, __ATOMIC_RELAXED);
+                if (n > max) {
+                        n = max;
+                }
+                if (n > BATTERYINFO_SHM_MAX_BATTERIES) {
+                        n = BATTERYINFO_SHM_MAX_BATTERIES;
+                }
+                memcpy(batteries, shm->batteries, n * sizeof(struct batteryinfo_shm_battery));
+
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&shm->header.seq, __ATOMIC_RELAXED) == seq) {
+                        if (sample_time != NULL) {
+                                *sample_time = t;
+                        }
+                        return n;
+                }
+        }
+
+        return UINT32_MAX;
+}
+
+/** Routine to look up a string in a snapshot's string table.
+ * \param shm A pointer to the snapshot.
+ * \param index The string's index.
+ * \return The string, or NULL if index is 0 or out of range.
+ */
+static inline const char *
+batteryinfo_shm_string(const struct batteryinfo_shm *shm,
+                       uint16_t index)
+{
+        if (index == 0 || index >= __atomic_load_n(&shm->header.strings_n, __ATOMIC_ACQUIRE)) {
+                return NULL;
+        }
+
+        return shm->strings[index];
+}
+
+#endif // BATTERYINFO_SHM_H
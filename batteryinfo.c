@@ -35,20 +35,46 @@
 //----------------------------------------------------------------------------//
 
 #include <ctype.h>
-#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <float.h>
+#include <fnmatch.h>
 #define _GNU_SOURCE
 #include <getopt.h>
 #include <limits.h>
+#include <linux/netlink.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "batteryinfo-shm.h"
+
+// io_uring support (-U) is built if the kernel headers have it
+#if defined(__has_include)
+#       if __has_include(<linux/io_uring.h>)
+#               include <linux/io_uring.h>
+#               define HAVE_IO_URING            1
+#       endif
+#endif
+
 // comment the line below if you don't want color output
 #define COLOR_OUTPUT                    1
 
@@ -69,21 +95,91 @@
 
 #define SYS_FS_BATTERY_BASE_PATH                "/sys/class/power_supply/"
 #define SYS_FS_BATTERY_BASE_PATH_LEN            sizeof(SYS_FS_BATTERY_BASE_PATH)
+#define SYS_FS_ROOT_ENV                         "BATTERYINFO_SYSFS_ROOT" ///< Environment variable which overrides SYS_FS_BATTERY_BASE_PATH.
 
 #define DEFAULT_OUTPUT_SEQUENCE                 "ncvCmMedsp" ///< The default output sequence for battery information.
 #define COMPLETE_OUTPUT_SEQUENCE                "nctvCTdmMeshSHrpogD" ///< The complete output sequence for all battery information.
+#define QUERY_DEFAULT_OUTPUT_SEQUENCE           "nxcvCs" ///< The default output sequence for --query.
+#define QUERY_COMPLETE_OUTPUT_SEQUENCE          "nxctvCTDs" ///< The complete output sequence for --query.
 
 #define CONFIG_FLAG_DIGITS                      0x00001 ///< Digit output for flags (1/0 instead of yes/no, or true/false in JSON's case) config flag.
 #define CONFIG_FLAG_BY_NAME                     0x00002 ///< Output info for named battery config flag.
 #define CONFIG_FLAG_OUTPUT_ALL                  0x00004 ///< Output every possible piece of information.
 #define CONFIG_FLAG_DISABLE_CHARGE_CAP          0x00008 ///< Disable the 100% charge capacity cap.
+#define CONFIG_FLAG_WATCH                       0x00010 ///< Keep running and sample battery information periodically.
+#define CONFIG_FLAG_LAZY                        0x00020 ///< Only read the individual sysfs attributes needed by the output sequence.
+#define CONFIG_FLAG_PARALLEL                    0x00040 ///< Read supplies concurrently with a pool of worker threads.
+#define CONFIG_FLAG_IO_URING                    0x00080 ///< Open and read supplies' files in batches with io_uring.
+#define CONFIG_FLAG_FOLLOW                      0x00100 ///< Keep running, and output batteries whenever they change.
+#define CONFIG_FLAG_DAEMON                      0x00200 ///< Keep running, and answer other invocations' requests over a Unix socket.
+#define CONFIG_FLAG_CLIENT                      0x00400 ///< Ask a daemon for battery information before reading it directly.
+#define CONFIG_FLAG_MAX_AGE                     0x00800 ///< Share batteries read by recent invocations through a cache file.
+#define CONFIG_FLAG_RECORD                      0x01000 ///< Append every sample to a history log instead of outputting it.
+#define CONFIG_FLAG_REPLAY                      0x02000 ///< Output the samples of a history log instead of reading sysfs.
+#define CONFIG_FLAG_QUERY                       0x04000 ///< Output aggregates of the samples of a history log instead of reading sysfs.
+#define CONFIG_FLAG_ROLLING                     0x08000 ///< Keep rolling statistics and the charge trend of each battery, because the output sequence (or a daemon's client) might ask for them.
 
 #define DOUBLE_INVALID                          DBL_MIN  ///< Invalid double value. Assume that this will never be read as an actual value, so that it can represent an invalid one.
 #define LONG_INVALID                            LONG_MIN ///< Invalid long value.  Assume that this will also never be read as an actual value, so that it can represent an invalid one.
 
+#define SYS_FS_READ_MAX                         4096 ///< The most that sysfs will return from a single attribute read (PAGE_SIZE).
+
+#define NSEC_PER_SEC                            1000000000LL ///< Nanoseconds per second.
+#define NSEC_PER_MSEC                           1000000LL ///< Nanoseconds per millisecond.
+
+#define SCAN_POOL_DEFAULT_THREADS               4 ///< Default amount of worker threads for -T without -P.
+#define SCAN_POOL_DEFAULT_THREADS_STR           "4" ///< SCAN_POOL_DEFAULT_THREADS as a string.
+#define SCAN_POOL_MAX_THREADS                   256 ///< Maximum value of -P.
+#define SCAN_DEFAULT_TIMEOUT_NS                 NSEC_PER_SEC ///< Default per-supply read deadline in parallel mode, in nanoseconds.
+#define SCAN_DEFAULT_TIMEOUT_STR                "1" ///< SCAN_DEFAULT_TIMEOUT_NS as a string, in seconds.
+#define FOLLOW_DEFAULT_INTERVAL                 30 ///< Default interval at which --follow re-reads every supply anyway, in seconds.
+#define FOLLOW_DEFAULT_INTERVAL_STR             "30" ///< FOLLOW_DEFAULT_INTERVAL as a string.
+#define UEVENT_MSG_MAX                          8192 ///< Size of the buffer which kernel uevent messages are received into.
+#define UEVENT_SOCKET_RCVBUF                    (1024 * 1024) ///< Receive buffer size asked for on the uevent socket.
+#define DAEMON_SOCKET_PATH                      "/run/batteryinfo.sock" ///< Default path of the --daemon socket.
+#define DAEMON_SOCKET_ENV                       "BATTERYINFO_SOCKET" ///< Environment variable which overrides DAEMON_SOCKET_PATH.
+#define DAEMON_DEFAULT_INTERVAL                 5 ///< Default interval at which --daemon reads every supply, in seconds.
+#define DAEMON_DEFAULT_INTERVAL_STR             "5" ///< DAEMON_DEFAULT_INTERVAL as a string.
+#define DAEMON_PROTOCOL                         "batteryinfo/2" ///< First field of every request to a daemon.
+#define DAEMON_REQUEST_MAX                      4096 ///< Longest request a daemon accepts, including the newline.
+#define CACHE_DIR_ENV                           "XDG_RUNTIME_DIR" ///< Environment variable naming the directory of --max-age's cache file.
+#define CACHE_DEFAULT_DIR                       "/run" ///< Directory of --max-age's cache file if CACHE_DIR_ENV isn't set.
+#define CACHE_FILE_NAME                         "batteryinfo" ///< Name of --max-age's cache file, without its suffix.
+#define CACHE_READ_TRIES                        100000 ///< Times a half-written cache file is read before giving up on it.
+#define CACHE_STRINGS_PER_BATTERY               10 ///< Most string table entries a battery can add to a snapshot.
+#define HISTORY_MAGIC                           0x63657262U ///< First word of every --record history log ("brec").
+#define HISTORY_VERSION                         2 ///< Version of the history log layout. Changes whenever it does.
+#define HISTORY_MAX_SUPPLIES                    63 ///< Most supplies a history log can name; samples of any more are dropped.
+#define HISTORY_NAME_MAX                        64 ///< Size of each supply name in a history log; longer names are truncated.
+#define HISTORY_BLOCK_SIZE                      4096 ///< Size of each block of samples in a history log.
+#define HISTORY_BLOCK_SAMPLES_MAX               UINT16_MAX ///< Most samples a block holds, however well they compress.
+#define HISTORY_GROW                            64 ///< Amount of blocks a history log is preallocated for at a time.
+#define HISTORY_FIELDS                          (ATTR_LONG_NUM + 1) ///< Columns per battery in a block: the numeric attributes, and the status.
+#define HISTORY_FIELD_STATUS                    ATTR_LONG_NUM ///< The status' column, after the numeric attributes'.
+#define HISTORY_VARINT_MAX                      10 ///< Most bytes a varint takes.
+#define HISTORY_COLUMN_CAP                      (HISTORY_BLOCK_SIZE + 3 * HISTORY_VARINT_MAX) ///< Room for each column of the block being filled: a block's worth, plus the most that a sample adds.
+#define HISTORY_TOKEN_RUN                       0 ///< Column token which is followed by a varint count of zero residuals.
+#define HISTORY_TOKEN_MISSING                   1 ///< Column token for an unknown value.
+#define HISTORY_TOKEN_VALUE                     2 ///< Column tokens from this one on are a zigzagged residual, plus this.
+#define HISTORY_READ_TRIES                      100000 ///< Times a block which is being rewritten is read before giving up on it.
+#define HISTORY_STATUSES_NUM                    6 ///< Amount of status column values (see history_statuses).
+#define QUERY_CHUNK                             128 ///< Samples which --query decodes at a time, before aggregating them.
+#define QUERY_BUCKETS_MAX                       1000000 ///< Most buckets --buckets can split a --query into.
+#define QUERY_GAP_FACTOR                        4 ///< How many times longer than the one before it an interval between a battery's samples has to be for --query to take it as a gap in the recording, which doesn't count towards any status.
+#define ROLLING_OUTPUT_CHARS                    "VAKE" ///< The output sequence characters which need rolling statistics.
+#define ROLLING_TREND_MIN_SAMPLES               3 ///< Samples of a charge trend needed before times until empty or full are estimated from it.
+#define ROLLING_STATUS_MAX                      32 ///< Size of the copy of a battery's last status kept with its charge trend; longer statuses are truncated.
+#define ROLLING_DEFAULT_WINDOW                  60 ///< Default value of -W: samples in the window of rolling statistics.
+#define ROLLING_DEFAULT_WINDOW_STR              "60" ///< ROLLING_DEFAULT_WINDOW as a string.
+#define ROLLING_MAX_WINDOW                      1000000 ///< Maximum value of -W.
+#define DAEMON_IO_TIMEOUT                       1 ///< Seconds either end of a daemon connection waits for the other.
+
+#define SCAN_URING_BATCH                        32 ///< Amount of supplies whose files are opened and read by each io_uring batch.
+
 #define free_if_not_null(p) if (p != NULL) free((void*) p) ///< Macro to free the memory address pointed to by p if it's value is not NULL.
 
 #define error(a, b...) fprintf(stderr, FMT_RED "error" FMT_RESET ": " a, ##b)
+#define warning(a, b...) fprintf(stderr, FMT_YELLOW "warning" FMT_RESET ": " a, ##b)
 
 //------------------------------------------------------------------------------
 // _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
@@ -94,6 +190,15 @@ static const char short_usage_str[] =
         "Usage: " PROGRAM_NAME " <output sequence>\n"
         "           [-h | --help] [-v | --version] [-l | --license]\n"
         "           [-a | --all] [-d | --digits] [-n | --name <name>] [-j | --json]\n"
+        "           [-w | --watch <interval>] [-c | --count <samples>] [-L | --lazy]\n"
+        "           [-R | --sysfs-root <dir>] [-P | --parallel <threads>]\n"
+        "           [-T | --timeout <seconds>] [-U | --io-uring] [-f | --follow]\n"
+        "           [-D | --daemon] [-C | --client] [-S | --socket <path>]\n"
+        "           [-M | --shm <path>] [-A | --max-age <ms>] [-F | --format <format>]\n"
+        "           [-r | --record <file>] [-y | --replay <file>]\n"
+        "           [-s | --since <time>] [-u | --until <time>]\n"
+        "           [-q | --query <file>] [-b | --buckets <n>]\n"
+        "           [-W | --window <samples>]\n"
         "Use `" PROGRAM_NAME " -h' for more information.\n";
 
 /** Longer, more extensive usage information string. */
@@ -101,6 +206,15 @@ static const char usage_str[] =
         "Usage: " PROGRAM_NAME " <output sequence>\n"
         "           [-h | --help] [-v | --version] [-l | --license]\n"
         "           [-a | --all] [-d | --digits] [-n | --name <name>] [-j | --json]\n"
+        "           [-w | --watch <interval>] [-c | --count <samples>] [-L | --lazy]\n"
+        "           [-R | --sysfs-root <dir>] [-P | --parallel <threads>]\n"
+        "           [-T | --timeout <seconds>] [-U | --io-uring] [-f | --follow]\n"
+        "           [-D | --daemon] [-C | --client] [-S | --socket <path>]\n"
+        "           [-M | --shm <path>] [-A | --max-age <ms>] [-F | --format <format>]\n"
+        "           [-r | --record <file>] [-y | --replay <file>]\n"
+        "           [-s | --since <time>] [-u | --until <time>]\n"
+        "           [-q | --query <file>] [-b | --buckets <n>]\n"
+        "           [-W | --window <samples>]\n"
         "\n"
         "`output sequence' is a sequence of the below characters, in any order, which\n"
         "determines what information is listed about available batteries.\n"
@@ -130,12 +244,23 @@ static const char usage_str[] =
         "                discharged (remaining battery life), in hours.\n"
         "                This assumes that the current battery drain will\n"
         "                remain constant.\n"
+        "    x           when the information was read, in seconds since the\n"
+        "                epoch (not included by -a).\n"
+        "    V           rolling statistics of the voltage over the last -W\n"
+        "                samples: its moving average, minimum, maximum and\n"
+        "                standard deviation (not included by -a).\n"
+        "    A           the same, for the current (not included by -a).\n"
+        "    K           the same, for the temperature (not included by -a).\n"
+        "    E           hours until the battery is empty, and until it is\n"
+        "                full, going by how its charge has changed over the\n"
+        "                last -W samples (unknown until it has been sampled\n"
+        "                a few times; not included by -a).\n"
         "If the output sequence is not provided, it will default to:\n"
         "        " DEFAULT_OUTPUT_SEQUENCE "\n"
         "If there is no data available for one of the above mentioned parameters, a\n"
-        "question mark (\"?\") is outputted instead, if the output format is CSV. If\n"
-        "the output format is JSON, a null value will be used to indicate the absence\n"
-        "of a certain piece of data.\n"
+        "question mark (\"?\") is outputted instead, if the output format is plain. If\n"
+        "it is CSV, the value is left empty, and if it is JSON or NDJSON, a null value\n"
+        "will be used to indicate the absence of a certain piece of data.\n"
         "\n"
         "Options:\n"
         "   -h,--help         display this help text.\n"
@@ -149,8 +274,103 @@ static const char usage_str[] =
         "   -n,--name <name>  specify the name of a battery to output information for.\n"
         "                     If no battery by that name is found, the output will be\n"
         "                     empty (unless the output format is in JSON, in which case\n"
-        "                     the `batteries' array will be empty).\n"
-        "   -j,--json         output battery information in JSON format.\n";
+        "                     the `batteries' array will be empty). Several names can\n"
+        "                     be given, separated by commas or with more -n options,\n"
+        "                     and listed in that order. Names can also be glob\n"
+        "                     patterns (like `BAT*'), in which case every matching\n"
+        "                     battery is listed, in directory order.\n"
+        "   -j,--json         output battery information in JSON format (the same as\n"
+        "                     `-F json').\n"
+        "   -F,--format <format>\n"
+        "                     output battery information in `format', which is one\n"
+        "                     of: plain (`label: value' lines, the default), csv\n"
+        "                     (a header line, written once, then one row per\n"
+        "                     battery), json (one document per sample) or ndjson\n"
+        "                     (one object per line, per battery).\n"
+        "   -w,--watch <interval>\n"
+        "                     keep running, and output battery information every\n"
+        "                     `interval' seconds (fractions such as 0.25 are\n"
+        "                     allowed). Samples are taken on a fixed schedule, so\n"
+        "                     the period does not drift. When stopped (e.g: with\n"
+        "                     Ctrl-C), the measured sampling jitter is reported on\n"
+        "                     stderr.\n"
+        "   -c,--count <samples>\n"
+        "                     with --watch, stop after `samples' samples. With\n"
+        "                     --follow, stop after `samples' updates.\n"
+        "   -L,--lazy         only read the individual sysfs attribute files needed\n"
+        "                     by the output sequence, instead of the whole uevent\n"
+        "                     file. uevent is still used for anything the battery's\n"
+        "                     driver doesn't provide as a separate file.\n"
+        "   -R,--sysfs-root <dir>\n"
+        "                     read power supplies from `dir' instead of\n"
+        "                     " SYS_FS_BATTERY_BASE_PATH ". This can also be set\n"
+        "                     with the " SYS_FS_ROOT_ENV " environment variable.\n"
+        "   -P,--parallel <threads>\n"
+        "                     read supplies concurrently, with up to `threads'\n"
+        "                     worker threads. Batteries are still listed in\n"
+        "                     directory order.\n"
+        "   -T,--timeout <seconds>\n"
+        "                     with --parallel (which this implies, with\n"
+        "                     " SCAN_POOL_DEFAULT_THREADS_STR " threads), give up on a supply whose files\n"
+        "                     take longer than `seconds' to read (default\n"
+        "                     " SCAN_DEFAULT_TIMEOUT_STR "). It is listed with only its name, and a warning\n"
+        "                     is printed on stderr.\n"
+        "   -U,--io-uring     open and read the supplies' files in batches with\n"
+        "                     io_uring, instead of one syscall at a time. If the\n"
+        "                     kernel doesn't support it, a warning is printed and\n"
+        "                     files are read as usual. Has no effect with\n"
+        "                     --parallel.\n"
+        "   -f,--follow       output every battery, and then keep running and output\n"
+        "                     a battery again whenever the kernel reports that it\n"
+        "                     has changed. Every supply is also re-read every -w\n"
+        "                     `interval' (default " FOLLOW_DEFAULT_INTERVAL_STR " seconds), for drivers which\n"
+        "                     don't report changes; with -R, only this is used.\n"
+        "   -D,--daemon       keep running, reading every supply every -w `interval'\n"
+        "                     (default " DAEMON_DEFAULT_INTERVAL_STR " seconds), and answer --client\n"
+        "                     invocations from what was last read. Output options\n"
+        "                     are ignored.\n"
+        "   -C,--client       ask a running daemon for the batteries first, and\n"
+        "                     only read them directly if it can't answer.\n"
+        "   -S,--socket <path>\n"
+        "                     the daemon's socket (default\n"
+        "                     " DAEMON_SOCKET_PATH "). This can also be set with\n"
+        "                     the " DAEMON_SOCKET_ENV " environment variable.\n"
+        "   -M,--shm <path>   with --daemon, also publish every scan into a shared\n"
+        "                     memory snapshot at `path' (e.g. /dev/shm/batteryinfo),\n"
+        "                     which programs can read without any syscalls (see\n"
+        "                     batteryinfo-shm.h).\n"
+        "   -A,--max-age <ms> share what is read between invocations through a cache\n"
+        "                     file in $" CACHE_DIR_ENV " (or " CACHE_DEFAULT_DIR "), only\n"
+        "                     reading the batteries again if it's older than `ms'\n"
+        "                     milliseconds.\n"
+        "   -r,--record <file>\n"
+        "                     append every battery read (once, every --watch\n"
+        "                     `interval', or every --daemon scan) to the history\n"
+        "                     log `file', creating it if needed. Only one\n"
+        "                     batteryinfo can record to a log at a time.\n"
+        "   -y,--replay <file>\n"
+        "                     output the samples recorded in the history log\n"
+        "                     `file' instead of reading the batteries, in any\n"
+        "                     format. -c limits the amount of samples.\n"
+        "   -s,--since <time>\n"
+        "   -u,--until <time>\n"
+        "                     with --replay or --query, only use samples taken at or\n"
+        "                     after (or at or before) `time', in seconds since the\n"
+        "                     epoch, or if negative, seconds before now.\n"
+        "   -q,--query <file> output, for each battery, aggregates of the samples\n"
+        "                     recorded in the history log `file' (between --since\n"
+        "                     and --until), in any format. In the output sequence,\n"
+        "                     c, t, v, T and D give the minimum, mean and maximum\n"
+        "                     of that value, C also gives its 50th, 90th and 99th\n"
+        "                     percentiles (estimated), x gives the span of time and\n"
+        "                     the amount of samples, and s the seconds spent in\n"
+        "                     each status (default " QUERY_DEFAULT_OUTPUT_SEQUENCE ").\n"
+        "   -b,--buckets <n>  with --query, split the time into `n' equal spans,\n"
+        "                     and aggregate each separately (default 1).\n"
+        "   -W,--window <samples>\n"
+        "                     keep V, A, K and E over the last `samples' samples\n"
+        "                     (default " ROLLING_DEFAULT_WINDOW_STR "), with --watch, --follow,\n"
+        "                     --daemon or --replay.\n";
 
 /** License string. */
 static const char license_str[] =
@@ -174,8 +394,19 @@ static const char version_str[] = PROGRAM_NAME" v"PROGRAM_VERSION_STR"\n";
 
 /** Output format enumerations. */
 enum {
+        OUTPUT_FORMAT_PLAIN,
         OUTPUT_FORMAT_CSV,
-        OUTPUT_FORMAT_JSON
+        OUTPUT_FORMAT_JSON,
+        OUTPUT_FORMAT_NDJSON,
+        OUTPUT_FORMAT_NUM
+};
+
+/** Names of the output formats, as given to -F and in daemon requests. */
+static const char *const output_format_names[OUTPUT_FORMAT_NUM] = {
+        [OUTPUT_FORMAT_PLAIN]  = "plain",
+        [OUTPUT_FORMAT_CSV]    = "csv",
+        [OUTPUT_FORMAT_JSON]   = "json",
+        [OUTPUT_FORMAT_NDJSON] = "ndjson",
 };
 
 /** Long argument definitions for getopt_long. */
@@ -186,8 +417,29 @@ static const struct option long_command_line_opts[] = {
         { "all", no_argument, NULL, 'a' },
         { "digits", no_argument, NULL, 'd' },
         { "json", no_argument, NULL, 'j' },
+        { "format", required_argument, NULL, 'F' },
         { "name", required_argument, NULL, 'n' },
         { "no-cap", no_argument, NULL, 'N'},
+        { "watch", required_argument, NULL, 'w' },
+        { "count", required_argument, NULL, 'c' },
+        { "lazy", no_argument, NULL, 'L' },
+        { "sysfs-root", required_argument, NULL, 'R' },
+        { "parallel", required_argument, NULL, 'P' },
+        { "timeout", required_argument, NULL, 'T' },
+        { "io-uring", no_argument, NULL, 'U' },
+        { "follow", no_argument, NULL, 'f' },
+        { "daemon", no_argument, NULL, 'D' },
+        { "client", no_argument, NULL, 'C' },
+        { "socket", required_argument, NULL, 'S' },
+        { "shm", required_argument, NULL, 'M' },
+        { "max-age", required_argument, NULL, 'A' },
+        { "record", required_argument, NULL, 'r' },
+        { "replay", required_argument, NULL, 'y' },
+        { "since", required_argument, NULL, 's' },
+        { "until", required_argument, NULL, 'u' },
+        { "query", required_argument, NULL, 'q' },
+        { "buckets", required_argument, NULL, 'b' },
+        { "window", required_argument, NULL, 'W' },
         { NULL, 0, NULL, 0 }
 };
 
@@ -195,15 +447,389 @@ static const struct option long_command_line_opts[] = {
 // _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
 //------------------------------------------------------------------------------
 
+/** Structure to hold the names given with -n: a list of plain names, in the
+ * order given, a hash set of the same names, and any glob patterns. */
+struct name_set {
+        char **names;           ///< The plain names, without duplicates.
+        size_t n;               ///< Amount of plain names.
+        char **patterns;        ///< The glob patterns.
+        size_t patterns_n;      ///< Amount of glob patterns.
+        const char **slots;     ///< Open addressing hash table of the plain names (built by name_set_build).
+        size_t mask;            ///< The hash table's size, minus 1 (it's a power of 2).
+};
+
 /** Structure to hold various program configuration parameters. */
 struct config {
         uint64_t configflags;   ///< Configuration flags.
         int output_format;      ///< Output format.
+        uint32_t attrs;         ///< The ATTR_MASK_* attributes needed by the output sequence (only used with CONFIG_FLAG_LAZY).
+        struct output_plan *plan; ///< The output sequence, compiled for output_format and configflags.
+        const char *sys_fs_path; ///< The power supply directory to read, ending in a '/'.
+        const char *socket_path; ///< The --daemon socket's path.
+        const char *shm_path;   ///< The --shm snapshot's path, or NULL.
+        const char *history_path; ///< The --record, --replay or --query history log's path.
+        struct history *history; ///< The --record history log, once open, or NULL.
         struct {
-                char *n;        ///< The value of the -n,--name option, if it was provided on the command line.
+                struct name_set n; ///< The values of the -n,--name options.
+                struct timespec w; ///< The parsed value of the -w,--watch option.
+                unsigned long c; ///< The value of the -c,--count option (0 means no limit).
+                unsigned long P; ///< The value of the -P,--parallel option.
+                struct timespec T; ///< The parsed value of the -T,--timeout option.
+                unsigned long A; ///< The value of the -A,--max-age option, in milliseconds.
+                int64_t s;      ///< The parsed value of the -s,--since option (CLOCK_REALTIME, in nanoseconds).
+                int64_t u;      ///< The parsed value of the -u,--until option (CLOCK_REALTIME, in nanoseconds).
+                unsigned long b; ///< The value of the -b,--buckets option.
+                unsigned long W; ///< The value of the -W,--window option.
         } cmdopts;              ///< Struct to store the values for options on the command line that take them.
 };
 
+/** Individual sysfs attributes of a power supply. Numeric attributes come
+ * first, followed by string attributes. */
+enum {
+        ATTR_CAPACITY,
+        ATTR_CHARGE_NOW,
+        ATTR_CHARGE_FULL,
+        ATTR_CHARGE_FULL_DESIGN,
+        ATTR_VOLTAGE_NOW,
+        ATTR_CURRENT_NOW,
+        ATTR_TEMP,
+        ATTR_PRESENT,
+        ATTR_ONLINE,
+        ATTR_CHARGING_ENABLED,
+        ATTR_LONG_NUM,
+        ATTR_NAME = ATTR_LONG_NUM,
+        ATTR_MODEL_NAME,
+        ATTR_MANUFACTURER,
+        ATTR_TECHNOLOGY,
+        ATTR_STATUS,
+        ATTR_HEALTH,
+        ATTR_SERIAL_NUMBER,
+        ATTR_CHARGE_TYPE,
+        ATTR_CHARGE_RATE,
+        ATTR_NUM
+};
+
+#define ATTR_MASK(a)                            (1u << (a)) ///< Mask bit for an ATTR_* attribute.
+#define ATTR_MASK_DRIVER                        (1u << ATTR_NUM) ///< Mask bit for the driver, which comes from device/uevent rather than an attribute file.
+
+/** Files which are kept open for each battery in the supply cache. The
+ * individual attribute files follow SUPPLY_FILE_ATTR, in ATTR_* order. */
+enum {
+        SUPPLY_FILE_UEVENT,
+        SUPPLY_FILE_DEVICE_UEVENT,
+        SUPPLY_FILE_ATTR,
+        SUPPLY_FILE_NUM = SUPPLY_FILE_ATTR + ATTR_NUM
+};
+
+#define SUPPLY_FD_CLOSED                        -1 ///< Supply cache file descriptor value for a file which hasn't been opened yet.
+#define SUPPLY_FD_MISSING                       -2 ///< Supply cache file descriptor value for a file which doesn't exist.
+#define COMPARE_FILE_MAX                        32 ///< Size of the buffer used by compare_file_contents.
+#define SUPPLY_FD_RESERVE                       64 ///< File descriptors which the supply cache leaves free for everything else.
+#define SUPPLY_FILE_NAME_MAX                    31 ///< Maximum length of a supply's file name (see supply_file_name), relative to the supply's directory.
+#define SUPPLY_PATH_MAX                         (NAME_MAX + 1 + SUPPLY_FILE_NAME_MAX + 1) ///< Size of the buffer needed by supply_path.
+#define SUPPLY_PREFETCH_NUM                     SUPPLY_FILE_ATTR ///< Files which io_uring batches read ahead: SUPPLY_FILE_UEVENT and SUPPLY_FILE_DEVICE_UEVENT.
+#define SUPPLY_DENTS_SIZE                       (32 * 1024) ///< Size of the buffer which directory entries are read into, in one getdents64 call.
+
+/** Structure to hold the cached state of a single /sys/class/power_supply
+ * entry. */
+struct supply {
+        char name[NAME_MAX + 1];        ///< Directory entry name.
+        int fds[SUPPLY_FILE_NUM];       ///< Open file descriptors (or SUPPLY_FD_*) for the files in SUPPLY_FILE_*.
+        uint32_t uevent_lacks;          ///< ATTR_MASK_* attributes which were absent from uevent the last time it was parsed.
+        char classified;                ///< Whether is_battery has been set yet.
+        char is_battery;                ///< Whether the supply's type is "Battery" (this never changes for an entry).
+        char seen;                      ///< Whether the supply was seen during the current scan.
+        char busy;                      ///< Whether a worker thread is reading the supply (guarded by scan_pool_lock).
+        char orphaned;                  ///< Whether the supply was removed from the cache while busy, so the worker has to free it (guarded by scan_pool_lock).
+        char listed;                    ///< Whether the last parallel scan which finished reading the supply found it to be a battery (only used by the main thread).
+        const char *prefetched[SUPPLY_PREFETCH_NUM]; ///< The contents of each file read ahead by an io_uring batch (see scan_uring_prefetch) for supply_read to use, or NULL.
+        int prefetched_len[SUPPLY_PREFETCH_NUM]; ///< The result of each read ahead: the contents' length, or a negated errno value.
+        char *record;                   ///< The last record output for the battery by --follow, or NULL.
+        size_t record_len;              ///< Length of record.
+        size_t record_cap;              ///< Allocated capacity of record.
+        int record_index;               ///< The battery's index in the last --follow scan.
+        int history_id;                 ///< The battery's index in the --record history log's names, or -1 if not looked up yet.
+        struct rolling *rolling;        ///< The battery's rolling statistics, or NULL if none have been kept.
+};
+
+/** Structure to hold every power supply seen by previous scans, so that their
+ * files only need to be opened and classified once. */
+struct supply_cache {
+        struct supply **supplies;       ///< Array of cached supplies, in directory order. Each is allocated separately, so that worker threads can hold on to one while the array changes.
+        size_t n;                       ///< Amount of cached supplies.
+        size_t cap;                     ///< Allocated capacity of supplies.
+        size_t hint;                    ///< Index at which the next directory entry is expected to be found.
+        int dir_fd;                     ///< The sysfs power supply directory, kept open between scans (or -1). Every supply's files are opened relative to it.
+        char *dents;                    ///< Buffer of directory entries, from getdents64.
+        size_t dents_len;               ///< Amount of data in dents.
+        size_t dents_pos;               ///< Offset in dents of the next directory entry.
+};
+
+/** Structure of a directory entry returned by getdents64 (glibc doesn't
+ * always declare one). */
+struct linux_dirent64 {
+        uint64_t d_ino;                 ///< Inode number.
+        int64_t d_off;                  ///< Offset of the next entry.
+        unsigned short d_reclen;        ///< Size of this entry.
+        unsigned char d_type;           ///< File type.
+        char d_name[];                  ///< NUL-terminated file name.
+};
+
+#define ARENA_BLOCK_SIZE                        (64 * 1024) ///< Default size of each block of memory in an arena.
+#define ARENA_ALIGN                             16 ///< Alignment of every allocation from an arena.
+
+/** Structure to hold one block of memory in an arena. */
+struct arena_block {
+        struct arena_block *next;       ///< The next block, or NULL.
+        size_t size;                    ///< Size of data.
+        size_t used;                    ///< Amount of data used since the arena was last reset.
+        _Alignas(ARENA_ALIGN) char data[]; ///< The block's memory.
+};
+
+/** Structure to hold an arena: a set of memory blocks which are allocated from
+ * by bumping a pointer, and which are all released at once by resetting the
+ * arena. Blocks are kept when the arena is reset, so once it has grown to fit
+ * a scan, later scans don't allocate anything. */
+struct arena {
+        struct arena_block *head;       ///< The first block, or NULL.
+        struct arena_block *cur;        ///< The block currently being allocated from.
+};
+
+/** Structure to hold the results of a scan of every power supply. */
+struct scan {
+        struct arena arena;             ///< Storage for the batteries' information and the file contents it points into. Reset at the start of every scan.
+        struct battery_info **batteries; ///< The batteries found by the current scan, in directory order.
+        struct supply **supplies;       ///< The cached supply each of batteries was read from.
+        size_t n;                       ///< Amount of batteries found by the current scan.
+        size_t cap;                     ///< Allocated capacity of batteries.
+        struct scan_pool *pool;         ///< Worker threads for parallel scans, or NULL.
+        struct scan_uring *uring;       ///< io_uring for batched scans, or NULL.
+        int64_t time;                   ///< When the current scan started (CLOCK_REALTIME, in nanoseconds).
+};
+
+/** States of a supply in a parallel scan. */
+enum {
+        SCAN_JOB_PENDING,               ///< Waiting for a worker.
+        SCAN_JOB_RUNNING,               ///< Being read by a worker.
+        SCAN_JOB_DONE,                  ///< Finished.
+        SCAN_JOB_TIMED_OUT,             ///< Missed its deadline.
+        SCAN_JOB_BUSY,                  ///< Not read, because a worker was still reading it for an earlier scan.
+        SCAN_JOB_SKIPPED                ///< Not read, because every worker was stuck.
+};
+
+/** Structure to hold a single supply to be read by a parallel scan. */
+struct scan_job {
+        struct supply *supply;          ///< The supply.
+        struct battery_info *info;      ///< The battery's information once done, or NULL if it isn't a battery or couldn't be read.
+        struct scan_worker *worker;     ///< The worker reading the supply, while running.
+        int64_t started;                ///< When the worker started reading the supply (CLOCK_MONOTONIC, in nanoseconds).
+        int state;                      ///< State, from SCAN_JOB_*.
+        int err;                        ///< errno, if reading the supply failed.
+};
+
+/** Structure to hold a worker thread of a parallel scan. */
+struct scan_worker {
+        pthread_t thread;               ///< The thread.
+        struct scan_pool *pool;         ///< The pool the worker belongs to.
+        struct arena arena;             ///< Storage for the information the worker reads. Only the worker resets it, when it starts on a new scan.
+        unsigned long generation;       ///< The scan the arena's contents belong to.
+        char busy;                      ///< Whether the worker is reading a supply.
+        char timed_out;                 ///< Whether the supply being read has missed its deadline (so the worker is stuck).
+};
+
+/** Structure to hold the worker threads and the jobs of parallel scans. Every
+ * field is guarded by scan_pool_lock. */
+struct scan_pool {
+        pthread_cond_t work;            ///< Signalled when there are jobs, or the workers should stop.
+        pthread_cond_t done;            ///< Signalled when the last job of a scan is done.
+        struct scan_worker **workers;   ///< Every worker thread started.
+        size_t workers_n;               ///< Amount of workers.
+        size_t threads;                 ///< Amount of workers wanted (-P), not counting stuck ones.
+        struct scan_job *jobs;          ///< The current scan's jobs, in directory order.
+        size_t jobs_n;                  ///< Amount of jobs available to workers.
+        size_t jobs_cap;                ///< Allocated capacity of jobs.
+        size_t next;                    ///< Index of the next job to hand out.
+        size_t remaining;               ///< Amount of jobs which are neither done nor timed out.
+        unsigned long generation;       ///< Incremented at the start of every scan.
+        struct config *config;          ///< Program configuration.
+        int dir_fd;                     ///< The sysfs power supply directory (see supply_cache_open).
+        char stop;                      ///< Set to make the workers exit.
+};
+
+#ifdef HAVE_IO_URING
+#define SCAN_URING_ENTRIES                      (SCAN_URING_BATCH * SUPPLY_PREFETCH_NUM * 2) ///< Size of the io_uring submission queue: a read and a close for each file read ahead in a batch.
+
+/** Structure to hold the io_uring of batched scans, and what its batches use.
+ * The rings are shared with the kernel. */
+struct scan_uring {
+        int fd;                         ///< The io_uring's file descriptor.
+        void *sq_ring;                  ///< The mapped submission queue ring.
+        size_t sq_ring_size;            ///< Size of sq_ring.
+        void *cq_ring;                  ///< The mapped completion queue ring (sq_ring itself, with IORING_FEAT_SINGLE_MMAP).
+        size_t cq_ring_size;            ///< Size of cq_ring.
+        struct io_uring_sqe *sqes;      ///< The mapped submission queue entries.
+        size_t sqes_size;               ///< Size of sqes.
+        unsigned *sq_tail;              ///< The submission queue's tail.
+        unsigned *sq_mask;              ///< The submission queue's index mask.
+        unsigned *sq_array;             ///< The submission queue's indices into sqes.
+        unsigned *cq_head;              ///< The completion queue's head.
+        unsigned *cq_tail;              ///< The completion queue's tail.
+        unsigned *cq_mask;              ///< The completion queue's index mask.
+        struct io_uring_cqe *cqes;      ///< The completion queue's entries.
+        unsigned queued;                ///< Amount of entries queued for the next batch.
+        char broken;                    ///< Set if a batch failed, after which the io_uring isn't used again.
+        struct supply **supplies;       ///< The supplies of the current scan which may be batteries, in directory order.
+        size_t cap;                     ///< Allocated capacity of supplies.
+        int res[SCAN_URING_ENTRIES];    ///< The result of each entry of the last batch, indexed by user_data.
+        int fds[SCAN_URING_BATCH * SUPPLY_PREFETCH_NUM]; ///< The file descriptor of each file a batch reads (or SUPPLY_FD_*).
+        char once[SCAN_URING_BATCH * SUPPLY_PREFETCH_NUM]; ///< Whether each of those has to be closed after reading (see supply_read).
+        char paths[SCAN_URING_BATCH * SUPPLY_PREFETCH_NUM][SUPPLY_PATH_MAX]; ///< The path of each file a batch opens.
+        char bufs[SCAN_URING_BATCH * SUPPLY_PREFETCH_NUM][SYS_FS_READ_MAX + 1]; ///< The contents of each file a batch reads.
+};
+#endif
+
+#define OUTPUT_BUF_SIZE                         (16 * 1024) ///< Initial size of the output buffer.
+#define FIXED2_MAX                              2147483648.0 ///< Magnitude below which format_fixed2 handles a value itself.
+#define FIXED2_TIE_EPSILON                      1e-4 ///< Distance from a rounding boundary (in hundredths) within which format_fixed2 defers to printf. Far larger than the scaling error below FIXED2_MAX.
+#define FIXED2_BUF_SIZE                         16 ///< Size of the buffer needed by format_fixed2.
+#define OUTPUT_PLAIN_LABEL_WIDTH                30 ///< Width of a label (including the ':' and padding) in plain output.
+
+/** Structure to hold a buffer which output is rendered into before being
+ * written. */
+struct outbuf {
+        char *data;                     ///< The buffer.
+        size_t len;                     ///< Length of the buffer's contents.
+        size_t cap;                     ///< Allocated capacity of the buffer.
+};
+
+/** Structure to hold the precomputed forms of a field's label in each output
+ * format. */
+struct output_label {
+        const char *name;               ///< The name, as used in the CSV header.
+        const char *plain;              ///< The plain label, at least OUTPUT_PLAIN_LABEL_WIDTH characters long (only that many are used).
+        const char *json;               ///< The JSON separator and key, up to the value.
+        size_t json_len;                ///< The length of json.
+        const char *ndjson;             ///< The NDJSON separator and key, up to the value.
+        size_t ndjson_len;              ///< The length of ndjson.
+};
+
+/** Macro to build a field's output_label at compile time. The plain label is
+ * the name and a colon, padded with spaces to OUTPUT_PLAIN_LABEL_WIDTH
+ * characters (names must be shorter than that). */
+#define OUTPUT_LABEL(name) { \
+                name, \
+                name ":                              ", \
+                ",\n\t\t\"" name "\": ", \
+                sizeof(",\n\t\t\"" name "\": ") - 1, \
+                ",\"" name "\":", \
+                sizeof(",\"" name "\":") - 1 \
+        }
+
+/** Type of a routine which outputs a field's value (without its label).
+ * \param value A pointer to the field in a struct battery_info.
+ */
+typedef void (*output_fn)(const void *value);
+
+/** Structure to hold one step of an output plan: a field's label and the
+ * routine which outputs its value, both already chosen for the output format
+ * and configuration. */
+struct output_step {
+        const char *label;              ///< The label, as output.
+        size_t label_len;               ///< The length of label.
+        size_t offset;                  ///< The field's offset in struct battery_info.
+        output_fn fn;                   ///< The routine which outputs the field's value.
+};
+
+/** Structure to hold an output sequence compiled by output_plan_compile, so
+ * that outputting a battery doesn't have to look at the sequence, the format
+ * or the configuration flags again, and the state of the output it's used
+ * for. */
+struct output_plan {
+        const char *infostr;            ///< The output sequence.
+        struct output_step *steps;      ///< The steps, one per character of infostr.
+        size_t n;                       ///< Amount of steps.
+        char *header;                   ///< The CSV header line, or NULL for other formats.
+        size_t header_len;              ///< The length of header.
+        int header_done;                ///< Whether the CSV header has been output (it only ever is once).
+        unsigned long records;          ///< Amount of records output since battery_info_output_init.
+        size_t record;                  ///< Offset in the output buffer of the last record, after any header or separator before it.
+};
+
+#define OUTPUT_PLAN_INIT { NULL, NULL, 0, NULL, 0, 0, 0, 0 } ///< Initializer for an output plan which hasn't been compiled.
+
+/** Structure to hold sampling statistics for watch mode. Lateness is the
+ * amount of time between when a sample was scheduled and when it was taken. */
+struct watch_stats {
+        unsigned long samples;  ///< Amount of samples taken.
+        unsigned long missed;   ///< Amount of scheduled samples which were skipped because a previous one overran.
+        int64_t min_late;       ///< Minimum lateness, in nanoseconds.
+        int64_t max_late;       ///< Maximum lateness, in nanoseconds.
+        int64_t total_late;     ///< Sum of all lateness values, in nanoseconds.
+};
+
+/** The numbers which rolling statistics are kept of (see rolling_update). */
+enum {
+        ROLLING_VOLTAGE,
+        ROLLING_CURRENT,
+        ROLLING_TEMPERATURE,
+        ROLLING_NUM
+};
+
+/** Structure to hold the rolling statistics of one of a battery's numbers, as
+ * output. */
+struct rolling_values {
+        double avg;                     ///< Exponentially weighted moving average.
+        double min;                     ///< Minimum over the window.
+        double max;                     ///< Maximum over the window.
+        double stddev;                  ///< Standard deviation over the window.
+};
+
+/** Structure to hold the state of the rolling statistics of one of a
+ * battery's numbers, over the last -W samples in which it was known. The
+ * window's values are kept in a ring indexed by sample number, and its minimum
+ * and maximum at the front of two monotonic deques of sample numbers (each a
+ * ring too, as neither ever holds more than the window). */
+struct rolling_stat {
+        double *ring;                   ///< The window's values, by sample number modulo the window.
+        uint64_t *min_q;                ///< Sample numbers whose values only increase from the front to the back.
+        uint64_t *max_q;                ///< Sample numbers whose values only decrease from the front to the back.
+        size_t min_front;               ///< Index of the front of min_q.
+        size_t min_len;                 ///< Amount of sample numbers in min_q.
+        size_t max_front;               ///< Index of the front of max_q.
+        size_t max_len;                 ///< Amount of sample numbers in max_q.
+        uint64_t samples;               ///< Amount of values added (so the next one's sample number).
+        double avg;                     ///< Exponentially weighted moving average.
+        double mean;                    ///< Mean of the window's values (Welford).
+        double m2;                      ///< Sum of the squares of the window's values' differences from mean (Welford).
+};
+
+/** Structure to hold the trend of a battery's charge over the last -W samples
+ * in which it was known, as the sums of a least squares fit of the charge
+ * against time, over rings of the window's samples. Times are kept relative
+ * to base, which moves forward every -W samples, so that they stay small, and
+ * charges relative to the first one, so that a flat charge sums to exactly
+ * zero. */
+struct rolling_trend {
+        double *times;                  ///< The window's times, relative to base, by sample number modulo the window.
+        double *levels;                 ///< The window's charges, relative to level_base, by sample number modulo the window.
+        uint64_t samples;               ///< Amount of samples added since the trend was started.
+        double base;                    ///< The time which times are relative to, in seconds since the epoch.
+        double level_base;              ///< The charge which levels are relative to (0-100%).
+        double st;                      ///< Sum of the window's times.
+        double sl;                      ///< Sum of the window's charges.
+        double stt;                     ///< Sum of the squares of the window's times.
+        double stl;                     ///< Sum of the products of the window's times and charges.
+        char status[ROLLING_STATUS_MAX]; ///< The battery's status when the trend was started (the trend starts again when it changes).
+};
+
+/** Structure to hold a battery's rolling statistics. It is allocated in one
+ * piece, with the rings of each rolling_stat and of the trend after it. */
+struct rolling {
+        size_t window;                  ///< Size of the window, in samples.
+        struct rolling_stat stats[ROLLING_NUM]; ///< Each number's statistics.
+        struct rolling_trend trend;     ///< The charge's trend.
+};
+
 /** Structure to hold information about a specific battery. */
 struct battery_info {
         double charge;         ///< Current battery charge (0-100%).
@@ -212,6 +838,7 @@ struct battery_info {
         double current;        ///< Current battery current.
         double temperature;    ///< Current battery temperature.
         double etd;            ///< Estimated Time until Discharge, i.e: the (estimated) amount of time left until the battery is completely discharged.
+        double time;           ///< When the information was read, in seconds since the epoch.
 
         char *name;            ///< Battery name (as per what the system gave it).
         char *model;           ///< Battery model.
@@ -227,8 +854,373 @@ struct battery_info {
         char present;          ///< Is the battery present?
         char online;           ///< Is the battery online?
         char charging_enabled; ///< Does the battery have charging enabled?
+
+        long values[ATTR_LONG_NUM]; ///< The numeric attributes which the above were worked out from, as read (LONG_INVALID if unknown).
+
+        struct rolling_values rolling[ROLLING_NUM]; ///< Rolling statistics of the voltage, current and temperature, or DOUBLE_INVALID if not kept (see rolling_update).
+        double time_to_empty;  ///< Hours until the battery is empty, going by the trend of its charge over the last -W samples (or DOUBLE_INVALID if it isn't discharging, or no trend is kept).
+        double time_to_full;   ///< Hours until the battery is full, in the same way.
+};
+
+/** Header of a --record history log. It is followed by the names of the
+ * supplies which blocks refer to, and then by the blocks, in the order they
+ * were written (so by time). */
+struct history_header {
+        uint32_t magic;                 ///< HISTORY_MAGIC.
+        uint32_t version;               ///< HISTORY_VERSION.
+        uint32_t block_size;            ///< HISTORY_BLOCK_SIZE.
+        uint32_t supplies_n;            ///< Amount of supply names in use.
+        uint64_t blocks;                ///< Amount of blocks written, including the one still being filled.
+        uint64_t dropped;               ///< Batteries which weren't written, because there were too many supplies to name.
+        uint8_t reserved[32];           ///< Zero.
+} __attribute__((aligned(64)));
+
+/** The first page of a history log. */
+struct history_file {
+        struct history_header header;   ///< The header.
+        char names[HISTORY_MAX_SUPPLIES][HISTORY_NAME_MAX]; ///< The supplies' names (each NUL-terminated).
+};
+
+/** A block of consecutive samples of the same batteries in a history log.
+ * data holds the index of each battery's name, and then the columns: the
+ * samples' times, followed by each battery's HISTORY_FIELDS raw values. Each
+ * column is its length in bytes as a varint, and then one token per sample
+ * (see history_column_add), so a reader can skip the columns it doesn't need.
+ * Blocks are all the same size, so their headers double as an index which
+ * can be binary searched by time. */
+struct history_block {
+        uint64_t seq;                   ///< Sequence number: odd while the block is being rewritten. Only the last block ever is.
+        int64_t first_time;             ///< When the first sample was read (CLOCK_REALTIME, in milliseconds).
+        int64_t last_time;              ///< When the last sample was read.
+        uint16_t samples;               ///< Amount of samples.
+        uint16_t len;                   ///< Amount of data in use.
+        uint8_t supplies_n;             ///< Amount of batteries in each sample.
+        uint8_t reserved[3];            ///< Zero.
+        uint8_t data[HISTORY_BLOCK_SIZE - 32]; ///< The batteries' name indices, and the columns.
+};
+
+/** Structure to hold one column of the block being filled in a history log,
+ * as it is encoded. */
+struct history_column {
+        uint8_t *data;                  ///< The encoded tokens (room for HISTORY_COLUMN_CAP bytes).
+        size_t len;                     ///< Amount of data in use.
+        int64_t prev;                   ///< The last value added.
+        int64_t prev_delta;             ///< The difference between the last two values added (only used for times).
+        uint32_t run;                   ///< Amount of zero residuals added after data, which aren't encoded yet.
+};
+
+/** Structure to hold a history log which is open for appending. */
+struct history {
+        const char *path;               ///< The log's path.
+        int fd;                         ///< The log's file, locked for as long as it is open.
+        struct history_file *file;      ///< The mapped file.
+        size_t cap;                     ///< Amount of blocks the file has room for.
+        struct history_column *columns; ///< The columns of the block being filled.
+        struct history_column *saved;   ///< Copies of columns taken before each sample, to undo it if the block overflows.
+        size_t columns_cap;             ///< Allocated capacity of columns and saved.
+        uint8_t *column_data;           ///< Storage for every column's data.
+        uint64_t block;                 ///< Index of the block being filled.
+        int64_t first_time;             ///< When the block's first sample was read (in milliseconds).
+        int64_t last_time;              ///< When its last sample was read.
+        uint32_t samples;               ///< Amount of samples in the block (0 if there isn't one yet).
+        uint32_t supplies_n;            ///< Amount of batteries in each of the block's samples.
+        uint8_t supplies[HISTORY_MAX_SUPPLIES]; ///< The index of each battery's name.
+};
+
+/** Structure to hold the position of a reader in a column of a history log
+ * block. */
+struct history_cursor {
+        const uint8_t *p;               ///< The next token.
+        const uint8_t *end;             ///< The end of the column.
+        int64_t prev;                   ///< The last value read.
+        int64_t prev_delta;             ///< The difference between the last two values read (only used for times).
+        uint64_t run;                   ///< Amount of zero residuals left in the current run.
+};
+
+/** The numbers which --query aggregates. */
+enum {
+        QUERY_CHARGE,
+        QUERY_MAX_CHARGE,
+        QUERY_VOLTAGE,
+        QUERY_CURRENT,
+        QUERY_TEMPERATURE,
+        QUERY_ETD,
+        QUERY_NUM
+};
+
+#define QUERY_STATUSES_NUM                      (HISTORY_STATUSES_NUM - 1) ///< Statuses which --query counts the time spent in (every recordable one but "none", which is counted as "Unknown").
+#define QUERY_QUANTILES_NUM                     3 ///< Percentiles of the current which --query estimates.
+
+/** Structure to hold the minimum, mean and maximum of a number over a bucket
+ * of a --query. */
+struct query_agg {
+        double min;                     ///< The minimum, or DOUBLE_INVALID if the number was never known.
+        double mean;                    ///< The mean.
+        double max;                     ///< The maximum.
+};
+
+/** Structure to hold what --query outputs for a battery, for a bucket. */
+struct query_stats {
+        char *name;                     ///< Battery name.
+        double start;                   ///< When the bucket starts, in seconds since the epoch.
+        double end;                     ///< When the bucket ends.
+        unsigned long samples;          ///< Amount of samples of the battery in the bucket.
+        struct query_agg aggs[QUERY_NUM]; ///< Each QUERY_* number's aggregates.
+        double current_p[QUERY_QUANTILES_NUM]; ///< Estimated percentiles of the current (see query_quantiles).
+        double status_time[QUERY_STATUSES_NUM]; ///< Seconds spent in each status, in history_statuses order.
+};
+
+/** Structure to hold a P-square estimator of a quantile: five markers, whose
+ * heights approximate the minimum, the quantile halfway to it, the quantile,
+ * the one halfway to the maximum, and the maximum, adjusted as values are
+ * added, so that no values need to be kept. */
+struct quantile {
+        double p;                       ///< The quantile estimated (0-1).
+        double q[5];                    ///< The markers' heights.
+        double n[5];                    ///< The markers' positions.
+        double want[5];                 ///< The markers' desired positions.
+        unsigned long count;            ///< Amount of values added.
+};
+
+/** Structure to hold the running aggregates of a battery over the current
+ * bucket of a --query. */
+struct query_acc {
+        unsigned long samples;          ///< Amount of samples.
+        double min[QUERY_NUM];          ///< Each number's minimum.
+        double max[QUERY_NUM];          ///< Each number's maximum.
+        double sum[QUERY_NUM];          ///< Each number's sum.
+        unsigned long n[QUERY_NUM];     ///< Amount of samples in which each number was known.
+        struct quantile current_p[QUERY_QUANTILES_NUM]; ///< Estimators of the current's percentiles.
+        int64_t status_time[QUERY_STATUSES_NUM]; ///< Milliseconds spent in each status.
+};
+
+/** Structure to hold the state of a battery over a --query. */
+struct query_supply {
+        struct query_acc acc;           ///< Aggregates over the current bucket.
+        int64_t last_time;              ///< When the last sample was read (in milliseconds), or INT64_MIN.
+        int64_t last_interval;          ///< The interval between the last two samples (0 if there haven't been two).
+        int last_status;                ///< The status in the last sample, from 0 to QUERY_STATUSES_NUM - 1.
+};
+
+/** Structure to hold samples decoded by --query, laid out a column per
+ * number per battery, so that each can be aggregated in one pass. */
+struct query_chunk {
+        size_t n;                       ///< Amount of samples.
+        uint32_t supplies_n;            ///< Amount of batteries in each sample.
+        uint8_t supplies[HISTORY_MAX_SUPPLIES]; ///< The index of each battery's name.
+        int64_t time[QUERY_CHUNK];      ///< When each sample was read (in milliseconds).
+        double values[HISTORY_MAX_SUPPLIES][QUERY_NUM][QUERY_CHUNK]; ///< Each battery's numbers.
+        uint8_t status[HISTORY_MAX_SUPPLIES][QUERY_CHUNK]; ///< Each battery's status (as a status_time index).
+};
+
+#define UEVENT_KEY_PREFIX                       "POWER_SUPPLY_" ///< Prefix of every power supply property key in uevent files.
+#define UEVENT_KEY_PREFIX_LEN                   (sizeof(UEVENT_KEY_PREFIX) - 1)
+#define DEVICE_UEVENT_DRIVER_KEY                "DRIVER=" ///< Key of the driver name in device/uevent files, including the '='.
+#define DEVICE_UEVENT_DRIVER_KEY_LEN            (sizeof(DEVICE_UEVENT_DRIVER_KEY) - 1)
+
+/** Structure to describe an individual sysfs attribute. */
+struct attr_desc {
+        const char *file;      ///< The attribute's file name, relative to the supply's directory.
+        const char *key;       ///< The attribute's key in uevent files, including the trailing '='.
+        size_t key_len;        ///< The length of key, which is also the offset of the value in a uevent line.
+        size_t offset;         ///< For string attributes, the offset of the corresponding field in struct battery_info.
+};
+
+#define ATTR_DESC(file, key, offset) { file, UEVENT_KEY_PREFIX key "=", sizeof(UEVENT_KEY_PREFIX key "=") - 1, offset }
+
+/** Descriptions of each ATTR_* attribute. */
+static const struct attr_desc attr_descs[ATTR_NUM] = {
+        [ATTR_CAPACITY]           = ATTR_DESC("capacity", "CAPACITY", 0),
+        [ATTR_CHARGE_NOW]         = ATTR_DESC("charge_now", "CHARGE_NOW", 0),
+        [ATTR_CHARGE_FULL]        = ATTR_DESC("charge_full", "CHARGE_FULL", 0),
+        [ATTR_CHARGE_FULL_DESIGN] = ATTR_DESC("charge_full_design", "CHARGE_FULL_DESIGN", 0),
+        [ATTR_VOLTAGE_NOW]        = ATTR_DESC("voltage_now", "VOLTAGE_NOW", 0),
+        [ATTR_CURRENT_NOW]        = ATTR_DESC("current_now", "CURRENT_NOW", 0),
+        [ATTR_TEMP]               = ATTR_DESC("temp", "TEMP", 0),
+        [ATTR_PRESENT]            = ATTR_DESC("present", "PRESENT", 0),
+        [ATTR_ONLINE]             = ATTR_DESC("online", "ONLINE", 0),
+        [ATTR_CHARGING_ENABLED]   = ATTR_DESC("charging_enabled", "CHARGING_ENABLED", 0),
+        [ATTR_NAME]               = ATTR_DESC(NULL, "NAME", offsetof(struct battery_info, name)), // always the directory entry's name
+        [ATTR_MODEL_NAME]         = ATTR_DESC("model_name", "MODEL_NAME", offsetof(struct battery_info, model)),
+        [ATTR_MANUFACTURER]       = ATTR_DESC("manufacturer", "MANUFACTURER", offsetof(struct battery_info, manufacturer)),
+        [ATTR_TECHNOLOGY]         = ATTR_DESC("technology", "TECHNOLOGY", offsetof(struct battery_info, technology)),
+        [ATTR_STATUS]             = ATTR_DESC("status", "STATUS", offsetof(struct battery_info, status)),
+        [ATTR_HEALTH]             = ATTR_DESC("health", "HEALTH", offsetof(struct battery_info, health)),
+        [ATTR_SERIAL_NUMBER]      = ATTR_DESC("serial_number", "SERIAL_NUMBER", offsetof(struct battery_info, serial_number)),
+        [ATTR_CHARGE_TYPE]        = ATTR_DESC("charge_type", "CHARGE_TYPE", offsetof(struct battery_info, charge_type)),
+        [ATTR_CHARGE_RATE]        = ATTR_DESC("charge_rate", "CHARGE_RATE", offsetof(struct battery_info, charge_rate)),
+};
+
+#undef ATTR_DESC
+
+/** Perfect hash of a uevent key, without UEVENT_KEY_PREFIX and the '='. The
+ * multipliers were found by brute force so that every key in attr_descs lands
+ * in a different one of 32 slots; unknown keys may land anywhere, so a match
+ * must be confirmed against attr_descs.
+ * \param k The key.
+ * \param len The key's length (at least 2).
+ */
+#define uevent_key_hash(k, len) ((((unsigned char) (k)[0]) * 5 + ((unsigned char) (k)[(len) - 2]) + (len) * 10) & 31)
+
+/** Table mapping uevent_key_hash values to ATTR_* attributes, plus one (zero
+ * meaning no attribute). Regenerate this if an attribute is added. */
+static const signed char uevent_key_slots[32] = {
+        [2] = ATTR_CHARGE_NOW + 1,
+        [4] = ATTR_PRESENT + 1,
+        [6] = ATTR_SERIAL_NUMBER + 1,
+        [9] = ATTR_CHARGE_FULL + 1,
+        [10] = ATTR_CHARGE_FULL_DESIGN + 1,
+        [11] = ATTR_VOLTAGE_NOW + 1,
+        [12] = ATTR_CURRENT_NOW + 1,
+        [13] = ATTR_CHARGE_TYPE + 1,
+        [15] = ATTR_TECHNOLOGY + 1,
+        [16] = ATTR_STATUS + 1,
+        [17] = ATTR_CHARGE_RATE + 1,
+        [18] = ATTR_MODEL_NAME + 1,
+        [19] = ATTR_CAPACITY + 1,
+        [20] = ATTR_CHARGING_ENABLED + 1,
+        [21] = ATTR_ONLINE + 1,
+        [24] = ATTR_HEALTH + 1,
+        [25] = ATTR_TEMP + 1,
+        [27] = ATTR_NAME + 1,
+        [30] = ATTR_MANUFACTURER + 1,
 };
 
+#define attr_str_field(info, a) ((char**) ((char*) (info) + attr_descs[a].offset)) ///< Macro to get a pointer to the battery_info field for string attribute a.
+
+/** Types of the fields which can be output. */
+enum {
+        FIELD_STR,              ///< A string (char*), or NULL if unknown.
+        FIELD_DOUBLE,           ///< A double, or DOUBLE_INVALID if unknown.
+        FIELD_PERCENT,          ///< A double which is a percentage.
+        FIELD_CHARGE,           ///< A percentage which is capped at 100% (unless -N is given).
+        FIELD_FLAG,             ///< A flag (char: 1, 0, or -1 if unknown).
+        FIELD_FLAG_DIGITS,      ///< A flag, output as digits (only used in output plans, for FIELD_FLAG with -d).
+        FIELD_COUNT,            ///< A count (unsigned long).
+        FIELD_NUM
+};
+
+/** Structure to describe a character of an output sequence. */
+struct output_field {
+        char c;                         ///< The character.
+        int type;                       ///< The field's FIELD_* type.
+        size_t offset;                  ///< The field's offset in struct battery_info (or in struct query_stats, for --query).
+        struct output_label label;      ///< The field's label.
+        uint32_t attrs;                 ///< The ATTR_MASK_* attributes needed to output the field.
+};
+
+#define OUTPUT_FIELD(c, type, member, attrs) { c, type, offsetof(struct battery_info, member), OUTPUT_LABEL(#member), attrs }
+#define ROLLING_FIELD(c, num, member, name, attrs) { c, FIELD_DOUBLE, offsetof(struct battery_info, rolling[num].member), OUTPUT_LABEL(name), attrs }
+
+/** The fields which can be output, in COMPLETE_OUTPUT_SEQUENCE order (then
+ * x, which -a leaves out so that its output doesn't change between runs, and
+ * the rolling statistics, which it leaves out as they only mean something
+ * over several samples). This is what output sequences are checked against,
+ * what decides which attributes they need read, and what they're compiled
+ * from. Several fields can share a character. */
+static const struct output_field output_fields[] = {
+        OUTPUT_FIELD('n', FIELD_STR, name, ATTR_MASK(ATTR_NAME)),
+        // charge_now and charge_full are only read if capacity is unusable
+        OUTPUT_FIELD('c', FIELD_CHARGE, charge, ATTR_MASK(ATTR_CAPACITY)),
+        OUTPUT_FIELD('t', FIELD_PERCENT, max_charge, ATTR_MASK(ATTR_CHARGE_FULL) | ATTR_MASK(ATTR_CHARGE_FULL_DESIGN)),
+        OUTPUT_FIELD('v', FIELD_DOUBLE, voltage, ATTR_MASK(ATTR_VOLTAGE_NOW)),
+        OUTPUT_FIELD('C', FIELD_DOUBLE, current, ATTR_MASK(ATTR_CURRENT_NOW)),
+        OUTPUT_FIELD('T', FIELD_DOUBLE, temperature, ATTR_MASK(ATTR_TEMP)),
+        OUTPUT_FIELD('d', FIELD_STR, driver, ATTR_MASK_DRIVER),
+        OUTPUT_FIELD('m', FIELD_STR, model, ATTR_MASK(ATTR_MODEL_NAME)),
+        OUTPUT_FIELD('M', FIELD_STR, manufacturer, ATTR_MASK(ATTR_MANUFACTURER)),
+        OUTPUT_FIELD('e', FIELD_STR, technology, ATTR_MASK(ATTR_TECHNOLOGY)),
+        OUTPUT_FIELD('s', FIELD_STR, status, ATTR_MASK(ATTR_STATUS)),
+        OUTPUT_FIELD('h', FIELD_STR, health, ATTR_MASK(ATTR_HEALTH)),
+        OUTPUT_FIELD('S', FIELD_STR, serial_number, ATTR_MASK(ATTR_SERIAL_NUMBER)),
+        OUTPUT_FIELD('H', FIELD_STR, charge_type, ATTR_MASK(ATTR_CHARGE_TYPE)),
+        OUTPUT_FIELD('r', FIELD_STR, charge_rate, ATTR_MASK(ATTR_CHARGE_RATE)),
+        OUTPUT_FIELD('p', FIELD_FLAG, present, ATTR_MASK(ATTR_PRESENT)),
+        OUTPUT_FIELD('o', FIELD_FLAG, online, ATTR_MASK(ATTR_ONLINE)),
+        OUTPUT_FIELD('g', FIELD_FLAG, charging_enabled, ATTR_MASK(ATTR_CHARGING_ENABLED)),
+        OUTPUT_FIELD('D', FIELD_DOUBLE, etd, ATTR_MASK(ATTR_CHARGE_NOW) | ATTR_MASK(ATTR_CHARGE_FULL) | ATTR_MASK(ATTR_CURRENT_NOW)),
+        OUTPUT_FIELD('x', FIELD_DOUBLE, time, 0),
+        ROLLING_FIELD('V', ROLLING_VOLTAGE, avg, "voltage_avg", ATTR_MASK(ATTR_VOLTAGE_NOW)),
+        ROLLING_FIELD('V', ROLLING_VOLTAGE, min, "voltage_min", ATTR_MASK(ATTR_VOLTAGE_NOW)),
+        ROLLING_FIELD('V', ROLLING_VOLTAGE, max, "voltage_max", ATTR_MASK(ATTR_VOLTAGE_NOW)),
+        ROLLING_FIELD('V', ROLLING_VOLTAGE, stddev, "voltage_stddev", ATTR_MASK(ATTR_VOLTAGE_NOW)),
+        ROLLING_FIELD('A', ROLLING_CURRENT, avg, "current_avg", ATTR_MASK(ATTR_CURRENT_NOW)),
+        ROLLING_FIELD('A', ROLLING_CURRENT, min, "current_min", ATTR_MASK(ATTR_CURRENT_NOW)),
+        ROLLING_FIELD('A', ROLLING_CURRENT, max, "current_max", ATTR_MASK(ATTR_CURRENT_NOW)),
+        ROLLING_FIELD('A', ROLLING_CURRENT, stddev, "current_stddev", ATTR_MASK(ATTR_CURRENT_NOW)),
+        ROLLING_FIELD('K', ROLLING_TEMPERATURE, avg, "temperature_avg", ATTR_MASK(ATTR_TEMP)),
+        ROLLING_FIELD('K', ROLLING_TEMPERATURE, min, "temperature_min", ATTR_MASK(ATTR_TEMP)),
+        ROLLING_FIELD('K', ROLLING_TEMPERATURE, max, "temperature_max", ATTR_MASK(ATTR_TEMP)),
+        ROLLING_FIELD('K', ROLLING_TEMPERATURE, stddev, "temperature_stddev", ATTR_MASK(ATTR_TEMP)),
+        OUTPUT_FIELD('E', FIELD_DOUBLE, time_to_empty, ATTR_MASK(ATTR_CAPACITY) | ATTR_MASK(ATTR_CHARGE_NOW) | ATTR_MASK(ATTR_CHARGE_FULL) | ATTR_MASK(ATTR_STATUS)),
+        OUTPUT_FIELD('E', FIELD_DOUBLE, time_to_full, ATTR_MASK(ATTR_CAPACITY) | ATTR_MASK(ATTR_CHARGE_NOW) | ATTR_MASK(ATTR_CHARGE_FULL) | ATTR_MASK(ATTR_STATUS)),
+};
+
+#undef OUTPUT_FIELD
+#undef ROLLING_FIELD
+
+#define OUTPUT_FIELDS_NUM (sizeof(output_fields) / sizeof(output_fields[0]))
+
+#define QUERY_FIELD(c, type, member, name) { c, type, offsetof(struct query_stats, member), OUTPUT_LABEL(name), 0 }
+
+/** The fields which --query can output. Each character of its output sequence
+ * stands for every field here with that character, in this order. */
+static const struct output_field query_fields[] = {
+        QUERY_FIELD('n', FIELD_STR, name, "name"),
+        QUERY_FIELD('x', FIELD_DOUBLE, start, "start"),
+        QUERY_FIELD('x', FIELD_DOUBLE, end, "end"),
+        QUERY_FIELD('x', FIELD_COUNT, samples, "samples"),
+        QUERY_FIELD('c', FIELD_CHARGE, aggs[QUERY_CHARGE].min, "charge_min"),
+        QUERY_FIELD('c', FIELD_CHARGE, aggs[QUERY_CHARGE].mean, "charge_mean"),
+        QUERY_FIELD('c', FIELD_CHARGE, aggs[QUERY_CHARGE].max, "charge_max"),
+        QUERY_FIELD('t', FIELD_PERCENT, aggs[QUERY_MAX_CHARGE].min, "max_charge_min"),
+        QUERY_FIELD('t', FIELD_PERCENT, aggs[QUERY_MAX_CHARGE].mean, "max_charge_mean"),
+        QUERY_FIELD('t', FIELD_PERCENT, aggs[QUERY_MAX_CHARGE].max, "max_charge_max"),
+        QUERY_FIELD('v', FIELD_DOUBLE, aggs[QUERY_VOLTAGE].min, "voltage_min"),
+        QUERY_FIELD('v', FIELD_DOUBLE, aggs[QUERY_VOLTAGE].mean, "voltage_mean"),
+        QUERY_FIELD('v', FIELD_DOUBLE, aggs[QUERY_VOLTAGE].max, "voltage_max"),
+        QUERY_FIELD('C', FIELD_DOUBLE, aggs[QUERY_CURRENT].min, "current_min"),
+        QUERY_FIELD('C', FIELD_DOUBLE, aggs[QUERY_CURRENT].mean, "current_mean"),
+        QUERY_FIELD('C', FIELD_DOUBLE, aggs[QUERY_CURRENT].max, "current_max"),
+        QUERY_FIELD('C', FIELD_DOUBLE, current_p[0], "current_p50"),
+        QUERY_FIELD('C', FIELD_DOUBLE, current_p[1], "current_p90"),
+        QUERY_FIELD('C', FIELD_DOUBLE, current_p[2], "current_p99"),
+        QUERY_FIELD('T', FIELD_DOUBLE, aggs[QUERY_TEMPERATURE].min, "temperature_min"),
+        QUERY_FIELD('T', FIELD_DOUBLE, aggs[QUERY_TEMPERATURE].mean, "temperature_mean"),
+        QUERY_FIELD('T', FIELD_DOUBLE, aggs[QUERY_TEMPERATURE].max, "temperature_max"),
+        QUERY_FIELD('D', FIELD_DOUBLE, aggs[QUERY_ETD].min, "etd_min"),
+        QUERY_FIELD('D', FIELD_DOUBLE, aggs[QUERY_ETD].mean, "etd_mean"),
+        QUERY_FIELD('D', FIELD_DOUBLE, aggs[QUERY_ETD].max, "etd_max"),
+        QUERY_FIELD('s', FIELD_DOUBLE, status_time[0], "time_unknown"),
+        QUERY_FIELD('s', FIELD_DOUBLE, status_time[1], "time_charging"),
+        QUERY_FIELD('s', FIELD_DOUBLE, status_time[2], "time_discharging"),
+        QUERY_FIELD('s', FIELD_DOUBLE, status_time[3], "time_not_charging"),
+        QUERY_FIELD('s', FIELD_DOUBLE, status_time[4], "time_full"),
+};
+
+#undef QUERY_FIELD
+
+#define QUERY_FIELDS_NUM (sizeof(query_fields) / sizeof(query_fields[0]))
+
+/** Routine to look up an output sequence character's field.
+ * \param c The character.
+ * \return A pointer to the field, or NULL if c isn't a valid output sequence
+ * character.
+ */
+static const struct output_field *
+output_field_find(char c)
+{
+        size_t i;
+
+        for (i = 0; i < OUTPUT_FIELDS_NUM; i++) {
+                if (output_fields[i].c == c) {
+                        return &output_fields[i];
+                }
+        }
+
+        return NULL;
+}
+
 //------------------------------------------------------------------------------
 // _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
 //------------------------------------------------------------------------------
@@ -239,8 +1231,202 @@ struct battery_info {
 static void config_init(struct config *config)
 {
         config->configflags = 0;
-        config->output_format = OUTPUT_FORMAT_CSV;
-        config->cmdopts.n = NULL;
+        config->output_format = OUTPUT_FORMAT_PLAIN;
+        config->attrs = 0;
+        config->plan = NULL;
+        config->sys_fs_path = SYS_FS_BATTERY_BASE_PATH;
+        config->socket_path = DAEMON_SOCKET_PATH;
+        config->shm_path = NULL;
+        config->history_path = NULL;
+        config->history = NULL;
+        config->cmdopts.n.names = NULL;
+        config->cmdopts.n.n = 0;
+        config->cmdopts.n.patterns = NULL;
+        config->cmdopts.n.patterns_n = 0;
+        config->cmdopts.n.slots = NULL;
+        config->cmdopts.n.mask = 0;
+        config->cmdopts.w.tv_sec = 0;
+        config->cmdopts.w.tv_nsec = 0;
+        config->cmdopts.c = 0;
+        config->cmdopts.P = SCAN_POOL_DEFAULT_THREADS;
+        config->cmdopts.T.tv_sec = SCAN_DEFAULT_TIMEOUT_NS / NSEC_PER_SEC;
+        config->cmdopts.T.tv_nsec = SCAN_DEFAULT_TIMEOUT_NS % NSEC_PER_SEC;
+        config->cmdopts.A = 0;
+        config->cmdopts.s = INT64_MIN;
+        config->cmdopts.u = INT64_MAX;
+        config->cmdopts.b = 1;
+        config->cmdopts.W = ROLLING_DEFAULT_WINDOW;
+}
+
+/** Routine to set the power supply directory which is read, making sure that
+ * it ends in a '/'.
+ * \param config A pointer to the program configuration struct.
+ * \param path The directory.
+ * \return 0 on success, -1 if the path is empty or memory couldn't be
+ * allocated.
+ */
+static int
+set_sys_fs_path(struct config *config,
+                const char *path)
+{
+        size_t len = strlen(path);
+        if (len == 0) {
+                return -1;
+        }
+
+        if (path[len - 1] == '/') {
+                config->sys_fs_path = path;
+                return 0;
+        }
+
+        // this lives until the program exits
+        char *p = (char*) malloc(len + 2);
+        if (p == NULL) {
+                return -1;
+        }
+        memcpy(p, path, len);
+        p[len] = '/';
+        p[len + 1] = '\0';
+        config->sys_fs_path = p;
+
+        return 0;
+}
+
+/** Utility routine for hashing a name (32-bit FNV-1a).
+ * \param name The NUL-terminated name.
+ * \return The name's hash.
+ */
+static uint32_t
+name_hash(const char *name)
+{
+        uint32_t h = 2166136261u;
+        while (*name != '\0') {
+                h = (h ^ (uint8_t) *name++) * 16777619u;
+        }
+        return h;
+}
+
+/** Routine to add the names in an -n argument to a name set. The argument is
+ * split at commas, in place.
+ * \param set A pointer to the name set.
+ * \param arg The argument.
+ * \return 0 on success, -1 if one of the names is invalid (empty, "." or
+ * "..", or containing a '/'), or memory couldn't be allocated.
+ */
+static int
+name_set_add(struct name_set *set,
+             char *arg)
+{
+        char *name, *save = NULL;
+
+        if (*arg == '\0') {
+                return -1;
+        }
+
+        for (name = strtok_r(arg, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+                if (strchr(name, '/') != NULL || !strcmp(name, ".") || !strcmp(name, "..")) {
+                        return -1;
+                }
+
+                char ***list = &set->names;
+                size_t *n = &set->n;
+                if (strpbrk(name, "*?[") != NULL) {
+                        list = &set->patterns;
+                        n = &set->patterns_n;
+                }
+
+                char **p = (char**) realloc(*list, (*n + 1) * sizeof(char*));
+                if (p == NULL) {
+                        return -1;
+                }
+                p[(*n)++] = name;
+                *list = p;
+        }
+
+        return 0;
+}
+
+/** Routine to look up a plain name in a name set's hash table.
+ * \param set A pointer to the name set.
+ * \param name The name.
+ * \return A pointer to the name's slot: either holding the name, or empty.
+ */
+static const char **
+name_set_slot(const struct name_set *set,
+              const char *name)
+{
+        size_t i = name_hash(name) & set->mask;
+
+        while (set->slots[i] != NULL && strcmp(set->slots[i], name)) {
+                i = (i + 1) & set->mask;
+        }
+
+        return &set->slots[i];
+}
+
+/** Routine to build a name set's hash table, once every name has been added,
+ * dropping any duplicate names.
+ * \param set A pointer to the name set.
+ * \return 0 on success, -1 if memory couldn't be allocated.
+ */
+static int
+name_set_build(struct name_set *set)
+{
+        size_t size = 8, i, n = 0;
+        while (size < set->n * 2) size *= 2;
+
+        if ((set->slots = (const char**) calloc(size, sizeof(const char*))) == NULL) {
+                return -1;
+        }
+        set->mask = size - 1;
+
+        for (i = 0; i < set->n; i++) {
+                const char **slot = name_set_slot(set, set->names[i]);
+                if (*slot == NULL) {
+                        *slot = set->names[i];
+                        set->names[n++] = set->names[i];
+                }
+        }
+        set->n = n;
+
+        return 0;
+}
+
+/** Routine to check whether a directory entry's name is in a name set, either
+ * as a plain name or by matching one of the glob patterns.
+ * \param set A pointer to the name set.
+ * \param name The name.
+ * \return 1 if it is, 0 if it isn't.
+ */
+static int
+name_set_match(const struct name_set *set,
+               const char *name)
+{
+        size_t i;
+
+        if (*name_set_slot(set, name) != NULL) {
+                return 1;
+        }
+
+        for (i = 0; i < set->patterns_n; i++) {
+                if (fnmatch(set->patterns[i], name, FNM_PERIOD) == 0) {
+                        return 1;
+                }
+        }
+
+        return 0;
+}
+
+/** Routine to free the memory used by a name set. (The names themselves are
+ * the program's arguments.)
+ * \param set A pointer to the name set.
+ */
+static void
+name_set_cleanup(struct name_set *set)
+{
+        free_if_not_null(set->names);
+        free_if_not_null(set->patterns);
+        free_if_not_null(set->slots);
 }
 
 /** Routine to initialize a battery_info structure with blank values.
@@ -255,6 +1441,7 @@ battery_info_init(struct battery_info *info)
         info->current = DOUBLE_INVALID;
         info->temperature = DOUBLE_INVALID;
         info->etd = DOUBLE_INVALID;
+        info->time = DOUBLE_INVALID;
 
         info->name = NULL;
         info->model = NULL;
@@ -270,113 +1457,262 @@ battery_info_init(struct battery_info *info)
         info->present = -1;
         info->online = -1;
         info->charging_enabled = -1;
-}
 
-/** Routine to clean up a battery_info structure by freeing any allocated memory.
- * \param info A pointer to the structure to clean up.
- */
-static void
-battery_info_cleanup(struct battery_info *info)
-{
-        free_if_not_null(info->name);
-        free_if_not_null(info->model);
-        free_if_not_null(info->manufacturer);
-        free_if_not_null(info->technology);
-        free_if_not_null(info->driver);
-        free_if_not_null(info->status);
-        free_if_not_null(info->health);
-        free_if_not_null(info->serial_number);
-        free_if_not_null(info->charge_type);
-        free_if_not_null(info->charge_rate);
+        int a;
+        for (a = 0; a < ATTR_LONG_NUM; a++) {
+                info->values[a] = LONG_INVALID;
+        }
+        for (a = 0; a < ROLLING_NUM; a++) {
+                info->rolling[a].avg = DOUBLE_INVALID;
+                info->rolling[a].min = DOUBLE_INVALID;
+                info->rolling[a].max = DOUBLE_INVALID;
+                info->rolling[a].stddev = DOUBLE_INVALID;
+        }
+        info->time_to_empty = DOUBLE_INVALID;
+        info->time_to_full = DOUBLE_INVALID;
 }
 
 //------------------------------------------------------------------------------
 // _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
 //------------------------------------------------------------------------------
 
-#define output_n_spaces(n) do { \
-                size_t i = n; \
-                while (i-- > 0) fputc(' ', stdout); \
-        } while (0)
-#define output_csv_name() do { \
-                fputs(name, stdout); \
-                fputc(':', stdout); \
-                output_n_spaces(29 - strlen(name)); \
-        } while (0)
+static atomic_ulong alloc_count = 0; ///< Amount of heap allocations made through counted_realloc (by any thread).
 
-/** Output routine for the beginning of outputting all battery information.
- * \param config A pointer to the program configuration struct.
+/** Utility routine for allocating or resizing heap memory, which keeps count
+ * of how many times it has been called (realloc wrapper). Every allocation the
+ * program makes while scanning goes through this.
+ * \param p The memory to resize, or NULL to allocate new memory.
+ * \param size The new size, in bytes.
+ * \return A pointer to the memory, or NULL on error.
  */
-static void
-battery_info_output_init(struct config *config)
+static void *
+counted_realloc(void *p,
+                size_t size)
 {
-        switch (config->output_format) {
-                case OUTPUT_FORMAT_CSV: {
-                        break;
-                }
-                case OUTPUT_FORMAT_JSON: {
-                        fputs("{\n\"batteries\": [\n", stdout);
-                        break;
+        alloc_count++;
+        return realloc(p, size);
+}
+
+/** Output buffer. All battery information is rendered into this, and then
+ * written to stdout in one go by output_flush, instead of going through stdio
+ * a field at a time. */
+static struct outbuf output = { NULL, 0, 0 };
+
+/** Routine to make sure that the output buffer has room for more data.
+ * \param n The amount of bytes needed.
+ * \return A pointer to the end of the output buffer's contents, or NULL on
+ * error.
+ */
+static char *
+output_reserve(size_t n)
+{
+        if (output.len + n > output.cap) {
+                size_t cap = output.cap == 0 ? OUTPUT_BUF_SIZE : output.cap;
+                while (cap < output.len + n) cap *= 2;
+
+                char *data = (char*) counted_realloc(output.data, cap);
+                if (data == NULL) {
+                        return NULL;
                 }
-                default:
-                        break;
+                output.data = data;
+                output.cap = cap;
         }
+
+        return output.data + output.len;
 }
 
-/** Output routine for the end of outputting all battery information.
- * \param config A pointer to the program configuration struct.
+/** Routine to append data to the output buffer.
+ * \param p The data.
+ * \param n The amount of bytes of data.
  */
 static void
-battery_info_output_deinit(struct config *config)
+output_mem(const char *p,
+           size_t n)
 {
-        switch (config->output_format) {
-                case OUTPUT_FORMAT_CSV: {
-                        break;
-                }
-                case OUTPUT_FORMAT_JSON: {
-                        fputs("]\n}\n", stdout);
-                        break;
-                }
-                default:
-                        break;
+        char *dest = output_reserve(n);
+        if (dest != NULL) {
+                memcpy(dest, p, n);
+                output.len += n;
         }
 }
 
-/** Output routine for the beginning of outputting invividual battery
- * information.
- * \param battery The current battery.
- * \param config A pointer to the program configuration struct.
+#define output_lit(s) output_mem(s, sizeof(s) - 1) ///< Macro to append a string literal to the output buffer.
+
+/** Routine to append a string to the output buffer.
+ * \param s The NUL-terminated string.
  */
 static void
-battery_info_output_start(int battery,
-                          struct config *config)
+output_str(const char *s)
 {
-        switch (config->output_format) {
-                case OUTPUT_FORMAT_CSV: {
-                        printf("battery:                      %d\n", battery);
-                        break;
+        output_mem(s, strlen(s));
+}
+
+/** Routine to append an integer, in decimal, to the output buffer.
+ * \param n The integer.
+ */
+static void
+output_int(long n)
+{
+        char buf[24], *p = buf + sizeof(buf);
+        unsigned long u = n < 0 ? -(unsigned long) n : (unsigned long) n;
+
+        do {
+                *--p = (char) ('0' + u % 10);
+                u /= 10;
+        } while (u != 0);
+
+        if (n < 0) {
+                *--p = '-';
+        }
+
+        output_mem(p, (size_t) (buf + sizeof(buf) - p));
+}
+
+/** Routine to format a double with two decimal places, giving exactly the
+ * same result as printf's "%.2f", without going through printf.
+ *
+ * The value is scaled by 100 and rounded to the nearest integer. The scaling
+ * can be off by a tiny amount, which only matters when the scaled value is
+ * within that amount of a rounding boundary (x.5), where printf rounds the
+ * exact binary value; those values, and ones too large for the scaling to be
+ * accurate, are left to printf.
+ * \param d The double.
+ * \param buf The buffer to place the result in, at least FIXED2_BUF_SIZE
+ * bytes long. It isn't NUL-terminated.
+ * \return The length of the result, or -1 if printf should be used instead.
+ */
+static int
+format_fixed2(double d,
+              char *buf)
+{
+        if (!(d > -FIXED2_MAX && d < FIXED2_MAX)) { // also catches NaN
+                return -1;
+        }
+
+        int neg = signbit(d) != 0;
+        double scaled = (neg ? -d : d) * 100.0;
+        uint64_t r = (uint64_t) scaled;
+        double frac = scaled - (double) r;
+
+        if (frac > 0.5 - FIXED2_TIE_EPSILON && frac < 0.5 + FIXED2_TIE_EPSILON) {
+                return -1;
+        }
+        if (frac > 0.5) {
+                r++;
+        }
+
+        char tmp[FIXED2_BUF_SIZE], *p = tmp + sizeof(tmp);
+        *--p = (char) ('0' + r % 10);
+        *--p = (char) ('0' + r / 10 % 10);
+        *--p = '.';
+        r /= 100;
+        do {
+                *--p = (char) ('0' + r % 10);
+                r /= 10;
+        } while (r != 0);
+        if (neg) {
+                *--p = '-'; // printf keeps the sign of values which round to zero
+        }
+
+        int len = (int) (tmp + sizeof(tmp) - p);
+        memcpy(buf, p, (size_t) len);
+        return len;
+}
+
+/** Routine to append a double, with two decimal places, to the output buffer.
+ * \param d The double.
+ */
+static void
+output_double(double d)
+{
+        char *dest = output_reserve(64);
+        if (dest == NULL) {
+                return;
+        }
+
+        int n = format_fixed2(d, dest);
+        if (n >= 0) {
+                output.len += (size_t) n;
+                return;
+        }
+
+        n = snprintf(dest, 64, "%.2f", d);
+        if (n >= 64) {
+                // only very large values need more room than that
+                if ((dest = output_reserve((size_t) n + 1)) == NULL) {
+                        return;
                 }
-                case OUTPUT_FORMAT_JSON: {
-                        printf("\t{\n\t\t\"battery\": %d", battery);
-                        break;
+                snprintf(dest, (size_t) n + 1, "%.2f", d);
+        }
+
+        if (n > 0) {
+                output.len += (size_t) n;
+        }
+}
+
+/** Routine to write the contents of the output buffer to stdout with a single
+ * write (unless the write is interrupted or partial), and then empty it.
+ * \return 0 on success, -1 on error.
+ */
+static int
+output_flush(void)
+{
+        size_t off = 0;
+
+        while (off < output.len) {
+                ssize_t n = write(STDOUT_FILENO, output.data + off, output.len - off);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        output.len = 0;
+                        return -1;
                 }
-                default:
-                        break;
+                off += (size_t) n;
         }
+
+        output.len = 0;
+        return 0;
 }
 
-/** Output routine for the end of outputting invividual battery information.
+/** Routine to send the contents of the output buffer on a socket, and then
+ * empty it. Unlike output_flush, a peer which has gone away doesn't raise
+ * SIGPIPE.
+ * \param fd The socket.
+ * \return 0 on success, -1 on error.
+ */
+static int
+output_send(int fd)
+{
+        size_t off = 0;
+
+        while (off < output.len) {
+                ssize_t n = send(fd, output.data + off, output.len - off, MSG_NOSIGNAL);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        output.len = 0;
+                        return -1;
+                }
+                off += (size_t) n;
+        }
+
+        output.len = 0;
+        return 0;
+}
+
+/** Output routine for the beginning of outputting all battery information.
  * \param config A pointer to the program configuration struct.
  */
 static void
-battery_info_output_end(struct config *config)
+battery_info_output_init(struct config *config)
 {
+        config->plan->records = 0;
+
         switch (config->output_format) {
-                case OUTPUT_FORMAT_CSV: {
-                        break;
-                }
                 case OUTPUT_FORMAT_JSON: {
-                        fputs("\n\t},\n", stdout);
+                        output_lit("{\n\"batteries\": [\n");
                         break;
                 }
                 default:
@@ -384,32 +1720,18 @@ battery_info_output_end(struct config *config)
         }
 }
 
-/** Output routine for outputting a double value in the correct format.
- * \param d The value.
- * \param name The value's identifiable name.
+/** Output routine for the end of outputting all battery information.
  * \param config A pointer to the program configuration struct.
  */
 static void
-battery_info_output_double(double d,
-                           const char *name,
-                           struct config *config)
+battery_info_output_deinit(struct config *config)
 {
         switch (config->output_format) {
-                case OUTPUT_FORMAT_CSV: {
-                        output_csv_name();
-                        if (d != DOUBLE_INVALID) {
-                                printf("%.2f\n", d);
-                        } else {
-                                fputs("?\n", stdout);
-                        }
-                        break;
-                }
                 case OUTPUT_FORMAT_JSON: {
-                        printf(",\n\t\t\"%s\": ", name);
-                        if (d != DOUBLE_INVALID) {
-                                printf("%.2f", d);
+                        if (config->plan->records > 0) {
+                                output_lit("\n]\n}\n");
                         } else {
-                                fputs("null", stdout);
+                                output_lit("]\n}\n");
                         }
                         break;
                 }
@@ -418,69 +1740,57 @@ battery_info_output_double(double d,
         }
 }
 
-/** Output routine for outputting a double value in the correct format, as a
- * percentage.
- * \param d The value.
- * \param name The value's identifiable name.
+/** Output routine for the beginning of outputting invividual battery
+ * information.
+ * \param battery The current battery.
  * \param config A pointer to the program configuration struct.
  */
 static void
-battery_info_output_double_percent(double d,
-                                   const char *name,
-                                   struct config *config)
+battery_info_output_start(int battery,
+                          struct config *config)
 {
+        struct output_plan *plan = config->plan;
+
         switch (config->output_format) {
                 case OUTPUT_FORMAT_CSV: {
-                        output_csv_name();
-                        if (d != DOUBLE_INVALID) {
-                                printf("%.2f%%\n", d);
-                        } else {
-                                fputs("?\n", stdout);
+                        if (!plan->header_done) {
+                                output_mem(plan->header, plan->header_len);
+                                plan->header_done = 1;
                         }
                         break;
                 }
                 case OUTPUT_FORMAT_JSON: {
-                        // we don't want % signs in the JSON
-                        printf(",\n\t\t\"%s\": ", name);
-                        if (d != DOUBLE_INVALID) {
-                                printf("%.2f", d);
-                        } else {
-                                fputs("null", stdout);
+                        if (plan->records > 0) {
+                                output_lit(",\n");
                         }
                         break;
                 }
                 default:
                         break;
         }
-}
 
-/** Output routine for outputting a string in the correct format.
- * \param s The string.
- * \param name The string's identifiable name.
- * \param config A pointer to the program configuration struct.
- */
-static void
-battery_info_output_str(const char *s,
-                        const char *name,
-                        struct config *config)
-{
+        plan->record = output.len;
+        plan->records++;
+
         switch (config->output_format) {
+                case OUTPUT_FORMAT_PLAIN: {
+                        output_mem(((const struct output_label) OUTPUT_LABEL("battery")).plain, OUTPUT_PLAIN_LABEL_WIDTH);
+                        output_int(battery);
+                        output_lit("\n");
+                        break;
+                }
                 case OUTPUT_FORMAT_CSV: {
-                        output_csv_name();
-                        if (s == NULL) {
-                                fputs("?\n", stdout);
-                        } else {
-                                printf("%s\n", s);
-                        }
+                        output_int(battery);
                         break;
                 }
                 case OUTPUT_FORMAT_JSON: {
-                        printf(",\n\t\t\"%s\": ", name);
-                        if (s == NULL) {
-                                fputs("null", stdout);
-                        } else {
-                                printf("\"%s\"", s);
-                        }
+                        output_lit("\t{\n\t\t\"battery\": ");
+                        output_int(battery);
+                        break;
+                }
+                case OUTPUT_FORMAT_NDJSON: {
+                        output_lit("{\"battery\":");
+                        output_int(battery);
                         break;
                 }
                 default:
@@ -488,47 +1798,23 @@ battery_info_output_str(const char *s,
         }
 }
 
-/** Output routine for outputting a true/false flag in the correct format.
- * \param flag The flag value.
- * \param name The flag value's identifiable name.
+/** Output routine for the end of outputting invividual battery information.
  * \param config A pointer to the program configuration struct.
  */
 static void
-battery_info_output_flag(int flag,
-                         const char *name,
-                         struct config *config)
+battery_info_output_end(struct config *config)
 {
         switch (config->output_format) {
                 case OUTPUT_FORMAT_CSV: {
-                        output_csv_name();
-                        if (config->configflags & CONFIG_FLAG_DIGITS) {
-                                printf("%s\n", flag == 1 ? "1" :
-                                                        flag == 0 ? "0" : "?");
-                        } else {
-                                printf("%s\n", flag == 1 ? "yes" :
-                                                        flag == 0 ? "no" : "?");
-                        }
+                        output_lit("\n");
                         break;
                 }
                 case OUTPUT_FORMAT_JSON: {
-                        printf(",\n\t\t\"%s\": ", name);
-                        if (config->configflags & CONFIG_FLAG_DIGITS) {
-                                if (flag == 0) {
-                                        fputc('0', stdout);
-                                } else if (flag == 1) {
-                                        fputc('1', stdout);
-                                } else {
-                                        fputs("null", stdout);
-                                }
-                        } else {
-                                if (flag == 0) {
-                                        fputs("false", stdout);
-                                } else if (flag == 1) {
-                                        fputs("true", stdout);
-                                } else {
-                                        fputs("null", stdout);
-                                }
-                        }
+                        output_lit("\n\t}");
+                        break;
+                }
+                case OUTPUT_FORMAT_NDJSON: {
+                        output_lit("}\n");
                         break;
                 }
                 default:
@@ -536,458 +1822,6012 @@ battery_info_output_flag(int flag,
         }
 }
 
-#undef output_n_spaces
-#undef output_csv_name
+/** Output routine for a string in plain output.
+ * \param value A pointer to the string.
+ */
+static void
+output_plain_str(const void *value)
+{
+        const char *s = *(char* const*) value;
 
-//------------------------------------------------------------------------------
-// _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
-//------------------------------------------------------------------------------
+        if (s == NULL) {
+                output_lit("?\n");
+        } else {
+                output_str(s);
+                output_lit("\n");
+        }
+}
 
-/** Utility routine for converting a string into an integer (strtol wrapper).
- * \param s The string to convert.
- * \param dest A pointer to the long integer to place the result in.
- * \return 0 on success, -1 on error.
+/** Output routine for a double in plain output.
+ * \param value A pointer to the double.
  */
-static int
-strtol_helper(char *s,
-              long *dest)
+static void
+output_plain_double(const void *value)
 {
-        errno = 0;
-        char *endptr;
+        double d = *(const double*) value;
 
-        *dest = strtol(s, &endptr, 10);
+        if (d != DOUBLE_INVALID) {
+                output_double(d);
+                output_lit("\n");
+        } else {
+                output_lit("?\n");
+        }
+}
 
-        if (errno != 0 || endptr == s || (endptr != NULL && *endptr != '\0')) {
-                *dest = LONG_INVALID;
-                return -1;
+/** Output routine for a percentage in plain output.
+ * \param value A pointer to the percentage.
+ */
+static void
+output_plain_percent(const void *value)
+{
+        double d = *(const double*) value;
+
+        if (d != DOUBLE_INVALID) {
+                output_double(d);
+                output_lit("%\n");
+        } else {
+                output_lit("?\n");
         }
+}
 
-        return 0;
+/** Output routine for a charge in plain output, capped at 100% (the cap is
+ * applied here rather than when parsed, so that scans can be shared by -N and
+ * non -N output).
+ * \param value A pointer to the charge.
+ */
+static void
+output_plain_charge(const void *value)
+{
+        double d = *(const double*) value;
+
+        if (d > 100.0) {
+                d = 100.0;
+        }
+        output_plain_percent(&d);
 }
 
-/** Utility routine for copying strings by allocating memory for a copy and then
- * copying the source to it.
- * \param src The source string to copy.
- * \param dest A pointer to a char pointer in which to place a pointer to the
- * resulting allocated string.
- * \return 0 on success, -1 on error.
+/** Output routine for a flag in plain output, as yes or no.
+ * \param value A pointer to the flag.
  */
-static int
-strcpy_helper(char *src,
-              char **dest)
+static void
+output_plain_flag(const void *value)
 {
-        free_if_not_null(*dest);
-        *dest = (char*) malloc(strlen((const char*) src) + 1);
-        if (*dest == NULL) {
-                return -1;
+        char flag = *(const char*) value;
+
+        if (flag == 1) {
+                output_lit("yes\n");
+        } else if (flag == 0) {
+                output_lit("no\n");
+        } else {
+                output_lit("?\n");
         }
+}
 
-        strcpy(*dest, (const char*) src);
-        return 0;
+/** Output routine for a flag in plain output, as 1 or 0.
+ * \param value A pointer to the flag.
+ */
+static void
+output_plain_flag_digits(const void *value)
+{
+        char flag = *(const char*) value;
+
+        if (flag == 1) {
+                output_lit("1\n");
+        } else if (flag == 0) {
+                output_lit("0\n");
+        } else {
+                output_lit("?\n");
+        }
 }
 
-/** Utility routine for comparing a file's contents to a string.
- * \param path The path of the file to compare.
- * \param comparison The string to compare the file's contents to.
- * \return 0 on success, -1 on error or when the file doesn't match the given
- * string.
+/** Output routine for a string in CSV. Unknown values are left empty, and
+ * strings are quoted (as per RFC 4180) only if they need to be.
+ * \param value A pointer to the string.
  */
-static int
-compare_file_contents(const char *path,
-                      const char *comparison)
+static void
+output_csv_str(const void *value)
 {
-        FILE *f = fopen(path, "r");
-        if (f == NULL) {
-                return -1;
+        const char *s = *(char* const*) value;
+        const char *q;
+
+        if (s == NULL) {
+                return;
         }
 
-        size_t len = strlen(comparison);
-        char *s = (char*) comparison;
-        int c;
+        if (s[strcspn(s, ",\"\r\n")] == '\0') {
+                output_str(s);
+                return;
+        }
 
-        while (len > 0) {
-                c = fgetc(f);
-                if (c == EOF || c != (int) *s) {
-                        break;
+        output_lit("\"");
+        while ((q = strchr(s, '"')) != NULL) {
+                output_mem(s, (size_t) (q + 1 - s));
+                output_lit("\"");
+                s = q + 1;
+        }
+        output_str(s);
+        output_lit("\"");
+}
+
+/** Output routine for a double (or a percentage: CSV values are bare numbers)
+ * in CSV.
+ * \param value A pointer to the double.
+ */
+static void
+output_csv_double(const void *value)
+{
+        double d = *(const double*) value;
+
+        if (d != DOUBLE_INVALID) {
+                output_double(d);
+        }
+}
+
+/** Output routine for a charge in CSV, capped at 100% (see
+ * output_plain_charge).
+ * \param value A pointer to the charge.
+ */
+static void
+output_csv_charge(const void *value)
+{
+        double d = *(const double*) value;
+
+        if (d > 100.0) {
+                d = 100.0;
+        }
+        output_csv_double(&d);
+}
+
+/** Output routine for a flag in CSV, as yes or no.
+ * \param value A pointer to the flag.
+ */
+static void
+output_csv_flag(const void *value)
+{
+        char flag = *(const char*) value;
+
+        if (flag == 1) {
+                output_lit("yes");
+        } else if (flag == 0) {
+                output_lit("no");
+        }
+}
+
+/** Output routine for a flag in CSV, as 1 or 0.
+ * \param value A pointer to the flag.
+ */
+static void
+output_csv_flag_digits(const void *value)
+{
+        char flag = *(const char*) value;
+
+        if (flag == 1) {
+                output_lit("1");
+        } else if (flag == 0) {
+                output_lit("0");
+        }
+}
+
+/** Output routine for a string in JSON (and NDJSON), escaping quotes,
+ * backslashes and control characters.
+ * \param value A pointer to the string.
+ */
+static void
+output_json_str(const void *value)
+{
+        const char *s = *(char* const*) value;
+        const char *p;
+
+        if (s == NULL) {
+                output_lit("null");
+                return;
+        }
+
+        output_lit("\"");
+        for (p = s; *p != '\0'; p++) {
+                unsigned char c = (unsigned char) *p;
+                if (c != '"' && c != '\\' && c >= 0x20) {
+                        continue;
                 }
-                len--;
-                s++;
+
+                output_mem(s, (size_t) (p - s));
+                if (c == '"' || c == '\\') {
+                        char escape[2] = { '\\', (char) c };
+                        output_mem(escape, sizeof(escape));
+                } else {
+                        char escape[7];
+                        snprintf(escape, sizeof(escape), "\\u%04x", c);
+                        output_mem(escape, 6);
+                }
+                s = p + 1;
         }
+        output_mem(s, (size_t) (p - s));
+        output_lit("\"");
+}
 
-        fclose(f);
+/** Output routine for a double (or a percentage: we don't want % signs in the
+ * JSON) in JSON (and NDJSON).
+ * \param value A pointer to the double.
+ */
+static void
+output_json_double(const void *value)
+{
+        double d = *(const double*) value;
 
-        return len == 0 ? 0 : -1;
+        if (d != DOUBLE_INVALID) {
+                output_double(d);
+        } else {
+                output_lit("null");
+        }
 }
 
-//------------------------------------------------------------------------------
-// _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
-//------------------------------------------------------------------------------
+/** Output routine for a charge in JSON (and NDJSON), capped at 100% (see
+ * output_plain_charge).
+ * \param value A pointer to the charge.
+ */
+static void
+output_json_charge(const void *value)
+{
+        double d = *(const double*) value;
 
-#define if_startswith(s) if (strstr((const char*) buf, s) == buf)
+        if (d > 100.0) {
+                d = 100.0;
+        }
+        output_json_double(&d);
+}
 
-/** Routine to read a battery entry's uevent file, and place the parsed data
- * into a battery_info structure.
- * \param path The path to the battery's directory entry in the sysfs.
- * \param info A pointer to the structure in which to place the parsed data.
- * \return 0 on success, -1 on error. NOTE:
+/** Output routine for a flag in JSON (and NDJSON), as true or false.
+ * \param value A pointer to the flag.
+ */
+static void
+output_json_flag(const void *value)
+{
+        char flag = *(const char*) value;
+
+        if (flag == 0) {
+                output_lit("false");
+        } else if (flag == 1) {
+                output_lit("true");
+        } else {
+                output_lit("null");
+        }
+}
+
+/** Output routine for a flag in JSON (and NDJSON), as 1 or 0.
+ * \param value A pointer to the flag.
+ */
+static void
+output_json_flag_digits(const void *value)
+{
+        char flag = *(const char*) value;
+
+        if (flag == 0) {
+                output_lit("0");
+        } else if (flag == 1) {
+                output_lit("1");
+        } else {
+                output_lit("null");
+        }
+}
+
+/** Output routine for a count in plain output.
+ * \param value A pointer to the count.
+ */
+static void
+output_plain_count(const void *value)
+{
+        output_int((long) *(const unsigned long*) value);
+        output_lit("\n");
+}
+
+/** Output routine for a count in CSV, JSON and NDJSON.
+ * \param value A pointer to the count.
+ */
+static void
+output_count(const void *value)
+{
+        output_int((long) *(const unsigned long*) value);
+}
+
+/** The routines which output each FIELD_* type, in each output format. */
+static const output_fn output_fns[OUTPUT_FORMAT_NUM][FIELD_NUM] = {
+        [OUTPUT_FORMAT_PLAIN] = {
+                [FIELD_STR]         = output_plain_str,
+                [FIELD_DOUBLE]      = output_plain_double,
+                [FIELD_PERCENT]     = output_plain_percent,
+                [FIELD_CHARGE]      = output_plain_charge,
+                [FIELD_FLAG]        = output_plain_flag,
+                [FIELD_FLAG_DIGITS] = output_plain_flag_digits,
+                [FIELD_COUNT]       = output_plain_count,
+        },
+        [OUTPUT_FORMAT_CSV] = {
+                [FIELD_STR]         = output_csv_str,
+                [FIELD_DOUBLE]      = output_csv_double,
+                [FIELD_PERCENT]     = output_csv_double,
+                [FIELD_CHARGE]      = output_csv_charge,
+                [FIELD_FLAG]        = output_csv_flag,
+                [FIELD_FLAG_DIGITS] = output_csv_flag_digits,
+                [FIELD_COUNT]       = output_count,
+        },
+        [OUTPUT_FORMAT_JSON] = {
+                [FIELD_STR]         = output_json_str,
+                [FIELD_DOUBLE]      = output_json_double,
+                [FIELD_PERCENT]     = output_json_double,
+                [FIELD_CHARGE]      = output_json_charge,
+                [FIELD_FLAG]        = output_json_flag,
+                [FIELD_FLAG_DIGITS] = output_json_flag_digits,
+                [FIELD_COUNT]       = output_count,
+        },
+        [OUTPUT_FORMAT_NDJSON] = {
+                [FIELD_STR]         = output_json_str,
+                [FIELD_DOUBLE]      = output_json_double,
+                [FIELD_PERCENT]     = output_json_double,
+                [FIELD_CHARGE]      = output_json_charge,
+                [FIELD_FLAG]        = output_json_flag,
+                [FIELD_FLAG_DIGITS] = output_json_flag_digits,
+                [FIELD_COUNT]       = output_count,
+        },
+};
 
+/** Routine to look up an output format by name.
+ * \param name The format's name.
+ * \return The format's OUTPUT_FORMAT_* value, or -1 if there is no such
+ * format.
  */
 static int
-get_battery_info(const char *path,
-                 struct battery_info *info,
-                 struct config *config)
+output_format_find(const char *name)
 {
-        long charge_now = LONG_INVALID,
-             charge_full = LONG_INVALID,
-             charge_full_design = LONG_INVALID,
-             capacity = LONG_INVALID,
-             voltage_now = LONG_INVALID,
-             current_now = LONG_INVALID,
-             temp = LONG_INVALID,
-             online = LONG_INVALID,
-             present = LONG_INVALID,
-             charging_enabled = LONG_INVALID;
-
-        char buf[256], pathbuf[SYS_FS_BATTERY_BASE_PATH_LEN + 64];
-        strcpy((char*) pathbuf, path);
-        strcat((char*) pathbuf, "/uevent");
+        int format;
 
-        int failed_opens = 0;
-        FILE *f = fopen(pathbuf, "r");
-        if (f == NULL) {
+        for (format = 0; format < OUTPUT_FORMAT_NUM; format++) {
+                if (!strcmp(name, output_format_names[format])) {
+                        return format;
+                }
+        }
+
+        return -1;
+}
+
+/** Routine to compile an output sequence into an output plan, for the output
+ * format and configuration flags in config. With --query, the sequence is
+ * made of query_fields rather than output_fields.
+ * \param plan A pointer to the plan to compile into. Free it with
+ * output_plan_cleanup.
+ * \param infostr The sequence of characters which denotes what information is
+ * outputted, and its order.
+ * \param config A pointer to the program configuration struct.
+ * \return 0 on success, or -1 on error (errno is set to EINVAL if infostr
+ * contains an invalid character).
+ */
+static int
+output_plan_compile(struct output_plan *plan,
+                    const char *infostr,
+                    struct config *config)
+{
+        const struct output_field *fields = output_fields;
+        size_t fields_n = OUTPUT_FIELDS_NUM;
+        size_t n = 0, i, f;
+
+        if (config->configflags & CONFIG_FLAG_QUERY) {
+                fields = query_fields;
+                fields_n = QUERY_FIELDS_NUM;
+        }
+
+        // a character can stand for several fields
+        const struct output_field **matched = (const struct output_field**) counted_realloc(NULL, (strlen(infostr) * fields_n + 1) * sizeof(struct output_field*));
+        if (matched == NULL) {
+                return -1;
+        }
+        for (i = 0; infostr[i] != '\0'; i++) {
+                size_t found = n;
+                for (f = 0; f < fields_n; f++) {
+                        if (fields[f].c == infostr[i]) {
+                                matched[n++] = &fields[f];
+                        }
+                }
+                if (n == found) {
+                        free(matched);
+                        errno = EINVAL;
+                        return -1;
+                }
+        }
+
+        struct output_step *steps = (struct output_step*) counted_realloc(NULL, (n + 1) * sizeof(struct output_step));
+        if (steps == NULL) {
+                free(matched);
+                return -1;
+        }
+
+        size_t header_len = sizeof("battery\n") - 1;
+        for (i = 0; i < n; i++) {
+                const struct output_field *field = matched[i];
+                header_len += 1 + strlen(field->label.name);
+
+                int type = field->type;
+                if (type == FIELD_CHARGE && (config->configflags & CONFIG_FLAG_DISABLE_CHARGE_CAP)) {
+                        type = FIELD_PERCENT;
+                } else if (type == FIELD_FLAG && (config->configflags & CONFIG_FLAG_DIGITS)) {
+                        type = FIELD_FLAG_DIGITS;
+                }
+
+                switch (config->output_format) {
+                        case OUTPUT_FORMAT_CSV: {
+                                steps[i].label = ",";
+                                steps[i].label_len = 1;
+                                break;
+                        }
+                        case OUTPUT_FORMAT_JSON: {
+                                steps[i].label = field->label.json;
+                                steps[i].label_len = field->label.json_len;
+                                break;
+                        }
+                        case OUTPUT_FORMAT_NDJSON: {
+                                steps[i].label = field->label.ndjson;
+                                steps[i].label_len = field->label.ndjson_len;
+                                break;
+                        }
+                        default: {
+                                steps[i].label = field->label.plain;
+                                steps[i].label_len = OUTPUT_PLAIN_LABEL_WIDTH;
+                                break;
+                        }
+                }
+                steps[i].offset = field->offset;
+                steps[i].fn = output_fns[config->output_format][type];
+        }
+
+        char *header = NULL;
+        if (config->output_format == OUTPUT_FORMAT_CSV) {
+                if ((header = (char*) counted_realloc(NULL, header_len + 1)) == NULL) {
+                        free(matched);
+                        free(steps);
+                        return -1;
+                }
+                char *p = stpcpy(header, "battery");
+                for (i = 0; i < n; i++) {
+                        *p++ = ',';
+                        p = stpcpy(p, matched[i]->label.name);
+                }
+                strcpy(p, "\n");
+        }
+        free(matched);
+
+        plan->infostr = infostr;
+        plan->steps = steps;
+        plan->n = n;
+        plan->header = header;
+        plan->header_len = header_len;
+        plan->header_done = 0;
+        plan->records = 0;
+        plan->record = 0;
+
+        return 0;
+}
+
+/** Routine to free an output plan.
+ * \param plan A pointer to the plan (which may be zeroed, if it was never
+ * compiled).
+ */
+static void
+output_plan_cleanup(struct output_plan *plan)
+{
+        free(plan->steps);
+        free(plan->header);
+        plan->steps = NULL;
+        plan->n = 0;
+        plan->header = NULL;
+}
+
+//------------------------------------------------------------------------------
+// _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
+//------------------------------------------------------------------------------
+
+/** Utility routine for converting a string into an integer (strtol wrapper).
+ * \param s The string to convert.
+ * \param dest A pointer to the long integer to place the result in.
+ * \return 0 on success, -1 on error.
+ */
+static int
+strtol_helper(char *s,
+              long *dest)
+{
+        errno = 0;
+        char *endptr;
+
+        *dest = strtol(s, &endptr, 10);
+
+        if (errno != 0 || endptr == s || (endptr != NULL && *endptr != '\0')) {
+                *dest = LONG_INVALID;
+                return -1;
+        }
+
+        return 0;
+}
+
+/** Utility routine for comparing the start of a file's contents to a string,
+ * with a single read.
+ * \param dir_fd The directory which path is relative to.
+ * \param path The path of the file to compare.
+ * \param comparison The string to compare the file's contents to (shorter
+ * than COMPARE_FILE_MAX).
+ * \return 0 on success, -1 on error or when the file doesn't match the given
+ * string.
+ */
+static int
+compare_file_contents(int dir_fd,
+                      const char *path,
+                      const char *comparison)
+{
+        int fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return -1;
+        }
+
+        size_t len = strlen(comparison);
+        char buf[COMPARE_FILE_MAX];
+        ssize_t n = len < sizeof(buf) ? read(fd, buf, len) : -1;
+
+        int err = errno;
+        close(fd);
+        errno = err;
+
+        return n == (ssize_t) len && !memcmp(buf, comparison, len) ? 0 : -1;
+}
+
+/** Utility routine for converting a timespec into nanoseconds.
+ * \param ts A pointer to the timespec to convert.
+ * \return The amount of nanoseconds represented by ts.
+ */
+static int64_t
+timespec_to_ns(const struct timespec *ts)
+{
+        return (int64_t) ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+/** Utility routine for converting nanoseconds into a timespec.
+ * \param ns The amount of nanoseconds.
+ * \param ts A pointer to the timespec in which to place the result.
+ */
+static void
+ns_to_timespec(int64_t ns,
+               struct timespec *ts)
+{
+        ts->tv_sec = (time_t) (ns / NSEC_PER_SEC);
+        ts->tv_nsec = (long) (ns % NSEC_PER_SEC);
+}
+
+/** Utility routine for getting the current time.
+ * \return The current CLOCK_MONOTONIC time, in nanoseconds.
+ */
+static int64_t
+monotonic_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return timespec_to_ns(&ts);
+}
+
+/** Utility routine for getting the current wall clock time.
+ * \return The current CLOCK_REALTIME time, in nanoseconds.
+ */
+static int64_t
+realtime_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return timespec_to_ns(&ts);
+}
+
+//------------------------------------------------------------------------------
+// _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
+//------------------------------------------------------------------------------
+
+/** Routine to initialize an arena structure with blank values.
+ * \param arena A pointer to the structure to initialize.
+ */
+static void
+arena_init(struct arena *arena)
+{
+        arena->head = NULL;
+        arena->cur = NULL;
+}
+
+/** Routine to clean up an arena structure by freeing all of its blocks.
+ * \param arena A pointer to the structure to clean up.
+ */
+static void
+arena_cleanup(struct arena *arena)
+{
+        struct arena_block *block = arena->head, *next;
+        while (block != NULL) {
+                next = block->next;
+                free(block);
+                block = next;
+        }
+
+        arena_init(arena);
+}
+
+/** Routine to release everything allocated from an arena, while keeping its
+ * blocks for reuse.
+ * \param arena A pointer to the arena.
+ */
+static void
+arena_reset(struct arena *arena)
+{
+        struct arena_block *block;
+        for (block = arena->head; block != NULL; block = block->next) {
+                block->used = 0;
+        }
+
+        arena->cur = arena->head;
+}
+
+/** Routine to reserve memory in an arena without allocating it, so that a
+ * caller can fill in up to size bytes and then arena_commit only what it used.
+ * Anything else allocated from the arena before then reuses the same memory.
+ * \param arena A pointer to the arena.
+ * \param size The amount of bytes to reserve.
+ * \return A pointer to the reserved memory, or NULL on error.
+ */
+static void *
+arena_reserve(struct arena *arena,
+              size_t size)
+{
+        struct arena_block *block = arena->cur, *last = NULL;
+
+        for (; block != NULL; block = block->next) {
+                size_t used = (block->used + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+                if (used + size <= block->size) {
+                        block->used = used;
+                        arena->cur = block;
+                        return block->data + used;
+                }
+                last = block;
+        }
+
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = (struct arena_block*) counted_realloc(NULL, sizeof(struct arena_block) + block_size);
+        if (block == NULL) {
+                return NULL;
+        }
+
+        block->next = NULL;
+        block->size = block_size;
+        block->used = 0;
+
+        if (last != NULL) {
+                last->next = block;
+        } else {
+                arena->head = block;
+        }
+        arena->cur = block;
+
+        return block->data;
+}
+
+/** Routine to allocate the start of the memory most recently reserved with
+ * arena_reserve.
+ * \param arena A pointer to the arena.
+ * \param size The amount of bytes to allocate. This must not be more than
+ * was reserved.
+ */
+static void
+arena_commit(struct arena *arena,
+             size_t size)
+{
+        arena->cur->used += size;
+}
+
+/** Routine to allocate memory from an arena.
+ * \param arena A pointer to the arena.
+ * \param size The amount of bytes to allocate.
+ * \return A pointer to the allocated memory, or NULL on error.
+ */
+static void *
+arena_alloc(struct arena *arena,
+            size_t size)
+{
+        void *p = arena_reserve(arena, size);
+        if (p != NULL) {
+                arena_commit(arena, size);
+        }
+
+        return p;
+}
+
+//------------------------------------------------------------------------------
+// _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
+//------------------------------------------------------------------------------
+
+// The supply cache keeps a file descriptor open for each battery's uevent and
+// device/uevent files, and re-reads them from offset 0 with pread (sysfs
+// regenerates an attribute's contents on every read at offset 0). Each
+// entry's type is only checked once, when the entry is first seen.
+//
+// Syscalls per sample, excluding the directory scan itself:
+//                     before (fopen/fgets/fclose)   after (cached pread)
+//     battery         14 (type: openat, fstat,      2 (pread uevent,
+//                     read, close; each uevent:     pread device/uevent)
+//                     openat, fstat, read, read,
+//                     close)
+//     other supply    4 (type)                      0
+// On a system with one battery and one AC adapter that is 18 syscalls down to
+// 2. Opens only happen the first time an entry is seen.
+//
+// The directory itself is opened once, and read with getdents64 into one
+// buffer (a single syscall for a few hundred entries) after an lseek back to
+// its start. Every supply's files are opened with openat relative to it, as
+// "<name>/<file>", so the kernel only looks up those two components instead
+// of the whole /sys/class/power_supply path each time.
+//
+// With thousands of batteries the cached descriptors would exceed
+// RLIMIT_NOFILE, so only as many are kept open as the limit allows (less
+// SUPPLY_FD_RESERVE); any further files are opened, read and closed each time.
+
+static atomic_long supply_fds_free = -1; ///< How many more file descriptors the supply cache may keep open (-1 until a cache is first initialized).
+
+/** Lock guarding the state of parallel scans (struct scan_pool), and the busy
+ * and orphaned flags of cached supplies. */
+static pthread_mutex_t scan_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Routine to get the path of a file in SUPPLY_FILE_*, relative to the
+ * supply's directory.
+ * \param file The file, from SUPPLY_FILE_*.
+ * \return The file's relative path.
+ */
+static const char *
+supply_file_name(int file)
+{
+        switch (file) {
+                case SUPPLY_FILE_UEVENT:
+                        return "uevent";
+                case SUPPLY_FILE_DEVICE_UEVENT:
+                        return "device/uevent";
+                default:
+                        return attr_descs[file - SUPPLY_FILE_ATTR].file;
+        }
+}
+
+/** Routine to initialize a supply cache structure with blank values.
+ * \param cache A pointer to the structure to initialize.
+ */
+static void
+supply_cache_init(struct supply_cache *cache)
+{
+        cache->supplies = NULL;
+        cache->n = 0;
+        cache->cap = 0;
+        cache->hint = 0;
+        cache->dir_fd = -1;
+        cache->dents = NULL;
+        cache->dents_len = 0;
+        cache->dents_pos = 0;
+
+        if (supply_fds_free < 0) {
+                struct rlimit limit;
+                if (getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur == RLIM_INFINITY) {
+                        limit.rlim_cur = 1024;
+                }
+                supply_fds_free = limit.rlim_cur > SUPPLY_FD_RESERVE ? (long) limit.rlim_cur - SUPPLY_FD_RESERVE : 0;
+        }
+}
+
+/** Routine to close every file descriptor held by a cached supply, and free
+ * its last --follow record and its rolling statistics.
+ * \param supply A pointer to the supply.
+ */
+static void
+supply_close(struct supply *supply)
+{
+        int i;
+        for (i = 0; i < SUPPLY_FILE_NUM; i++) {
+                if (supply->fds[i] >= 0) {
+                        close(supply->fds[i]);
+                        supply_fds_free++;
+                }
+                supply->fds[i] = SUPPLY_FD_CLOSED;
+        }
+
+        free_if_not_null(supply->record);
+        supply->record = NULL;
+        supply->record_len = 0;
+        supply->record_cap = 0;
+
+        free_if_not_null(supply->rolling);
+        supply->rolling = NULL;
+}
+
+/** Routine to close a cached supply's files and free it. If a worker thread is
+ * still reading the supply, it is left for the worker to free instead.
+ * \param supply A pointer to the supply.
+ */
+static void
+supply_free(struct supply *supply)
+{
+        pthread_mutex_lock(&scan_pool_lock);
+        int busy = supply->busy;
+        supply->orphaned = busy;
+        pthread_mutex_unlock(&scan_pool_lock);
+
+        if (!busy) {
+                supply_close(supply);
+                free(supply);
+        }
+}
+
+/** Routine to clean up a supply cache structure by closing every file
+ * descriptor and freeing any allocated memory.
+ * \param cache A pointer to the structure to clean up.
+ */
+static void
+supply_cache_cleanup(struct supply_cache *cache)
+{
+        size_t i;
+        for (i = 0; i < cache->n; i++) {
+                supply_free(cache->supplies[i]);
+        }
+
+        free_if_not_null(cache->supplies);
+        free_if_not_null(cache->dents);
+        if (cache->dir_fd >= 0) {
+                close(cache->dir_fd);
+        }
+        supply_cache_init(cache);
+}
+
+/** Routine to open the sysfs power supply directory of a supply cache, if it
+ * isn't open yet.
+ * \param cache A pointer to the supply cache.
+ * \param sys_fs_path The sysfs power supply directory, ending in a '/'.
+ * \return 0 on success, -1 on error.
+ */
+static int
+supply_cache_open(struct supply_cache *cache,
+                  const char *sys_fs_path)
+{
+        if (cache->dir_fd < 0) {
+                cache->dir_fd = open(sys_fs_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+
+        return cache->dir_fd < 0 ? -1 : 0;
+}
+
+/** Routine to go back to the first entry of a supply cache's directory.
+ * \param cache A pointer to the supply cache, opened with supply_cache_open.
+ * \return 0 on success, -1 on error.
+ */
+static int
+supply_cache_rewind(struct supply_cache *cache)
+{
+        cache->dents_len = 0;
+        cache->dents_pos = 0;
+
+        if (cache->dents == NULL && (cache->dents = (char*) counted_realloc(NULL, SUPPLY_DENTS_SIZE)) == NULL) {
+                return -1;
+        }
+
+        return lseek(cache->dir_fd, 0, SEEK_SET) < 0 ? -1 : 0;
+}
+
+/** Routine to read the next entry of a supply cache's directory, fetching a
+ * new batch of entries with getdents64 when the buffer runs out.
+ * \param cache A pointer to the supply cache, rewound with
+ * supply_cache_rewind.
+ * \return The entry's name, which is valid until the next call, or NULL if
+ * there are no more entries (or on error).
+ */
+static const char *
+supply_cache_next_entry(struct supply_cache *cache)
+{
+        if (cache->dents_pos >= cache->dents_len) {
+                long n = syscall(SYS_getdents64, cache->dir_fd, cache->dents, SUPPLY_DENTS_SIZE);
+                if (n <= 0) {
+                        return NULL;
+                }
+                cache->dents_len = (size_t) n;
+                cache->dents_pos = 0;
+        }
+
+        struct linux_dirent64 *dirent = (struct linux_dirent64*) (cache->dents + cache->dents_pos);
+        cache->dents_pos += dirent->d_reclen;
+        return (const char*) dirent->d_name;
+}
+
+/** Routine to remove a supply from the cache, keeping the remaining entries in
+ * order.
+ * \param cache A pointer to the supply cache.
+ * \param i The index of the supply to remove.
+ */
+static void
+supply_cache_remove(struct supply_cache *cache,
+                    size_t i)
+{
+        supply_free(cache->supplies[i]);
+        memmove(&cache->supplies[i], &cache->supplies[i + 1],
+                (cache->n - i - 1) * sizeof(struct supply*));
+        cache->n--;
+}
+
+/** Routine to find a supply in the cache by name, adding it if it isn't there
+ * yet (see supply_classify).
+ *
+ * Directory order is stable between scans, so the entry after the previous
+ * lookup is checked first; a steady-state scan therefore never searches.
+ * \param cache A pointer to the supply cache.
+ * \param name The name of the supply's directory entry.
+ * \return A pointer to the cached supply, or NULL on error.
+ */
+static struct supply *
+supply_cache_lookup(struct supply_cache *cache,
+                    const char *name)
+{
+        size_t i;
+
+        if (cache->hint < cache->n && !strcmp(cache->supplies[cache->hint]->name, name)) {
+                i = cache->hint;
+                goto found;
+        }
+
+        for (i = 0; i < cache->n; i++) {
+                if (!strcmp(cache->supplies[i]->name, name)) {
+                        goto found;
+                }
+        }
+
+        if (strlen(name) > NAME_MAX) {
+                return NULL;
+        }
+
+        if (cache->n == cache->cap) {
+                size_t cap = cache->cap == 0 ? 8 : cache->cap * 2;
+                struct supply **supplies = (struct supply**) counted_realloc(cache->supplies, cap * sizeof(struct supply*));
+                if (supplies == NULL) {
+                        return NULL;
+                }
+                cache->supplies = supplies;
+                cache->cap = cap;
+        }
+
+        struct supply *supply = (struct supply*) counted_realloc(NULL, sizeof(struct supply));
+        if (supply == NULL) {
+                return NULL;
+        }
+        strcpy(supply->name, name);
+        int file;
+        for (file = 0; file < SUPPLY_FILE_NUM; file++) {
+                supply->fds[file] = SUPPLY_FD_CLOSED;
+        }
+        supply->uevent_lacks = 0;
+        supply->classified = 0;
+        supply->is_battery = 0;
+        supply->busy = 0;
+        supply->orphaned = 0;
+        supply->listed = 0;
+        for (file = 0; file < SUPPLY_PREFETCH_NUM; file++) {
+                supply->prefetched[file] = NULL;
+        }
+        supply->record = NULL;
+        supply->record_len = 0;
+        supply->record_cap = 0;
+        supply->record_index = 0;
+        supply->history_id = -1;
+        supply->rolling = NULL;
+
+        // insert at the hint, so that the cache stays in directory order
+        i = cache->hint < cache->n ? cache->hint : cache->n;
+        memmove(&cache->supplies[i + 1], &cache->supplies[i],
+                (cache->n - i) * sizeof(struct supply*));
+        cache->supplies[i] = supply;
+        cache->n++;
+
+found:
+        cache->hint = i + 1;
+        return cache->supplies[i];
+}
+
+/** Routine to find a supply in the cache by name, without adding it.
+ * \param cache A pointer to the supply cache.
+ * \param name The name of the supply's directory entry.
+ * \return A pointer to the cached supply, or NULL if it isn't cached.
+ */
+static struct supply *
+supply_cache_find(struct supply_cache *cache,
+                  const char *name)
+{
+        size_t i;
+
+        for (i = 0; i < cache->n; i++) {
+                if (!strcmp(cache->supplies[i]->name, name)) {
+                        return cache->supplies[i];
+                }
+        }
+
+        return NULL;
+}
+
+/** Routine to build the path of one of a supply's files, relative to the
+ * sysfs power supply directory: "<name>/<file>".
+ * \param buf The buffer in which to place the path, of SUPPLY_PATH_MAX bytes.
+ * \param supply A pointer to the supply.
+ * \param file The file's name, relative to the supply's directory (at most
+ * SUPPLY_FILE_NAME_MAX characters).
+ * \return buf.
+ */
+static const char *
+supply_path(char *buf,
+            const struct supply *supply,
+            const char *file)
+{
+        size_t name_len = strlen(supply->name);
+        memcpy(buf, supply->name, name_len);
+        buf[name_len] = '/';
+        memcpy(buf + name_len + 1, file, strlen(file) + 1);
+        return (const char*) buf;
+}
+
+/** Routine to check whether a supply is a battery, the first time it is
+ * needed.
+ * \param supply A pointer to the supply.
+ * \param dir_fd The sysfs power supply directory (see supply_cache_open).
+ * \return 0 on success, -1 with errno set to ENODEV if the supply doesn't
+ * exist.
+ */
+static int
+supply_classify(struct supply *supply,
+                int dir_fd)
+{
+        if (!supply->classified) {
+                char path[SUPPLY_PATH_MAX];
+                errno = 0;
+                supply->is_battery = !compare_file_contents(dir_fd, supply_path(path, supply, "type"), "Battery");
+                if (!supply->is_battery && (errno == ENOENT || errno == ENOTDIR)) {
+                        // (only possible with -n, or if it has just been removed)
+                        errno = ENODEV;
+                        return -1;
+                }
+                supply->classified = 1;
+        }
+
+        return 0;
+}
+
+/** Routine to read the whole of one of a cached supply's files, opening it
+ * first if needed. If an io_uring batch has already read the file, its
+ * contents are used instead.
+ * \param supply A pointer to the supply.
+ * \param dir_fd The sysfs power supply directory (see supply_cache_open).
+ * \param file The file to read, from SUPPLY_FILE_*.
+ * \param buf The buffer to read into. It will be NUL-terminated.
+ * \param size The size of buf, in bytes.
+ * \return The amount of bytes read on success, -1 if the file doesn't exist
+ * or couldn't be read. errno is set to ENODEV if the supply itself has gone.
+ */
+static ssize_t
+supply_read(struct supply *supply,
+            int dir_fd,
+            int file,
+            char *buf,
+            size_t size)
+{
+        int *fd = &supply->fds[file];
+        ssize_t len;
+
+        if (file < SUPPLY_PREFETCH_NUM && supply->prefetched[file] != NULL) {
+                len = supply->prefetched_len[file];
+                if (len >= 0) {
+                        len = (size_t) len < size ? len : (ssize_t) size - 1;
+                        memcpy(buf, supply->prefetched[file], len);
+                } else {
+                        errno = (int) -len;
+                        len = -1;
+                }
+                supply->prefetched[file] = NULL;
+                goto done;
+        }
+
+        if (*fd == SUPPLY_FD_MISSING) {
+                errno = ENOENT;
+                return -1;
+        }
+
+        int once = -1;
+        if (*fd == SUPPLY_FD_CLOSED) {
+                char path[SUPPLY_PATH_MAX];
+                int new_fd = openat(dir_fd, supply_path(path, supply, supply_file_name(file)), O_RDONLY | O_CLOEXEC);
+                if (new_fd < 0) {
+                        // running out of descriptors doesn't mean the file is missing
+                        if (errno != EMFILE && errno != ENFILE) {
+                                int err = errno;
+                                *fd = SUPPLY_FD_MISSING;
+                                errno = err;
+                        }
+                        return -1;
+                }
+
+                if (atomic_fetch_sub(&supply_fds_free, 1) > 0) {
+                        *fd = new_fd;
+                } else {
+                        atomic_fetch_add(&supply_fds_free, 1);
+                        once = new_fd;
+                }
+        }
+
+        len = pread(once >= 0 ? once : *fd, buf, size - 1, 0);
+        if (once >= 0) {
+                int err = errno;
+                close(once);
+                errno = err;
+        }
+
+done:
+        if (len < 0) {
+                // ENODEV is what sysfs returns for reads on an attribute whose
+                // device has been removed.
+                if (errno == ENODEV || errno == ENOENT) {
+                        errno = ENODEV;
+                }
+                return -1;
+        }
+
+        buf[len] = '\0';
+        return len;
+}
+
+//------------------------------------------------------------------------------
+// _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
+//------------------------------------------------------------------------------
+
+/** Routine to read the whole of one of a supply's files into an arena, with a
+ * single read. The contents are NUL-terminated, but the memory is only
+ * reserved: call arena_commit to keep it (so that parsed strings can point
+ * straight into it until the arena is reset).
+ * \param arena A pointer to the arena.
+ * \param supply A pointer to the supply.
+ * \param dir_fd The sysfs power supply directory (see supply_cache_open).
+ * \param file The file to read, from SUPPLY_FILE_*.
+ * \param len A pointer to a size_t in which to place the length of the
+ * contents.
+ * \return A pointer to the contents, or NULL on error. errno is set to ENODEV
+ * if the supply itself has gone.
+ */
+static char *
+arena_read_file(struct arena *arena,
+                struct supply *supply,
+                int dir_fd,
+                int file,
+                size_t *len)
+{
+        char *buf = (char*) arena_reserve(arena, SYS_FS_READ_MAX + 1);
+        if (buf == NULL) {
+                errno = ENOMEM;
+                return NULL;
+        }
+
+        ssize_t n = supply_read(supply, dir_fd, file, buf, SYS_FS_READ_MAX + 1);
+        if (n < 0) {
+                return NULL;
+        }
+
+        *len = (size_t) n;
+        return buf;
+}
+
+/** Routine to iterate over the lines in a buffer read from a uevent file. Each
+ * line is NUL-terminated in place and has any trailing whitespace stripped;
+ * blank lines are skipped. Nothing is copied.
+ * \param p A pointer to the current position in the buffer, which is advanced
+ * past the returned line.
+ * \param end A pointer to the end of the buffer's contents. This byte must be
+ * writable.
+ * \param len A pointer to a size_t in which to place the line's length.
+ * \return A pointer to the next line, or NULL if there are none left.
+ */
+static char *
+next_line(char **p,
+          char *end,
+          size_t *len)
+{
+        while (*p < end) {
+                char *line = *p;
+                char *eol = (char*) memchr(line, '\n', (size_t) (end - line));
+
+                if (eol != NULL) {
+                        *p = eol + 1;
+                } else {
+                        *p = eol = end;
+                }
+
+                // strip any whitespace at the end
+                while (eol > line && isspace((int) (unsigned char) eol[-1])) eol--;
+                *eol = '\0';
+
+                if (eol > line) {
+                        *len = (size_t) (eol - line);
+                        return line;
+                }
+        }
+
+        return NULL;
+}
+
+/** Routine to parse a single KEY=value line from a uevent file, placing the
+ * value of a recognised POWER_SUPPLY_* key into a values array or a
+ * battery_info structure.
+ *
+ * The key is looked up with one hash and one comparison against attr_descs,
+ * which is also where the value's offset within the line comes from. String
+ * values are not copied: the battery_info field points into the line.
+ * \param line The NUL-terminated line.
+ * \param line_len The length of the line.
+ * \param values An array of ATTR_LONG_NUM numeric attribute values.
+ * \param info A pointer to the structure in which to place string values.
+ * \return The ATTR_* attribute that was set, or -1 if the key wasn't
+ * recognised or the value couldn't be converted.
+ */
+static int
+parse_uevent_line(char *line,
+                  size_t line_len,
+                  long *values,
+                  struct battery_info *info)
+{
+        char *eq = (char*) memchr(line, '=', line_len);
+        if (eq == NULL) {
+                return -1;
+        }
+
+        size_t len = (size_t) (eq - line) + 1; // including the '='
+        if (len < UEVENT_KEY_PREFIX_LEN + 3 || memcmp(line, UEVENT_KEY_PREFIX, UEVENT_KEY_PREFIX_LEN) != 0) {
+                return -1;
+        }
+
+        const char *key = line + UEVENT_KEY_PREFIX_LEN;
+        size_t key_len = len - UEVENT_KEY_PREFIX_LEN - 1;
+        int a = uevent_key_slots[uevent_key_hash(key, key_len)] - 1;
+
+        if (a < 0 || attr_descs[a].key_len != len ||
+                memcmp(key, attr_descs[a].key + UEVENT_KEY_PREFIX_LEN, key_len) != 0) {
+                return -1;
+        }
+
+        if (a < ATTR_LONG_NUM) {
+                return strtol_helper(line + attr_descs[a].key_len, &values[a]) < 0 ? -1 : a;
+        }
+
+        *attr_str_field(info, a) = line + attr_descs[a].key_len;
+        return a;
+}
+
+/** Routine to read the driver name of a battery from its device/uevent file.
+ * \param arena A pointer to the arena to read the battery's files into.
+ * \param supply A pointer to the battery's entry in the supply cache.
+ * \param dir_fd The sysfs power supply directory (see supply_cache_open).
+ * \param info A pointer to the structure in which to place the driver name.
+ * \return 0 on success, -1 on error. errno is set to ENODEV if the battery
+ * has been removed.
+ */
+static int
+read_battery_driver(struct arena *arena,
+                    struct supply *supply,
+                    int dir_fd,
+                    struct battery_info *info)
+{
+        char *p, *end, *line;
+        size_t len;
+
+        if ((p = arena_read_file(arena, supply, dir_fd, SUPPLY_FILE_DEVICE_UEVENT, &len)) == NULL) {
+                return -1;
+        }
+        arena_commit(arena, len + 1);
+
+        end = p + len;
+        while ((line = next_line(&p, end, &len)) != NULL) {
+                if (len >= DEVICE_UEVENT_DRIVER_KEY_LEN &&
+                        !memcmp(line, DEVICE_UEVENT_DRIVER_KEY, DEVICE_UEVENT_DRIVER_KEY_LEN)) {
+                        info->driver = line + DEVICE_UEVENT_DRIVER_KEY_LEN;
+                }
+        }
+
+        return 0;
+}
+
+/** Routine to read a battery entry's uevent and device/uevent files, and place
+ * the parsed data into a values array and a battery_info structure.
+ * \param arena A pointer to the arena to read the battery's files into.
+ * \param supply A pointer to the battery's entry in the supply cache.
+ * \param dir_fd The sysfs power supply directory (see supply_cache_open).
+ * \param values An array of ATTR_LONG_NUM numeric attribute values to fill in.
+ * \param info A pointer to the structure in which to place the string
+ * attributes.
+ * \return 0 on success, -1 on error. errno is set to ENODEV if the battery
+ * has been removed.
+ */
+static int
+read_battery_uevent(struct arena *arena,
+                    struct supply *supply,
+                    int dir_fd,
+                    long *values,
+                    struct battery_info *info)
+{
+        char *p, *end, *line;
+        size_t len;
+
+        int failed_opens = 0;
+        if ((p = arena_read_file(arena, supply, dir_fd, SUPPLY_FILE_UEVENT, &len)) == NULL) {
+                if (errno == ENODEV) {
+                        return -1;
+                }
                 failed_opens++;
                 goto read_device_uevent;
         }
+        arena_commit(arena, len + 1);
+
+        end = p + len;
+        while ((line = next_line(&p, end, &len)) != NULL) {
+                parse_uevent_line(line, len, values, info);
+        }
+
+read_device_uevent:
+        if (read_battery_driver(arena, supply, dir_fd, info) < 0) {
+                if (errno == ENODEV) {
+                        return -1;
+                }
+                // if we manage to read at least something, count it as a success.
+                return ++failed_opens == 2 ? -1 : 0;
+        }
+
+        return 0;
+}
+
+/** Routine to read a set of individual attribute files of a battery.
+ * \param arena A pointer to the arena to read the battery's files into.
+ * \param supply A pointer to the battery's entry in the supply cache.
+ * \param dir_fd The sysfs power supply directory (see supply_cache_open).
+ * \param attrs The ATTR_MASK_* attributes to read.
+ * \param values An array of ATTR_LONG_NUM numeric attribute values to fill in.
+ * \param info A pointer to the structure in which to place the string
+ * attributes.
+ * \return The ATTR_MASK_* attributes whose files don't exist, or -1 on error.
+ * errno is set to ENODEV if the battery has been removed.
+ */
+static int64_t
+read_battery_attrs(struct arena *arena,
+                   struct supply *supply,
+                   int dir_fd,
+                   uint32_t attrs,
+                   long *values,
+                   struct battery_info *info)
+{
+        uint32_t missing = 0;
+        size_t len;
+        char *buf;
+        int a;
+
+        for (a = 0; a < ATTR_NUM; a++) {
+                if (!(attrs & ATTR_MASK(a))) {
+                        continue;
+                }
+
+                if (a == ATTR_NAME) {
+                        // POWER_SUPPLY_NAME is always the name of the directory entry
+                        info->name = supply->name;
+                        continue;
+                }
+
+                if ((buf = arena_read_file(arena, supply, dir_fd, SUPPLY_FILE_ATTR + a, &len)) == NULL) {
+                        if (errno == ENODEV) {
+                                return -1;
+                        }
+                        missing |= ATTR_MASK(a);
+                        continue;
+                }
+
+                size_t used = len + 1;
+                while (len > 0 && isspace((int) (unsigned char) buf[len - 1])) len--;
+                buf[len] = '\0';
+
+                if (a < ATTR_LONG_NUM) {
+                        // nothing points into numeric values, so their memory isn't kept
+                        strtol_helper(buf, &values[a]);
+                } else {
+                        arena_commit(arena, used);
+                        *attr_str_field(info, a) = buf;
+                }
+        }
+
+        return missing;
+}
+
+/** Routine to read only the attributes of a battery which are needed by the
+ * output sequence, falling back to parsing the uevent files for anything that
+ * the driver doesn't provide as an individual attribute file.
+ *
+ * Reading uevent makes the driver fetch every property, some of which may
+ * involve slow bus transactions; reading individual files only fetches what's
+ * actually going to be output. Attributes which were also absent from uevent
+ * last time are remembered, so that a missing attribute doesn't cause uevent
+ * to be parsed on every call.
+ * \param arena A pointer to the arena to read the battery's files into.
+ * \param supply A pointer to the battery's entry in the supply cache.
+ * \param dir_fd The sysfs power supply directory (see supply_cache_open).
+ * \param attrs The ATTR_MASK_* attributes needed.
+ * \param values An array of ATTR_LONG_NUM numeric attribute values to fill in.
+ * \param info A pointer to the structure in which to place the string
+ * attributes.
+ * \return 0 on success, -1 on error. errno is set to ENODEV if the battery
+ * has been removed.
+ */
+static int
+read_battery_attrs_lazy(struct arena *arena,
+                        struct supply *supply,
+                        int dir_fd,
+                        uint32_t attrs,
+                        long *values,
+                        struct battery_info *info)
+{
+        int64_t missing = read_battery_attrs(arena, supply, dir_fd, attrs & ~ATTR_MASK_DRIVER, values, info);
+        if (missing < 0) {
+                return -1;
+        }
+
+        // capacity is preferred for the charge, but if it's unusable the
+        // charge has to be worked out from charge_now and charge_full instead.
+        if ((attrs & ATTR_MASK(ATTR_CAPACITY)) &&
+                !(values[ATTR_CAPACITY] >= 0 && values[ATTR_CAPACITY] <= 100)) {
+                uint32_t extra = (ATTR_MASK(ATTR_CHARGE_NOW) | ATTR_MASK(ATTR_CHARGE_FULL)) & ~attrs;
+                int64_t extra_missing = read_battery_attrs(arena, supply, dir_fd, extra, values, info);
+                if (extra_missing < 0) {
+                        return -1;
+                }
+                missing |= extra_missing;
+                attrs |= extra;
+        }
+
+        if (missing & ~supply->uevent_lacks) {
+                if (read_battery_uevent(arena, supply, dir_fd, values, info) < 0) {
+                        return errno == ENODEV ? -1 : 0;
+                }
+
+                // remember what uevent didn't have either
+                uint32_t lacks = 0;
+                int a;
+                for (a = 0; a < ATTR_NUM; a++) {
+                        if (a < ATTR_LONG_NUM ? values[a] == LONG_INVALID : *attr_str_field(info, a) == NULL) {
+                                lacks |= ATTR_MASK(a);
+                        }
+                }
+                supply->uevent_lacks = lacks;
+        } else if (attrs & ATTR_MASK_DRIVER) {
+                if (read_battery_driver(arena, supply, dir_fd, info) < 0 && errno == ENODEV) {
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+/** Routine to fill in a battery's information from its parsed attribute
+ * values.
+ * \param info A pointer to the structure in which to place the information.
+ * \param values The values of the numeric ATTR_* attributes (LONG_INVALID if
+ * missing).
+ */
+static void
+battery_info_compute(struct battery_info *info,
+                     const long *values)
+{
+        long charge_now = values[ATTR_CHARGE_NOW],
+             charge_full = values[ATTR_CHARGE_FULL],
+             charge_full_design = values[ATTR_CHARGE_FULL_DESIGN],
+             capacity = values[ATTR_CAPACITY],
+             voltage_now = values[ATTR_VOLTAGE_NOW],
+             current_now = values[ATTR_CURRENT_NOW],
+             temp = values[ATTR_TEMP],
+             online = values[ATTR_ONLINE],
+             present = values[ATTR_PRESENT],
+             charging_enabled = values[ATTR_CHARGING_ENABLED];
+
+        if (capacity != LONG_INVALID && capacity >= 0 && capacity <= 100) {
+                info->charge = (double) capacity;
+        } else if (charge_now != LONG_INVALID && charge_full != LONG_INVALID) {
+                info->charge = (double) charge_now / (double) charge_full * 100;
+        }
+
+        if (charge_full != LONG_INVALID && charge_full_design != LONG_INVALID) {
+                info->max_charge = (double) charge_full / (double) charge_full_design * 100;
+        }
+
+        // TODO fix: make sure this is right (the units)
+        if (voltage_now != LONG_INVALID) {
+                info->voltage = (double) voltage_now / (double) 1000000.0;
+        }
+
+        // TODO fix: ^
+        if (current_now != LONG_INVALID) {
+                info->current = (double) current_now / (double) 100000.0;
+        }
+
+        // TODO fix: ^
+        if (temp != LONG_INVALID) {
+                info->temperature = (double) temp / (double) 10.0;
+        }
+
+        if (charge_full != LONG_INVALID && charge_now != LONG_INVALID &&
+                current_now != LONG_INVALID) {
+                info->etd = (((double) charge_full - (double) charge_now) / (double) current_now) * 10;
+        }
+
+        if (present == 1 || present == 0) {
+                info->present = (char) present;
+        }
+        if (online == 1 || online == 0) {
+                info->online = (char) online;
+        }
+        if (charging_enabled == 1 || charging_enabled == 0) {
+                info->charging_enabled = (char) charging_enabled;
+        }
+}
+
+/** Routine to read a battery's information, and place the parsed data into a
+ * battery_info structure.
+ * \param arena A pointer to the arena to read the battery's files into. The
+ * string fields of info will point into it.
+ * \param supply A pointer to the battery's entry in the supply cache.
+ * \param dir_fd The sysfs power supply directory (see supply_cache_open).
+ * \param info A pointer to the structure in which to place the parsed data.
+ * \param config A pointer to the program configuration struct.
+ * \return 0 on success, -1 on error. errno is set to ENODEV if the battery
+ * has been removed.
+ */
+static int
+get_battery_info(struct arena *arena,
+                 struct supply *supply,
+                 int dir_fd,
+                 struct battery_info *info,
+                 struct config *config)
+{
+        if (config->configflags & CONFIG_FLAG_LAZY) {
+                if (read_battery_attrs_lazy(arena, supply, dir_fd, config->attrs, info->values, info) < 0) {
+                        return -1;
+                }
+        } else if (read_battery_uevent(arena, supply, dir_fd, info->values, info) < 0) {
+                return -1;
+        }
+
+        battery_info_compute(info, info->values);
+
+        return 0;
+}
+
+/** Routine to work out which attributes are needed to output an output
+ * sequence.
+ * \param infostr The sequence of characters which denotes what information is
+ * outputted.
+ * \return The ATTR_MASK_* attributes needed.
+ */
+static uint32_t
+output_sequence_attrs(const char *infostr)
+{
+        uint32_t attrs = 0;
+        const char *p;
+
+        for (p = infostr; *p != '\0'; p++) {
+                const struct output_field *field = output_field_find(*p);
+                if (field != NULL) {
+                        attrs |= field->attrs;
+                }
+        }
+
+        return attrs;
+}
+
+/** Routine to list the information about a specific battery.
+ * \param battery An index for the battery.
+ * \param info A pointer to the battery's information.
+ * \param config A pointer to the program configuration struct.
+ */
+static void
+list_battery_info(int battery,
+                  struct battery_info *info,
+                  struct config *config)
+{
+        const struct output_step *step = config->plan->steps;
+        const struct output_step *end = step + config->plan->n;
+
+        battery_info_output_start(battery, config);
+
+        for (; step < end; step++) {
+                output_mem(step->label, step->label_len);
+                step->fn((const char*) info + step->offset);
+        }
+
+        battery_info_output_end(config);
+}
+
+/** Routine to read a supply found by a scan: check whether it's a battery
+ * (the first time) and, if it is, read its information.
+ * \param arena A pointer to the arena to read the battery's information into.
+ * \param supply A pointer to the supply.
+ * \param config A pointer to the program configuration struct.
+ * \param info A pointer to where to place a pointer to the battery's
+ * information, or NULL if the supply isn't a battery.
+ * \return 0 on success, -1 on error. errno is set to ENODEV if the supply
+ * has been removed.
+ */
+static int
+scan_supply(struct arena *arena,
+            struct supply *supply,
+            int dir_fd,
+            struct config *config,
+            struct battery_info **info)
+{
+        *info = NULL;
+
+        if (supply_classify(supply, dir_fd) < 0) {
+                return -1;
+        }
+        if (!supply->is_battery) {
+                return 0;
+        }
+
+        struct battery_info *battery = (struct battery_info*) arena_alloc(arena, sizeof(struct battery_info));
+        if (battery == NULL) {
+                return -1;
+        }
+        battery_info_init(battery);
+
+        if (get_battery_info(arena, supply, dir_fd, battery, config) < 0) {
+                return -1;
+        }
+
+        *info = battery;
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
+//------------------------------------------------------------------------------
+
+// Rolling statistics (the V, A and K output characters) are kept per battery
+// by whatever keeps sampling it: --watch and --follow in the battery's cached
+// supply, and --replay per name in the log. Each sample updates them in O(1)
+// without allocating anything, once the battery's state (a few rings of -W
+// values) has been allocated by its first sample:
+//     - the average is an EWMA, weighted as a -W sample moving average would
+//       be (alpha = 2 / (W + 1))
+//     - the minimum and maximum are the fronts of monotonic deques: a new value
+//       first drops every value behind it which it beats, so each value is
+//       pushed and popped at most once
+//     - the standard deviation uses Welford's updates, with the oldest value
+//       being swapped for the new one once the window is full. The mean and
+//       sum of squares are worked out again from the ring every -W samples,
+//       so rounding errors can't build up (which is still O(1), amortised).
+// A sample in which a number is unknown leaves its statistics as they were.
+//
+// The times until empty and full (E) come from the same window: a least
+// squares line through the charge (worked out from charge_now and charge_full
+// where possible, as capacity is only ever a whole percentage) against when
+// it was read, kept as running sums which the oldest sample is taken back out
+// of. Unlike D, which divides by the instantaneous current, this settles
+// after a few samples. The trend starts again whenever the battery's status
+// changes (e.g: when it's plugged in), so that it doesn't mix the two.
+
+/** Routine to allocate a battery's rolling statistics.
+ * \param window The size of the window, in samples.
+ * \return A pointer to the statistics (free it with free), or NULL on error.
+ */
+static struct rolling *
+rolling_alloc(size_t window)
+{
+        size_t per_stat = window * (sizeof(double) + 2 * sizeof(uint64_t));
+        size_t size = sizeof(struct rolling) + ROLLING_NUM * per_stat + 2 * window * sizeof(double);
+        struct rolling *rolling = (struct rolling*) counted_realloc(NULL, size);
+        if (rolling == NULL) {
+                return NULL;
+        }
+
+        char *p = (char*) (rolling + 1);
+        int num;
+
+        rolling->window = window;
+        for (num = 0; num < ROLLING_NUM; num++) {
+                struct rolling_stat *stat = &rolling->stats[num];
+                stat->ring = (double*) p;
+                stat->min_q = (uint64_t*) (p + window * sizeof(double));
+                stat->max_q = stat->min_q + window;
+                p += per_stat;
+
+                stat->min_front = stat->min_len = 0;
+                stat->max_front = stat->max_len = 0;
+                stat->samples = 0;
+                stat->avg = stat->mean = stat->m2 = 0;
+        }
+
+        rolling->trend.times = (double*) p;
+        rolling->trend.levels = rolling->trend.times + window;
+        rolling->trend.samples = 0;
+        rolling->trend.status[0] = '\0';
+
+        return rolling;
+}
+
+/** Routine to add a value to a number's rolling statistics.
+ * \param stat A pointer to the number's statistics.
+ * \param window The size of the window, in samples.
+ * \param x The value.
+ */
+static void
+rolling_stat_add(struct rolling_stat *stat,
+                 size_t window,
+                 double x)
+{
+        uint64_t k = stat->samples++;
+        size_t slot = (size_t) (k % window);
+        size_t i;
+
+        if (k >= window) {
+                // x takes the place of the oldest value
+                double old = stat->ring[slot];
+                double mean = stat->mean + (x - old) / (double) window;
+                stat->m2 += (x - old) * (x - mean + old - stat->mean);
+                stat->mean = mean;
+
+                if (stat->min_len > 0 && stat->min_q[stat->min_front] == k - window) {
+                        stat->min_front = (stat->min_front + 1) % window;
+                        stat->min_len--;
+                }
+                if (stat->max_len > 0 && stat->max_q[stat->max_front] == k - window) {
+                        stat->max_front = (stat->max_front + 1) % window;
+                        stat->max_len--;
+                }
+        } else {
+                double delta = x - stat->mean;
+                stat->mean += delta / (double) (k + 1);
+                stat->m2 += delta * (x - stat->mean);
+        }
+        stat->ring[slot] = x;
+        stat->avg = k == 0 ? x : stat->avg + 2 / ((double) window + 1) * (x - stat->avg);
+
+        while (stat->min_len > 0 &&
+                stat->ring[stat->min_q[(stat->min_front + stat->min_len - 1) % window] % window] >= x) {
+                stat->min_len--;
+        }
+        stat->min_q[(stat->min_front + stat->min_len++) % window] = k;
+        while (stat->max_len > 0 &&
+                stat->ring[stat->max_q[(stat->max_front + stat->max_len - 1) % window] % window] <= x) {
+                stat->max_len--;
+        }
+        stat->max_q[(stat->max_front + stat->max_len++) % window] = k;
+
+        if (k + 1 >= window && (k + 1) % window == 0) {
+                double sum = 0, m2 = 0;
+                for (i = 0; i < window; i++) {
+                        sum += stat->ring[i];
+                }
+                stat->mean = sum / (double) window;
+                for (i = 0; i < window; i++) {
+                        m2 += (stat->ring[i] - stat->mean) * (stat->ring[i] - stat->mean);
+                }
+                stat->m2 = m2;
+        }
+}
+
+/** Routine to add a sample to a battery's charge trend.
+ * \param trend A pointer to the trend.
+ * \param window The size of the window, in samples.
+ * \param time When the sample was read, in seconds since the epoch.
+ * \param level The battery's charge (0-100%).
+ */
+static void
+rolling_trend_add(struct rolling_trend *trend,
+                  size_t window,
+                  double time,
+                  double level)
+{
+        uint64_t k = trend->samples++;
+        size_t slot = (size_t) (k % window);
+        size_t i;
+
+        if (k == 0) {
+                trend->base = time;
+                trend->level_base = level;
+                trend->st = trend->sl = trend->stt = trend->stl = 0;
+        } else if (k >= window) {
+                double t = trend->times[slot], l = trend->levels[slot];
+                trend->st -= t;
+                trend->sl -= l;
+                trend->stt -= t * t;
+                trend->stl -= t * l;
+        }
+
+        double t = time - trend->base;
+        level -= trend->level_base;
+        trend->times[slot] = t;
+        trend->levels[slot] = level;
+        trend->st += t;
+        trend->sl += level;
+        trend->stt += t * t;
+        trend->stl += t * level;
+
+        if (k + 1 >= window && (k + 1) % window == 0) {
+                // move base up to the oldest sample (which the next one will
+                // replace, so it's in slot 0), and work the sums out again
+                double shift = trend->times[0];
+                trend->base += shift;
+                trend->st = trend->sl = trend->stt = trend->stl = 0;
+                for (i = 0; i < window; i++) {
+                        t = trend->times[i] -= shift;
+                        trend->st += t;
+                        trend->sl += trend->levels[i];
+                        trend->stt += t * t;
+                        trend->stl += t * trend->levels[i];
+                }
+        }
+}
+
+/** Routine to estimate how long a battery will take to become empty or full,
+ * from its charge trend.
+ * \param trend A pointer to the trend, to which the latest sample has been
+ * added.
+ * \param window The size of the window, in samples.
+ * \param info A pointer to the battery's information, whose time_to_empty is
+ * set if the battery is discharging, or time_to_full if it's charging (and
+ * the charge is falling or rising to match).
+ */
+static void
+rolling_trend_estimate(const struct rolling_trend *trend,
+                       size_t window,
+                       struct battery_info *info)
+{
+        double n = (double) (trend->samples < window ? trend->samples : window);
+        if (n < ROLLING_TREND_MIN_SAMPLES) {
+                return;
+        }
+
+        double d = n * trend->stt - trend->st * trend->st;
+        if (d <= 0) {
+                return;
+        }
+
+        // the fitted line's slope (in % per second), and its charge as of
+        // the latest sample
+        double slope = (n * trend->stl - trend->st * trend->sl) / d;
+        double t = trend->times[(trend->samples - 1) % window];
+        double level = trend->level_base + (trend->sl + slope * (n * t - trend->st)) / n;
+
+        if (slope < 0 && strcmp(trend->status, "Discharging") == 0) {
+                info->time_to_empty = (level > 0 ? level : 0) / -slope / 3600;
+        } else if (slope > 0 && strcmp(trend->status, "Charging") == 0) {
+                info->time_to_full = (level < 100 ? 100 - level : 0) / slope / 3600;
+        }
+}
+
+/** Routine to add a sample of a battery to its rolling statistics, and fill
+ * in the battery's rolling fields from them.
+ * \param rolling A pointer to the battery's statistics, which are allocated
+ * if it points to NULL.
+ * \param info A pointer to the battery's information.
+ * \param config A pointer to the program configuration struct.
+ */
+static void
+rolling_update(struct rolling **rolling,
+               struct battery_info *info,
+               struct config *config)
+{
+        const double values[ROLLING_NUM] = {
+                [ROLLING_VOLTAGE] = info->voltage,
+                [ROLLING_CURRENT] = info->current,
+                [ROLLING_TEMPERATURE] = info->temperature,
+        };
+        int num;
+
+        if (*rolling == NULL && (*rolling = rolling_alloc(config->cmdopts.W)) == NULL) {
+                return;
+        }
+
+        size_t window = (*rolling)->window;
+        for (num = 0; num < ROLLING_NUM; num++) {
+                struct rolling_stat *stat = &(*rolling)->stats[num];
+                if (values[num] != DOUBLE_INVALID) {
+                        rolling_stat_add(stat, window, values[num]);
+                }
+                if (stat->samples == 0) {
+                        continue;
+                }
+
+                size_t n = stat->samples < window ? (size_t) stat->samples : window;
+                info->rolling[num].avg = stat->avg;
+                info->rolling[num].min = stat->ring[stat->min_q[stat->min_front] % window];
+                info->rolling[num].max = stat->ring[stat->max_q[stat->max_front] % window];
+                info->rolling[num].stddev = stat->m2 > 0 ? sqrt(stat->m2 / (double) n) : 0;
+        }
+
+        struct rolling_trend *trend = &(*rolling)->trend;
+        long charge_now = info->values[ATTR_CHARGE_NOW], charge_full = info->values[ATTR_CHARGE_FULL];
+        double level = info->charge;
+        if (charge_now != LONG_INVALID && charge_full != LONG_INVALID && charge_full > 0) {
+                level = (double) charge_now / (double) charge_full * 100;
+        }
+
+        if (info->status != NULL && strncmp(info->status, trend->status, ROLLING_STATUS_MAX - 1) != 0) {
+                size_t len = strnlen(info->status, ROLLING_STATUS_MAX - 1);
+                memcpy(trend->status, info->status, len);
+                trend->status[len] = '\0';
+                trend->samples = 0;
+        }
+        if (level != DOUBLE_INVALID && info->time != DOUBLE_INVALID) {
+                rolling_trend_add(trend, window, info->time, level);
+        }
+        rolling_trend_estimate(trend, window, info);
+}
+
+//------------------------------------------------------------------------------
+// _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
+//------------------------------------------------------------------------------
+
+// Parallel scans (-P) hand each supply to a pool of worker threads, and wait
+// for them with a deadline per supply (-T), counted from when a worker starts
+// reading it. A read which blocks in the kernel can't be cancelled, so a
+// worker which misses its deadline is left to finish in its own time: the
+// supply is reported as timed out, another worker is started in its place
+// (up to twice -P in total), and the supply isn't handed out again until the
+// stuck read returns.
+//
+// That decides where things live. Each worker reads into its own arena, which
+// only it resets, when it starts on a scan newer than its arena's contents,
+// so a stuck worker never writes into memory which a later scan is using.
+// Supplies are allocated separately from the cache's array, and one which
+// disappears while busy is freed by its worker. A worker only touches the
+// jobs array with scan_pool_lock held, and drops its result if a newer scan
+// has started in the meantime.
+
+/** Routine run by each worker thread of a parallel scan.
+ * \param arg A pointer to the worker's scan_worker structure.
+ * \return NULL.
+ */
+static void *
+scan_worker_main(void *arg)
+{
+        struct scan_worker *worker = (struct scan_worker*) arg;
+        struct scan_pool *pool = worker->pool;
+
+        pthread_mutex_lock(&scan_pool_lock);
+        for (;;) {
+                for (;;) {
+                        // skip supplies which are still busy from an earlier scan
+                        while (pool->next < pool->jobs_n && pool->jobs[pool->next].state != SCAN_JOB_PENDING) {
+                                pool->next++;
+                        }
+                        if (pool->stop || pool->next < pool->jobs_n) {
+                                break;
+                        }
+                        pthread_cond_wait(&pool->work, &scan_pool_lock);
+                }
+                if (pool->stop) {
+                        break;
+                }
+
+                size_t i = pool->next++;
+                unsigned long generation = pool->generation;
+                struct scan_job *job = &pool->jobs[i];
+                struct supply *supply = job->supply;
+                job->state = SCAN_JOB_RUNNING;
+                job->worker = worker;
+                job->started = monotonic_ns();
+                worker->busy = 1;
+                supply->busy = 1;
+                pthread_mutex_unlock(&scan_pool_lock);
+
+                if (worker->generation != generation) {
+                        arena_reset(&worker->arena);
+                        worker->generation = generation;
+                }
+
+                struct battery_info *info;
+                int err = scan_supply(&worker->arena, supply, pool->dir_fd, pool->config, &info) < 0 ? errno : 0;
+
+                pthread_mutex_lock(&scan_pool_lock);
+                worker->busy = 0;
+                worker->timed_out = 0;
+                supply->busy = 0;
+                if (supply->orphaned) {
+                        supply_close(supply);
+                        free(supply);
+                } else if (generation == pool->generation && pool->jobs[i].state == SCAN_JOB_RUNNING) {
+                        job = &pool->jobs[i];
+                        job->state = SCAN_JOB_DONE;
+                        job->info = err == 0 ? info : NULL;
+                        job->err = err;
+                        if (--pool->remaining == 0) {
+                                pthread_cond_signal(&pool->done);
+                        }
+                }
+        }
+        pthread_mutex_unlock(&scan_pool_lock);
+
+        return NULL;
+}
+
+/** Routine to start another worker thread. scan_pool_lock must be held.
+ * \param pool A pointer to the pool.
+ * \return 0 on success, -1 on error.
+ */
+static int
+scan_pool_start_worker(struct scan_pool *pool)
+{
+        struct scan_worker **workers = (struct scan_worker**) counted_realloc(pool->workers, (pool->workers_n + 1) * sizeof(struct scan_worker*));
+        if (workers == NULL) {
+                return -1;
+        }
+        pool->workers = workers;
+
+        struct scan_worker *worker = (struct scan_worker*) counted_realloc(NULL, sizeof(struct scan_worker));
+        if (worker == NULL) {
+                return -1;
+        }
+        worker->pool = pool;
+        arena_init(&worker->arena);
+        worker->generation = 0;
+        worker->busy = 0;
+        worker->timed_out = 0;
+
+        // signals are handled by the main thread
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        int err = pthread_create(&worker->thread, NULL, scan_worker_main, worker);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+        if (err != 0) {
+                free(worker);
+                errno = err;
+                return -1;
+        }
+
+        pool->workers[pool->workers_n++] = worker;
+        return 0;
+}
+
+/** Routine to set up a scan for parallel scanning, by starting its worker
+ * threads.
+ * \param scan A pointer to the scan.
+ * \param config A pointer to the program configuration struct.
+ * \return 0 on success, -1 on error.
+ */
+static int
+scan_pool_init(struct scan *scan,
+               struct config *config)
+{
+        struct scan_pool *pool = (struct scan_pool*) counted_realloc(NULL, sizeof(struct scan_pool));
+        if (pool == NULL) {
+                return -1;
+        }
+
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&pool->work, NULL);
+        pthread_cond_init(&pool->done, &attr);
+        pthread_condattr_destroy(&attr);
+
+        pool->workers = NULL;
+        pool->workers_n = 0;
+        pool->threads = (size_t) config->cmdopts.P;
+        pool->jobs = NULL;
+        pool->jobs_n = 0;
+        pool->jobs_cap = 0;
+        pool->next = 0;
+        pool->remaining = 0;
+        pool->generation = 0;
+        pool->config = config;
+        pool->dir_fd = -1;
+        pool->stop = 0;
+        scan->pool = pool;
+
+        int ret = 0;
+        pthread_mutex_lock(&scan_pool_lock);
+        while (ret == 0 && pool->workers_n < pool->threads) {
+                ret = scan_pool_start_worker(pool);
+        }
+        pthread_mutex_unlock(&scan_pool_lock);
+
+        return ret;
+}
+
+/** Routine to stop the worker threads of a parallel scan and free the pool.
+ * Workers which are stuck reading a supply can't be waited for, so if there
+ * are any, they (and the pool, which they still use) are left to be cleaned
+ * up by the program exiting.
+ * \param pool A pointer to the pool.
+ */
+static void
+scan_pool_cleanup(struct scan_pool *pool)
+{
+        size_t i;
+        int stuck = 0;
+
+        pthread_mutex_lock(&scan_pool_lock);
+        pool->stop = 1;
+        pthread_cond_broadcast(&pool->work);
+        for (i = 0; i < pool->workers_n; i++) {
+                stuck |= pool->workers[i]->busy;
+        }
+        pthread_mutex_unlock(&scan_pool_lock);
+
+        if (stuck) {
+                for (i = 0; i < pool->workers_n; i++) {
+                        pthread_detach(pool->workers[i]->thread);
+                }
+                return;
+        }
+
+        for (i = 0; i < pool->workers_n; i++) {
+                pthread_join(pool->workers[i]->thread, NULL);
+                arena_cleanup(&pool->workers[i]->arena);
+                free(pool->workers[i]);
+        }
+        free_if_not_null(pool->workers);
+        free_if_not_null(pool->jobs);
+        pthread_cond_destroy(&pool->work);
+        pthread_cond_destroy(&pool->done);
+        free(pool);
+}
+
+/** Routine to add a supply to the jobs of the current parallel scan.
+ * scan_pool_lock must be held, and the jobs not yet handed out.
+ * \param pool A pointer to the pool.
+ * \param n A pointer to the amount of jobs added so far.
+ * \param supply A pointer to the supply.
+ * \return 0 on success, -1 on error.
+ */
+static int
+scan_pool_add(struct scan_pool *pool,
+              size_t *n,
+              struct supply *supply)
+{
+        if (*n == pool->jobs_cap) {
+                size_t cap = pool->jobs_cap == 0 ? 8 : pool->jobs_cap * 2;
+                struct scan_job *jobs = (struct scan_job*) counted_realloc(pool->jobs, cap * sizeof(struct scan_job));
+                if (jobs == NULL) {
+                        return -1;
+                }
+                pool->jobs = jobs;
+                pool->jobs_cap = cap;
+        }
+
+        struct scan_job *job = &pool->jobs[(*n)++];
+        job->supply = supply;
+        job->info = NULL;
+        job->worker = NULL;
+        job->started = 0;
+        job->err = 0;
+        // a supply still being read by an earlier scan can't be read again yet
+        job->state = supply->busy ? SCAN_JOB_BUSY : SCAN_JOB_PENDING;
+
+        return 0;
+}
+
+/** Routine to hand the jobs of the current parallel scan to the workers, and
+ * wait until each is done or has missed its deadline. scan_pool_lock must be
+ * held.
+ * \param pool A pointer to the pool.
+ * \param n The amount of jobs.
+ */
+static void
+scan_pool_run(struct scan_pool *pool,
+              size_t n)
+{
+        int64_t timeout = timespec_to_ns(&pool->config->cmdopts.T);
+        size_t i;
+
+        pool->next = 0;
+        pool->remaining = 0;
+        for (i = 0; i < n; i++) {
+                pool->remaining += pool->jobs[i].state == SCAN_JOB_PENDING;
+        }
+        pool->jobs_n = n;
+        pthread_cond_broadcast(&pool->work);
+
+        while (pool->remaining > 0) {
+                int64_t now = monotonic_ns(), wake = now + timeout;
+                size_t live = 0;
+
+                for (i = 0; i < n; i++) {
+                        struct scan_job *job = &pool->jobs[i];
+                        if (job->state != SCAN_JOB_RUNNING) {
+                                continue;
+                        }
+                        if (now - job->started >= timeout) {
+                                job->state = SCAN_JOB_TIMED_OUT;
+                                job->worker->timed_out = 1;
+                                pool->remaining--;
+                        } else if (job->started + timeout < wake) {
+                                wake = job->started + timeout;
+                        }
+                }
+
+                // replace stuck workers, so that the rest of the supplies
+                // still get read
+                for (i = 0; i < pool->workers_n; i++) {
+                        live += !pool->workers[i]->timed_out;
+                }
+                while (live < pool->threads && pool->workers_n < pool->threads * 2 &&
+                        scan_pool_start_worker(pool) == 0) {
+                        live++;
+                }
+                if (live == 0) {
+                        // every worker is stuck: give up on the rest
+                        for (i = pool->next; i < n; i++) {
+                                if (pool->jobs[i].state == SCAN_JOB_PENDING) {
+                                        pool->jobs[i].state = SCAN_JOB_SKIPPED;
+                                }
+                        }
+                        pool->next = n;
+                        pool->remaining = 0;
+                }
+
+                if (pool->remaining == 0) {
+                        break;
+                }
+
+                struct timespec ts;
+                ns_to_timespec(wake, &ts);
+                pthread_cond_timedwait(&pool->done, &scan_pool_lock, &ts);
+        }
+}
+
+//------------------------------------------------------------------------------
+// _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
+//------------------------------------------------------------------------------
+
+// Batched scans (-U) go through the supplies SCAN_URING_BATCH at a time, and
+// hand each step's opens and reads to an io_uring together, so that one
+// io_uring_enter does the work of up to SCAN_URING_ENTRIES syscalls:
+//     1. open the type file of every supply which hasn't been classified yet
+//     2. read those, each followed by a (hard-linked) close
+//     3. open every battery's uevent and device/uevent, if not cached yet
+//     4. read those from offset 0, closing any beyond the fd budget
+// Each battery is then parsed as usual, with supply_read handing out what
+// step 4 read instead of calling pread. A warm scan only needs step 4, so a
+// sample of -w costs one syscall per SCAN_URING_BATCH supplies. Anything a
+// batch couldn't do (e.g: because it ran out of file descriptors) is left to
+// the synchronous path, as is reading attribute files with -L.
+//
+// The io_uring is set up with raw syscalls, so liburing isn't needed. If it
+// can't be set up (an old kernel, or io_uring being disabled), scans stay
+// synchronous.
+
+#ifdef HAVE_IO_URING
+
+/** Routine to queue an entry for the next io_uring batch.
+ * \param ring A pointer to the io_uring.
+ * \param opcode The entry's IORING_OP_* operation.
+ * \param fd The file descriptor to operate on.
+ * \param addr The entry's address argument (a path, or a buffer).
+ * \param len The entry's length argument.
+ * \param user_data The index in ring->res of the entry's result.
+ * \return A pointer to the entry, for the caller to set any other fields of.
+ */
+static struct io_uring_sqe *
+scan_uring_queue(struct scan_uring *ring,
+                 int opcode,
+                 int fd,
+                 const void *addr,
+                 unsigned len,
+                 unsigned user_data)
+{
+        unsigned i = (*ring->sq_tail + ring->queued++) & *ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[i];
+
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->opcode = (unsigned char) opcode;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t) (uintptr_t) addr;
+        sqe->len = len;
+        sqe->user_data = user_data;
+        ring->sq_array[i] = i;
+        ring->res[user_data] = -ECANCELED;
+
+        return sqe;
+}
+
+/** Routine to submit the queued entries of an io_uring batch, and wait for
+ * all of them to complete. If this fails, the io_uring is marked as broken:
+ * entries may still be in flight, so it can't be used (or freed) again.
+ * \param ring A pointer to the io_uring.
+ * \return 0 on success, -1 on error. The result of any entry which didn't
+ * complete is -ECANCELED.
+ */
+static int
+scan_uring_submit(struct scan_uring *ring)
+{
+        unsigned n = ring->queued, submitted = 0, completed = 0;
+
+        if (n == 0) {
+                return 0;
+        }
+
+        __atomic_store_n(ring->sq_tail, *ring->sq_tail + n, __ATOMIC_RELEASE);
+        ring->queued = 0;
+
+        while (completed < n) {
+                long ret = syscall(__NR_io_uring_enter, ring->fd, n - submitted, n - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+                if (ret < 0) {
+                        if (errno == EINTR || errno == EAGAIN) {
+                                continue;
+                        }
+                        ring->broken = 1;
+                        return -1;
+                }
+                submitted += (unsigned) ret;
+
+                unsigned head = *ring->cq_head;
+                while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+                        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+                        ring->res[cqe->user_data] = cqe->res;
+                        head++;
+                        completed++;
+                }
+                __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        }
+
+        return 0;
+}
+
+/** Routine to classify a batch's supplies which haven't been yet (steps 1 and
+ * 2 above). Any which can't be are left for supply_classify.
+ * \param ring A pointer to the io_uring.
+ * \param dir_fd The sysfs power supply directory (see supply_cache_open).
+ * \param supplies The batch's supplies.
+ * \param n The amount of supplies (at most SCAN_URING_BATCH).
+ */
+static void
+scan_uring_classify(struct scan_uring *ring,
+                    int dir_fd,
+                    struct supply **supplies,
+                    size_t n)
+{
+        static const char battery[] = "Battery";
+        size_t i;
+
+        for (i = 0; i < n; i++) {
+                if (!supplies[i]->classified) {
+                        scan_uring_queue(ring, IORING_OP_OPENAT, dir_fd, supply_path(ring->paths[i], supplies[i], "type"),
+                                         0, i)->open_flags = O_RDONLY | O_CLOEXEC;
+                }
+        }
+        if (ring->queued == 0 || scan_uring_submit(ring) < 0) {
+                return;
+        }
+
+        for (i = 0; i < n; i++) {
+                ring->fds[i] = supplies[i]->classified ? -1 : ring->res[i];
+        }
+        for (i = 0; i < n; i++) {
+                if (ring->fds[i] >= 0) {
+                        struct io_uring_sqe *sqe = scan_uring_queue(ring, IORING_OP_READ, ring->fds[i], ring->bufs[i],
+                                                                    sizeof(battery) - 1, i * 2);
+                        sqe->flags |= IOSQE_IO_HARDLINK;
+                        scan_uring_queue(ring, IORING_OP_CLOSE, ring->fds[i], NULL, 0, i * 2 + 1);
+                }
+        }
+        if (scan_uring_submit(ring) < 0) {
+                return;
+        }
+
+        for (i = 0; i < n; i++) {
+                int len = ring->res[i * 2];
+                if (ring->fds[i] >= 0 && len != -ECANCELED) {
+                        supplies[i]->is_battery = len == (int) sizeof(battery) - 1 &&
+                                                  !memcmp(ring->bufs[i], battery, sizeof(battery) - 1);
+                        supplies[i]->classified = 1;
+                }
+        }
+}
+
+/** Routine to read ahead the uevent files of a batch's batteries (steps 3 and
+ * 4 above), for supply_read to use. Files which can't be are left for
+ * supply_read to read itself.
+ * \param ring A pointer to the io_uring.
+ * \param dir_fd The sysfs power supply directory (see supply_cache_open).
+ * \param supplies The batch's supplies.
+ * \param n The amount of supplies (at most SCAN_URING_BATCH).
+ */
+static void
+scan_uring_prefetch(struct scan_uring *ring,
+                    int dir_fd,
+                    struct supply **supplies,
+                    size_t n)
+{
+        size_t i, k;
+        int file;
+
+        // only open as many files as can be kept open: opening files beyond
+        // the budget together could run out of descriptors, so those are
+        // left to supply_read
+        long budget = atomic_load(&supply_fds_free);
+
+        for (i = 0; i < n; i++) {
+                for (file = 0; file < SUPPLY_PREFETCH_NUM; file++) {
+                        k = i * SUPPLY_PREFETCH_NUM + file;
+                        ring->fds[k] = supplies[i]->classified && supplies[i]->is_battery ? supplies[i]->fds[file] : SUPPLY_FD_MISSING;
+                        ring->once[k] = 0;
+                        if (ring->fds[k] == SUPPLY_FD_CLOSED) {
+                                if (budget-- <= 0) {
+                                        ring->fds[k] = SUPPLY_FD_MISSING; // (not for the supply itself)
+                                        continue;
+                                }
+                                scan_uring_queue(ring, IORING_OP_OPENAT, dir_fd,
+                                                 supply_path(ring->paths[k], supplies[i], supply_file_name(file)),
+                                                 0, k)->open_flags = O_RDONLY | O_CLOEXEC;
+                        }
+                }
+        }
+        if (scan_uring_submit(ring) < 0) {
+                return;
+        }
+
+        for (i = 0; i < n; i++) {
+                for (file = 0; file < SUPPLY_PREFETCH_NUM; file++) {
+                        k = i * SUPPLY_PREFETCH_NUM + file;
+                        if (ring->fds[k] != SUPPLY_FD_CLOSED) {
+                                continue;
+                        }
+
+                        int fd = ring->res[k];
+                        ring->fds[k] = SUPPLY_FD_MISSING;
+                        if (fd >= 0) {
+                                // (the same budget as supply_read)
+                                if (atomic_fetch_sub(&supply_fds_free, 1) > 0) {
+                                        supplies[i]->fds[file] = fd;
+                                } else {
+                                        atomic_fetch_add(&supply_fds_free, 1);
+                                        ring->once[k] = 1;
+                                }
+                                ring->fds[k] = fd;
+                        } else if (fd != -EMFILE && fd != -ENFILE && fd != -ECANCELED) {
+                                supplies[i]->fds[file] = SUPPLY_FD_MISSING;
+                        }
+                }
+        }
+
+        for (k = 0; k < n * SUPPLY_PREFETCH_NUM; k++) {
+                if (ring->fds[k] >= 0) {
+                        struct io_uring_sqe *sqe = scan_uring_queue(ring, IORING_OP_READ, ring->fds[k], ring->bufs[k],
+                                                                    SYS_FS_READ_MAX, k * 2);
+                        sqe->off = 0;
+                        if (ring->once[k]) {
+                                sqe->flags |= IOSQE_IO_HARDLINK;
+                                scan_uring_queue(ring, IORING_OP_CLOSE, ring->fds[k], NULL, 0, k * 2 + 1);
+                        }
+                }
+        }
+        if (scan_uring_submit(ring) < 0) {
+                return;
+        }
+
+        for (k = 0; k < n * SUPPLY_PREFETCH_NUM; k++) {
+                int len = ring->res[k * 2];
+                if (ring->fds[k] >= 0 && len != -ECANCELED) {
+                        struct supply *supply = supplies[k / SUPPLY_PREFETCH_NUM];
+                        file = (int) (k % SUPPLY_PREFETCH_NUM);
+                        if (len >= 0) {
+                                ring->bufs[k][len] = '\0';
+                        }
+                        supply->prefetched[file] = ring->bufs[k];
+                        supply->prefetched_len[file] = len;
+                }
+        }
+}
+
+/** Routine to set up an io_uring for a scan's batched reads.
+ * \param scan A pointer to the scan.
+ * \return 0 on success, -1 on error (with errno set to EOPNOTSUPP if the
+ * kernel's io_uring lacks an operation which is needed).
+ */
+static int
+scan_uring_init(struct scan *scan)
+{
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        int fd = (int) syscall(__NR_io_uring_setup, SCAN_URING_ENTRIES, &params);
+        if (fd < 0) {
+                return -1;
+        }
+
+        struct scan_uring *ring = NULL;
+        size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+        struct io_uring_probe *probe = (struct io_uring_probe*) calloc(1, probe_size);
+        if (probe == NULL) {
+                goto fail;
+        }
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0 ||
+                probe->last_op < IORING_OP_CLOSE || probe->last_op < IORING_OP_OPENAT || probe->last_op < IORING_OP_READ ||
+                !(probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) ||
+                !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) ||
+                !(probe->ops[IORING_OP_CLOSE].flags & IO_URING_OP_SUPPORTED)) {
+                free(probe);
+                errno = EOPNOTSUPP;
+                goto fail;
+        }
+        free(probe);
+
+        if ((ring = (struct scan_uring*) counted_realloc(NULL, sizeof(struct scan_uring))) == NULL) {
+                goto fail;
+        }
+        ring->fd = fd;
+        ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                if (ring->cq_ring_size > ring->sq_ring_size) {
+                        ring->sq_ring_size = ring->cq_ring_size;
+                }
+                ring->cq_ring_size = 0;
+        }
+        ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+        ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        ring->cq_ring = ring->sq_ring;
+        if (ring->sq_ring != MAP_FAILED && ring->cq_ring_size > 0) {
+                ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        }
+        ring->sqes = (struct io_uring_sqe*) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+                int err = errno;
+                if (ring->sqes != MAP_FAILED) {
+                        munmap(ring->sqes, ring->sqes_size);
+                }
+                if (ring->cq_ring != MAP_FAILED && ring->cq_ring_size > 0) {
+                        munmap(ring->cq_ring, ring->cq_ring_size);
+                }
+                if (ring->sq_ring != MAP_FAILED) {
+                        munmap(ring->sq_ring, ring->sq_ring_size);
+                }
+                errno = err;
+                goto fail;
+        }
+
+        char *sq = (char*) ring->sq_ring, *cq = (char*) ring->cq_ring;
+        ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+        ring->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+        ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+        ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+        ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+        ring->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+        ring->queued = 0;
+        ring->broken = 0;
+        ring->supplies = NULL;
+        ring->cap = 0;
+
+        scan->uring = ring;
+        return 0;
+
+fail: {
+                int err = errno;
+                free_if_not_null(ring);
+                close(fd);
+                errno = err;
+                return -1;
+        }
+}
+
+/** Routine to clean up a scan's io_uring.
+ * \param ring A pointer to the io_uring.
+ */
+static void
+scan_uring_cleanup(struct scan_uring *ring)
+{
+        if (ring->broken) {
+                return; // entries may still be in flight (see scan_uring_submit)
+        }
+
+        munmap(ring->sqes, ring->sqes_size);
+        if (ring->cq_ring_size > 0) {
+                munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        free_if_not_null(ring->supplies);
+        free(ring);
+}
+
+/** Routine to add a supply to the current batched scan.
+ * \param ring A pointer to the io_uring.
+ * \param n A pointer to the amount of supplies added so far, which is
+ * incremented.
+ * \param supply A pointer to the supply.
+ * \return 0 on success, -1 on error.
+ */
+static int
+scan_uring_add(struct scan_uring *ring,
+               size_t *n,
+               struct supply *supply)
+{
+        if (*n == ring->cap) {
+                size_t cap = ring->cap == 0 ? 8 : ring->cap * 2;
+                struct supply **supplies = (struct supply**) counted_realloc(ring->supplies, cap * sizeof(struct supply*));
+                if (supplies == NULL) {
+                        return -1;
+                }
+                ring->supplies = supplies;
+                ring->cap = cap;
+        }
+
+        ring->supplies[(*n)++] = supply;
+        return 0;
+}
+
+#else
+
+/** Routine to set up an io_uring for a scan's batched reads (which this build
+ * doesn't support).
+ * \param scan A pointer to the scan.
+ * \return -1, with errno set to ENOSYS.
+ */
+static int
+scan_uring_init(struct scan *scan)
+{
+        errno = ENOSYS;
+        return -1;
+}
+
+#endif
+
+/** Routine to initialize a scan structure with blank values.
+ * \param scan A pointer to the structure to initialize.
+ */
+static void
+scan_init(struct scan *scan)
+{
+        arena_init(&scan->arena);
+        scan->batteries = NULL;
+        scan->supplies = NULL;
+        scan->n = 0;
+        scan->cap = 0;
+        scan->pool = NULL;
+        scan->uring = NULL;
+        scan->time = 0;
+}
+
+/** Routine to clean up a scan structure by freeing any allocated memory.
+ * \param scan A pointer to the structure to clean up.
+ */
+static void
+scan_cleanup(struct scan *scan)
+{
+        if (scan->pool != NULL) {
+                scan_pool_cleanup(scan->pool);
+        }
+#ifdef HAVE_IO_URING
+        if (scan->uring != NULL) {
+                scan_uring_cleanup(scan->uring);
+        }
+#endif
+        arena_cleanup(&scan->arena);
+        free_if_not_null(scan->batteries);
+        free_if_not_null(scan->supplies);
+        scan_init(scan);
+}
+
+/** Routine to add a battery to the results of a scan.
+ * \param scan A pointer to the scan.
+ * \param supply A pointer to the battery's cached supply.
+ * \param info A pointer to the battery's information, allocated from the
+ * scan's arena.
+ * \return 0 on success, -1 on error.
+ */
+static int
+scan_add(struct scan *scan,
+         struct supply *supply,
+         struct battery_info *info)
+{
+        if (scan->n == scan->cap) {
+                size_t cap = scan->cap == 0 ? 8 : scan->cap * 2;
+                struct battery_info **batteries = (struct battery_info**) counted_realloc(scan->batteries, cap * sizeof(struct battery_info*));
+                if (batteries == NULL) {
+                        return -1;
+                }
+                scan->batteries = batteries;
+                struct supply **supplies = (struct supply**) counted_realloc(scan->supplies, cap * sizeof(struct supply*));
+                if (supplies == NULL) {
+                        return -1;
+                }
+                scan->supplies = supplies;
+                scan->cap = cap;
+        }
+
+        scan->supplies[scan->n] = supply;
+        scan->batteries[scan->n++] = info;
+        return 0;
+}
+
+/** Routine to check whether scans need to read the power supply directory,
+ * which they don't if -n was only given plain names.
+ * \param config A pointer to the program configuration struct.
+ * \return 1 if they do, 0 if they don't.
+ */
+static int
+scan_reads_dir(struct config *config)
+{
+        return !(config->configflags & CONFIG_FLAG_BY_NAME) || config->cmdopts.n.patterns_n > 0;
+}
+
+/** Routine to get the name of the next supply which a scan should look at:
+ * with -n and only plain names, the next of those (so the directory isn't
+ * read at all); otherwise, the next directory entry (which matches -n, if it
+ * was given).
+ * \param cache A pointer to the supply cache.
+ * \param config A pointer to the program configuration struct.
+ * \param i A pointer to the index of the next plain name, starting at 0.
+ * \return The name, or NULL if there are no more.
+ */
+static const char *
+scan_next_name(struct supply_cache *cache,
+               struct config *config,
+               size_t *i)
+{
+        const struct name_set *names = &config->cmdopts.n;
+        const char *name;
+
+        if (!scan_reads_dir(config)) {
+                return *i < names->n ? names->names[(*i)++] : NULL;
+        }
+
+        while ((name = supply_cache_next_entry(cache)) != NULL) {
+                if (name[0] == '.') {
+                        continue;
+                }
+
+                // was a specific battery name provided?
+                if ((config->configflags & CONFIG_FLAG_BY_NAME) && !name_set_match(names, name)) {
+                        continue; // no match
+                }
+
+                return name;
+        }
+
+        return NULL;
+}
+
+/** Routine which reads a supply, and adds it to a scan's results if it's a
+ * battery.
+ * \param cache A pointer to the supply cache.
+ * \param scan A pointer to the scan.
+ * \param config A pointer to the program configuration struct.
+ * \param supply A pointer to the supply.
+ */
+static void
+scan_read_supply(struct supply_cache *cache,
+                 struct scan *scan,
+                 struct config *config,
+                 struct supply *supply)
+{
+        struct battery_info *info;
+
+        // is this a battery?
+        if (scan_supply(&scan->arena, supply, cache->dir_fd, config, &info) < 0) {
+                if (errno == ENODEV) {
+                        // the supply went away (or, with -n, never existed)
+                        supply->seen = 0;
+                }
+                return;
+        }
+
+        if (info != NULL) {
+                scan_add(scan, supply, info);
+        }
+}
+
+/** Routine which reads the supplies found by scan_battery_info one after
+ * another, and adds the batteries among them to the scan's results.
+ * \param cache A pointer to the supply cache.
+ * \param scan A pointer to the scan.
+ * \param config A pointer to the program configuration struct.
+ */
+static void
+scan_battery_info_serial(struct supply_cache *cache,
+                         struct scan *scan,
+                         struct config *config)
+{
+        const char *name;
+        struct supply *supply;
+        size_t i = 0;
+
+        while ((name = scan_next_name(cache, config, &i)) != NULL) {
+                if ((supply = supply_cache_lookup(cache, name)) == NULL) {
+                        continue;
+                }
+                supply->seen = 1;
+                scan_read_supply(cache, scan, config, supply);
+        }
+}
+
+/** Routine which reads the supplies found by scan_battery_info with the scan's
+ * worker threads, and adds the batteries among them to the scan's results, in
+ * directory order. Batteries which miss their deadline are added with only
+ * their name filled in, and a warning is printed.
+ * \param cache A pointer to the supply cache.
+ * \param scan A pointer to the scan.
+ * \param config A pointer to the program configuration struct.
+ */
+static void
+scan_battery_info_parallel(struct supply_cache *cache,
+                           struct scan *scan,
+                           struct config *config)
+{
+        struct scan_pool *pool = scan->pool;
+        const char *name;
+        struct supply *supply;
+        size_t i = 0, n = 0;
+
+        pthread_mutex_lock(&scan_pool_lock);
+        pool->generation++;
+        pool->jobs_n = 0;
+        pool->dir_fd = cache->dir_fd;
+
+        while ((name = scan_next_name(cache, config, &i)) != NULL) {
+                if ((supply = supply_cache_lookup(cache, name)) == NULL) {
+                        continue;
+                }
+                supply->seen = 1;
+
+                // (is_battery can't be looked at while a worker is classifying it)
+                if (!supply->busy && supply->classified && !supply->is_battery) {
+                        continue;
+                }
+
+                if (scan_pool_add(pool, &n, supply) < 0) {
+                        break;
+                }
+        }
+
+        scan_pool_run(pool, n);
+        pthread_mutex_unlock(&scan_pool_lock);
+
+        // every job is now either done, with its worker finished with the
+        // supply, or timed out, and won't be touched by its worker again
+        for (i = 0; i < n; i++) {
+                struct scan_job *job = &pool->jobs[i];
+                struct battery_info *info = job->info;
+                supply = job->supply;
+
+                switch (job->state) {
+                        case SCAN_JOB_DONE: {
+                                supply->listed = supply->is_battery;
+                                if (job->err == ENODEV) {
+                                        // the supply went away (or, with -n, never existed)
+                                        supply->seen = 0;
+                                }
+                                break;
+                        }
+                        case SCAN_JOB_TIMED_OUT: {
+                                warning("%s: reading took longer than %.3f seconds, skipping it\n", supply->name,
+                                        (double) timespec_to_ns(&config->cmdopts.T) / NSEC_PER_SEC);
+                                break;
+                        }
+                        case SCAN_JOB_BUSY: {
+                                warning("%s: still waiting for a read from an earlier scan, skipping it\n", supply->name);
+                                break;
+                        }
+                        default: {
+                                warning("%s: every worker thread is stuck, skipping it\n", supply->name);
+                                break;
+                        }
+                }
+
+                // list batteries which couldn't be read by name only
+                if (job->state != SCAN_JOB_DONE && supply->listed &&
+                        (info = (struct battery_info*) arena_alloc(&scan->arena, sizeof(struct battery_info))) != NULL) {
+                        battery_info_init(info);
+                        info->name = supply->name;
+                }
+
+                if (info != NULL) {
+                        scan_add(scan, supply, info);
+                }
+        }
+}
+
+#ifdef HAVE_IO_URING
+/** Routine which reads the supplies found by scan_battery_info in batches with
+ * the scan's io_uring, and adds the batteries among them to the scan's
+ * results.
+ * \param cache A pointer to the supply cache.
+ * \param scan A pointer to the scan.
+ * \param config A pointer to the program configuration struct.
+ */
+static void
+scan_battery_info_uring(struct supply_cache *cache,
+                        struct scan *scan,
+                        struct config *config)
+{
+        struct scan_uring *ring = scan->uring;
+        const char *name;
+        struct supply *supply;
+        size_t i = 0, n = 0, start, end;
+        int file;
+
+        while ((name = scan_next_name(cache, config, &i)) != NULL) {
+                if ((supply = supply_cache_lookup(cache, name)) == NULL) {
+                        continue;
+                }
+                supply->seen = 1;
+
+                if (supply->classified && !supply->is_battery) {
+                        continue;
+                }
+                if (scan_uring_add(ring, &n, supply) < 0) {
+                        break;
+                }
+        }
+
+        for (start = 0; start < n; start = end) {
+                end = n - start > SCAN_URING_BATCH ? start + SCAN_URING_BATCH : n;
+
+                if (!ring->broken) {
+                        scan_uring_classify(ring, cache->dir_fd, ring->supplies + start, end - start);
+                }
+                if (!ring->broken && !(config->configflags & CONFIG_FLAG_LAZY)) {
+                        scan_uring_prefetch(ring, cache->dir_fd, ring->supplies + start, end - start);
+                }
+
+                for (i = start; i < end; i++) {
+                        supply = ring->supplies[i];
+                        scan_read_supply(cache, scan, config, supply);
+                        for (file = 0; file < SUPPLY_PREFETCH_NUM; file++) {
+                                supply->prefetched[file] = NULL;
+                        }
+                }
+        }
+}
+#endif
+
+/** Routine which goes through each entry in /sys/class/power_supply (or just
+ * the ones named with -n), checks whether it's a battery, and then reads the
+ * information of each battery found into a scan structure.
+ *
+ * Everything read is allocated from the scan's arena (or, for parallel scans,
+ * the workers' arenas), which is reset first, so once the arenas, the scan
+ * and the supply cache have grown to fit every battery, a scan doesn't make
+ * any heap allocations (see alloc_count).
+ * \param cache A pointer to the supply cache, which keeps track of entries
+ * between calls.
+ * \param scan A pointer to the scan structure in which to place the results.
+ * \param config A pointer to the program configuration struct.
+ */
+static void
+scan_battery_info(struct supply_cache *cache,
+                  struct scan *scan,
+                  struct config *config)
+{
+        const char *sys_fs_path = config->sys_fs_path;
+        if (supply_cache_open(cache, sys_fs_path) < 0 ||
+                (scan_reads_dir(config) && supply_cache_rewind(cache) < 0)) {
+                fprintf(stderr, "error: couldn't open directory \"%s\": %s\n", sys_fs_path, strerror(errno));
+                exit(1);
+        }
+
+        size_t i;
+
+        arena_reset(&scan->arena);
+        scan->n = 0;
+        scan->time = realtime_ns();
+
+        for (i = 0; i < cache->n; i++) {
+                cache->supplies[i]->seen = 0;
+        }
+        cache->hint = 0;
+
+        if (scan->pool != NULL) {
+                scan_battery_info_parallel(cache, scan, config);
+#ifdef HAVE_IO_URING
+        } else if (scan->uring != NULL) {
+                scan_battery_info_uring(cache, scan, config);
+#endif
+        } else {
+                scan_battery_info_serial(cache, scan, config);
+        }
+
+        // forget about (and close the files of) any entries which have gone
+        for (i = cache->n; i-- > 0;) {
+                if (!cache->supplies[i]->seen) {
+                        supply_cache_remove(cache, i);
+                }
+        }
+
+        for (i = 0; i < scan->n; i++) {
+                scan->batteries[i]->time = (double) scan->time / NSEC_PER_SEC;
+                if (config->configflags & CONFIG_FLAG_ROLLING) {
+                        rolling_update(&scan->supplies[i]->rolling, scan->batteries[i], config);
+                }
+        }
+}
+
+/** Routine to list the batteries of a scan of every supply, as if only the
+ * supplies which -n selects had been scanned: with only plain names, in the
+ * order the names were given in, and otherwise in directory order.
+ * \param batteries The batteries, in directory order.
+ * \param n The amount of batteries.
+ * \param config A pointer to the program configuration struct.
+ */
+static void
+list_scanned_battery_info(struct battery_info **batteries,
+                          size_t n,
+                          struct config *config)
+{
+        const struct name_set *names = &config->cmdopts.n;
+        size_t i, j;
+        int index = 0;
+
+        if (!(config->configflags & CONFIG_FLAG_BY_NAME)) {
+                for (i = 0; i < n; i++) {
+                        list_battery_info(index++, batteries[i], config);
+                }
+        } else if (!scan_reads_dir(config)) {
+                for (j = 0; j < names->n; j++) {
+                        for (i = 0; i < n; i++) {
+                                if (batteries[i]->name != NULL && !strcmp(batteries[i]->name, names->names[j])) {
+                                        list_battery_info(index++, batteries[i], config);
+                                        break;
+                                }
+                        }
+                }
+        } else {
+                for (i = 0; i < n; i++) {
+                        if (batteries[i]->name != NULL && name_set_match(names, batteries[i]->name)) {
+                                list_battery_info(index++, batteries[i], config);
+                        }
+                }
+        }
+}
+
+//------------------------------------------------------------------------------
+// _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
+//------------------------------------------------------------------------------
+
+// With --shm, the daemon also publishes each scan's batteries into a snapshot
+// file which other programs can map and read without asking (see
+// batteryinfo-shm.h for its layout, and for the reading side). --max-age's
+// cache file holds one too.
+
+_Static_assert(sizeof(struct batteryinfo_shm_header) == BATTERYINFO_SHM_CACHE_LINE,
+               "the snapshot header must be one cache line");
+_Static_assert(sizeof(struct batteryinfo_shm_battery) == 2 * BATTERYINFO_SHM_CACHE_LINE,
+               "a snapshot battery must be two cache lines");
+
+/** Routine to create a snapshot to publish batteries into. Any existing file
+ * at path is replaced rather than rewritten, so that anything still reading a
+ * previous daemon's snapshot keeps a consistent copy of it.
+ * \param path The snapshot's path.
+ * \return A pointer to the snapshot, or NULL on error.
+ */
+static struct batteryinfo_shm *
+shm_create(const char *path)
+{
+        unlink(path);
+
+        int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0) {
+                return NULL;
+        }
+
+        void *p = MAP_FAILED;
+        if (ftruncate(fd, sizeof(struct batteryinfo_shm)) == 0) {
+                p = mmap(NULL, sizeof(struct batteryinfo_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        if (p == MAP_FAILED) {
+                int err = errno;
+                close(fd);
+                unlink(path);
+                errno = err;
+                return NULL;
+        }
+        close(fd);
+
+        // the file starts out zeroed; magic goes last, so that a reader which
+        // sees it sees a valid header
+        struct batteryinfo_shm *shm = (struct batteryinfo_shm*) p;
+        shm->header.version = BATTERYINFO_SHM_VERSION;
+        shm->header.size = sizeof(struct batteryinfo_shm);
+        shm->header.strings_n = 1;
+        __atomic_store_n(&shm->header.magic, BATTERYINFO_SHM_MAGIC, __ATOMIC_RELEASE);
+
+        return shm;
+}
+
+/** Routine to find a string in a snapshot's string table, adding it if it
+ * isn't there. The table is small, and most of it is the same few statuses,
+ * so it's searched linearly.
+ * \param shm A pointer to the snapshot.
+ * \param str The string, or NULL.
+ * \return The string's index, or 0 if str is NULL or the table is full.
+ */
+static uint16_t
+shm_intern(struct batteryinfo_shm *shm,
+           const char *str)
+{
+        if (str == NULL) {
+                return 0;
+        }
+
+        size_t len = strnlen(str, BATTERYINFO_SHM_STRING_MAX - 1);
+        uint32_t i, n = shm->header.strings_n;
+
+        for (i = 1; i < n; i++) {
+                if (shm->strings[i][len] == '\0' && !memcmp(shm->strings[i], str, len)) {
+                        return (uint16_t) i;
+                }
+        }
+
+        if (n == BATTERYINFO_SHM_STRINGS) {
+                shm->header.dropped++;
+                return 0;
+        }
+
+        memcpy(shm->strings[n], str, len);
+        shm->strings[n][len] = '\0';
+        __atomic_store_n(&shm->header.strings_n, n + 1, __ATOMIC_RELEASE);
+
+        return (uint16_t) n;
+}
+
+/** Routine to convert a double from a battery_info structure for a snapshot.
+ * \param d The double.
+ * \return d, or NaN if it's DOUBLE_INVALID.
+ */
+static double
+shm_double(double d)
+{
+        return d == DOUBLE_INVALID ? NAN : d;
+}
+
+/** Routine to publish the batteries of a scan into a snapshot.
+ * \param shm A pointer to the snapshot.
+ * \param scan A pointer to the scan structure holding the batteries.
+ */
+static void
+shm_publish(struct batteryinfo_shm *shm,
+            struct scan *scan)
+{
+        size_t i, n = scan->n < BATTERYINFO_SHM_MAX_BATTERIES ? scan->n : BATTERYINFO_SHM_MAX_BATTERIES;
+        uint64_t seq = shm->header.seq | 1; // (already odd if a writer was killed mid-write)
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        __atomic_store_n(&shm->header.seq, seq, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        shm->header.dropped = (uint32_t) (scan->n - n);
+
+        for (i = 0; i < n; i++) {
+                struct battery_info *info = scan->batteries[i];
+                struct batteryinfo_shm_battery *b = &shm->batteries[i];
+
+                b->charge = shm_double(info->charge);
+                b->max_charge = shm_double(info->max_charge);
+                b->voltage = shm_double(info->voltage);
+                b->current = shm_double(info->current);
+                b->temperature = shm_double(info->temperature);
+                b->etd = shm_double(info->etd);
+                b->status = shm_intern(shm, info->status);
+                b->present = (int8_t) info->present;
+                b->online = (int8_t) info->online;
+                b->charging_enabled = (int8_t) info->charging_enabled;
+
+                b->name = shm_intern(shm, scan->supplies[i]->name);
+                b->model = shm_intern(shm, info->model);
+                b->manufacturer = shm_intern(shm, info->manufacturer);
+                b->technology = shm_intern(shm, info->technology);
+                b->driver = shm_intern(shm, info->driver);
+                b->health = shm_intern(shm, info->health);
+                b->serial_number = shm_intern(shm, info->serial_number);
+                b->charge_type = shm_intern(shm, info->charge_type);
+                b->charge_rate = shm_intern(shm, info->charge_rate);
+        }
+
+        __atomic_store_n(&shm->header.n, (uint32_t) n, __ATOMIC_RELAXED);
+        __atomic_store_n(&shm->header.sample_time, (uint64_t) timespec_to_ns(&now), __ATOMIC_RELAXED);
+        __atomic_store_n(&shm->header.seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+//------------------------------------------------------------------------------
+// _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
+//------------------------------------------------------------------------------
+
+// With --max-age, the batteries are shared between invocations through a
+// cache file in $XDG_RUNTIME_DIR (or CACHE_DEFAULT_DIR), holding a snapshot
+// in the same format as --shm's. An invocation which finds the snapshot too
+// old takes an exclusive flock on the file, reads every supply, and publishes
+// them into it (or, if its string table is nearly full, into a new file which
+// replaces it). Anyone else who finds it too old in the meantime makes do with
+// the previous snapshot, or waits for the lock if there isn't one. Snapshots
+// which couldn't hold every battery aren't used.
+
+/** Routine to work out the path of the cache file. Each sysfs root gets its
+ * own.
+ * \param path The buffer to place the path in, PATH_MAX bytes long.
+ * \param config A pointer to the program configuration struct.
+ * \return 0 on success, -1 if there's nowhere to put it.
+ */
+static int
+cache_path(char *path,
+           struct config *config)
+{
+        const char *dir = getenv(CACHE_DIR_ENV);
+        int n;
+
+        if (dir == NULL || *dir == '\0') {
+                dir = CACHE_DEFAULT_DIR;
+        }
+
+        if (!strcmp(config->sys_fs_path, SYS_FS_BATTERY_BASE_PATH)) {
+                n = snprintf(path, PATH_MAX, "%s/" CACHE_FILE_NAME ".cache", dir);
+        } else {
+                n = snprintf(path, PATH_MAX, "%s/" CACHE_FILE_NAME "-%08x.cache", dir,
+                             (unsigned int) name_hash(config->sys_fs_path));
+        }
+
+        return n > 0 && n < PATH_MAX ? 0 : -1;
+}
+
+/** Routine to map a cache file, if it holds a snapshot.
+ * \param fd The cache file, open for reading and writing.
+ * \return A pointer to the snapshot, or NULL if it doesn't hold one.
+ */
+static struct batteryinfo_shm *
+cache_map(int fd)
+{
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size != sizeof(struct batteryinfo_shm)) {
+                return NULL;
+        }
+
+        void *p = mmap(NULL, sizeof(struct batteryinfo_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+                return NULL;
+        }
+
+        struct batteryinfo_shm *shm = (struct batteryinfo_shm*) p;
+        if (__atomic_load_n(&shm->header.magic, __ATOMIC_ACQUIRE) != BATTERYINFO_SHM_MAGIC ||
+                shm->header.version != BATTERYINFO_SHM_VERSION ||
+                shm->header.size != sizeof(struct batteryinfo_shm)) {
+                munmap(p, sizeof(struct batteryinfo_shm));
+                return NULL;
+        }
+
+        return shm;
+}
+
+/** Routine to copy the batteries out of a cached snapshot. Like
+ * batteryinfo_shm_read, this gives up if the snapshot stays half-written,
+ * which it does if whoever was writing it was killed.
+ * \param shm A pointer to the snapshot.
+ * \param batteries The array to copy the batteries into, at least
+ * BATTERYINFO_SHM_MAX_BATTERIES long.
+ * \param max_age The oldest the snapshot may be, in nanoseconds, or -1 for
+ * any age.
+ * \param sample_time A pointer to where to place when the batteries were read
+ * (CLOCK_MONOTONIC, in nanoseconds).
+ * \return The amount of batteries, -1 if the snapshot is too old, has never
+ * been written, or stayed half-written, or -2 if it couldn't hold every
+ * battery.
+ */
+static int
+cache_read(const struct batteryinfo_shm *shm,
+           struct batteryinfo_shm_battery *batteries,
+           int64_t max_age,
+           int64_t *sample_time)
+{
+        struct timespec now;
+        int tries;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        for (tries = 0; tries < CACHE_READ_TRIES; tries++) {
+                uint64_t seq = __atomic_load_n(&shm->header.seq, __ATOMIC_ACQUIRE);
+                if (seq & 1) {
+                        continue;
+                }
+
+                uint32_t n = __atomic_load_n(&shm->header.n, __ATOMIC_RELAXED);
+                uint32_t dropped = __atomic_load_n(&shm->header.dropped, __ATOMIC_RELAXED);
+                uint64_t t = __atomic_load_n(&shm->header.sample_time, __ATOMIC_RELAXED);
+                if (n > BATTERYINFO_SHM_MAX_BATTERIES) {
+                        n = BATTERYINFO_SHM_MAX_BATTERIES;
+                }
+                memcpy(batteries, shm->batteries, n * sizeof(struct batteryinfo_shm_battery));
+
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&shm->header.seq, __ATOMIC_RELAXED) != seq) {
+                        continue;
+                }
+
+                if (seq == 0 || (max_age >= 0 && timespec_to_ns(&now) - (int64_t) t > max_age)) {
+                        return -1;
+                }
+                *sample_time = (int64_t) t;
+                if (dropped != 0) {
+                        return -2;
+                }
+                return (int) n;
+        }
+
+        return -1;
+}
+
+/** Routine to convert a double from a snapshot for a battery_info structure.
+ * \param d The double.
+ * \return d, or DOUBLE_INVALID if it's NaN.
+ */
+static double
+cache_double(double d)
+{
+        return isnan(d) ? DOUBLE_INVALID : d;
+}
+
+/** Routine to fill in a battery_info structure from a cached battery. Its
+ * strings point into the snapshot, which never changes them, and anything
+ * the snapshot doesn't hold is left blank.
+ * \param shm A pointer to the snapshot.
+ * \param b A pointer to the cached battery.
+ * \param info A pointer to the structure to fill in.
+ */
+static void
+cache_battery_info(const struct batteryinfo_shm *shm,
+                   const struct batteryinfo_shm_battery *b,
+                   struct battery_info *info)
+{
+        battery_info_init(info);
+
+        info->charge = cache_double(b->charge);
+        info->max_charge = cache_double(b->max_charge);
+        info->voltage = cache_double(b->voltage);
+        info->current = cache_double(b->current);
+        info->temperature = cache_double(b->temperature);
+        info->etd = cache_double(b->etd);
+
+        info->name = (char*) batteryinfo_shm_string(shm, b->name);
+        info->model = (char*) batteryinfo_shm_string(shm, b->model);
+        info->manufacturer = (char*) batteryinfo_shm_string(shm, b->manufacturer);
+        info->technology = (char*) batteryinfo_shm_string(shm, b->technology);
+        info->driver = (char*) batteryinfo_shm_string(shm, b->driver);
+        info->status = (char*) batteryinfo_shm_string(shm, b->status);
+        info->health = (char*) batteryinfo_shm_string(shm, b->health);
+        info->serial_number = (char*) batteryinfo_shm_string(shm, b->serial_number);
+        info->charge_type = (char*) batteryinfo_shm_string(shm, b->charge_type);
+        info->charge_rate = (char*) batteryinfo_shm_string(shm, b->charge_rate);
+
+        info->present = (char) b->present;
+        info->online = (char) b->online;
+        info->charging_enabled = (char) b->charging_enabled;
+}
+
+/** Routine to write a scan into a new cache file, which then replaces the
+ * existing one (if any).
+ * \param path The cache file's path.
+ * \param scan A pointer to the scan structure holding the batteries.
+ */
+static void
+cache_replace(const char *path,
+              struct scan *scan)
+{
+        char tmp[PATH_MAX];
+        if (snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long) getpid()) >= (int) sizeof(tmp)) {
+                return;
+        }
+
+        struct batteryinfo_shm *shm = shm_create(tmp);
+        if (shm == NULL) {
+                return;
+        }
+
+        shm_publish(shm, scan);
+        munmap(shm, sizeof(struct batteryinfo_shm));
+
+        if (rename(tmp, path) < 0) {
+                unlink(tmp);
+        }
+}
+
+/** Routine to output the batteries from the cache file, reading them and
+ * updating it first if it's older than --max-age.
+ * \param cache A pointer to the supply cache.
+ * \param scan A pointer to the scan structure to read battery information into.
+ * \param config A pointer to the program configuration struct.
+ * \return 0 on success, -1 if the cache can't be used (the batteries should
+ * then be read as usual).
+ */
+static int
+cache_list(struct supply_cache *cache,
+           struct scan *scan,
+           struct config *config)
+{
+        struct batteryinfo_shm_battery cached[BATTERYINFO_SHM_MAX_BATTERIES];
+        struct battery_info infos[BATTERYINFO_SHM_MAX_BATTERIES];
+        struct battery_info *batteries[BATTERYINFO_SHM_MAX_BATTERIES];
+        struct batteryinfo_shm *shm = NULL;
+        int64_t max_age = (int64_t) config->cmdopts.A * (NSEC_PER_SEC / 1000), sample_time = 0;
+        int fd, n = -1, locked = 0, i;
+        char path[PATH_MAX];
+
+        if (cache_path(path, config) < 0) {
+                return -1;
+        }
+
+        if ((fd = open(path, O_RDWR | O_CLOEXEC)) >= 0 && (shm = cache_map(fd)) != NULL &&
+                (n = cache_read(shm, cached, max_age, &sample_time)) == -1) {
+                if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+                        locked = 1;
+                } else if ((n = cache_read(shm, cached, -1, &sample_time)) == -1 && flock(fd, LOCK_EX) == 0) {
+                        locked = 1;
+                }
+
+                // it may have been updated while the lock was being taken
+                if (locked) {
+                        n = cache_read(shm, cached, max_age, &sample_time);
+                }
+        }
+
+        if (n == -2) {
+                // there are too many batteries to cache, so everyone reads
+                // them for themselves
+                if (locked) {
+                        flock(fd, LOCK_UN);
+                }
+                munmap(shm, sizeof(struct batteryinfo_shm));
+                close(fd);
+                return -1;
+        } else if (n >= 0) {
+                double time = (double) (realtime_ns() - (monotonic_ns() - sample_time)) / NSEC_PER_SEC;
+                for (i = 0; i < n; i++) {
+                        cache_battery_info(shm, &cached[i], &infos[i]);
+                        infos[i].time = time;
+                        batteries[i] = &infos[i];
+
+                        // a one-off run only ever has one sample, so the
+                        // rolling fields come out as they would from a scan
+                        if (config->configflags & CONFIG_FLAG_ROLLING) {
+                                struct rolling *rolling = NULL;
+                                rolling_update(&rolling, &infos[i], config);
+                                free_if_not_null(rolling);
+                        }
+                }
+
+                battery_info_output_init(config);
+                list_scanned_battery_info(batteries, (size_t) n, config);
+                battery_info_output_deinit(config);
+        } else {
+                // every battery is cached, whatever -n asks for
+                struct config all = *config;
+                all.configflags &= ~CONFIG_FLAG_BY_NAME;
+                scan_battery_info(cache, scan, &all);
+
+                // (with too many batteries, this tells everyone else so)
+                if (locked && shm->header.strings_n + CACHE_STRINGS_PER_BATTERY * scan->n <= BATTERYINFO_SHM_STRINGS) {
+                        shm_publish(shm, scan);
+                } else {
+                        cache_replace(path, scan);
+                }
+
+                battery_info_output_init(config);
+                list_scanned_battery_info(scan->batteries, scan->n, config);
+                battery_info_output_deinit(config);
+        }
+
+        if (locked) {
+                flock(fd, LOCK_UN);
+        }
+        if (shm != NULL) {
+                munmap(shm, sizeof(struct batteryinfo_shm));
+        }
+        if (fd >= 0) {
+                close(fd);
+        }
+
+        output_flush();
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
+//------------------------------------------------------------------------------
+
+// The client side of --daemon (see daemon_battery_info). A request is a single
+// line of tab-separated fields:
+//
+//     batteryinfo/2 <sysfs root> <format> <flags> <output sequence> [<name>...]
+//
+// where <format> is the name of the output format (as given to -F), <flags> is
+// '-', or any of 'd' (-d), 'N' (-N) and 'h' (the client has already output a
+// CSV header), and the names are the -n names and patterns. The daemon answers
+// with "ok\n" followed by exactly what would have been output had the
+// batteries been read directly, or with "error <reason>\n", and then closes
+// the connection.
+
+/** Routine to connect to a daemon's socket.
+ * \param path The socket's path.
+ * \return The connected socket, or -1 on error.
+ */
+static int
+client_connect(const char *path)
+{
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+                errno = ENAMETOOLONG;
+                return -1;
+        }
+        strcpy(addr.sun_path, path);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                return -1;
+        }
+
+        // a daemon which has stopped answering is no better than none at all
+        struct timeval tv = { DAEMON_IO_TIMEOUT, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+                int err = errno;
+                close(fd);
+                errno = err;
+                return -1;
+        }
+
+        return fd;
+}
+
+/** Routine to append a request field, preceded by a tab, to the output buffer.
+ * \param field The field.
+ * \return 0 on success, -1 if the field can't be sent (it contains a tab or a
+ * newline).
+ */
+static int
+client_field(const char *field)
+{
+        if (strpbrk(field, "\t\n") != NULL) {
+                return -1;
+        }
+
+        output_lit("\t");
+        output_mem(field, strlen(field));
+        return 0;
+}
+
+/** Routine to ask a daemon for the battery information which would otherwise
+ * be read and output. On success, the answer is left in the output buffer.
+ * \param config A pointer to the program configuration struct.
+ * \return 0 on success, -1 if there's no daemon, or it couldn't answer.
+ */
+static int
+client_query(struct config *config)
+{
+        int fd = client_connect(config->socket_path);
+        if (fd < 0) {
+                return -1;
+        }
+
+        char flags[4], *f = flags;
+        if (config->configflags & CONFIG_FLAG_DIGITS) {
+                *f++ = 'd';
+        }
+        if (config->configflags & CONFIG_FLAG_DISABLE_CHARGE_CAP) {
+                *f++ = 'N';
+        }
+        if (config->plan->header_done) {
+                *f++ = 'h';
+        }
+        if (f == flags) {
+                *f++ = '-';
+        }
+        *f = '\0';
+
+        int bad = 0;
+        size_t i;
+
+        output_lit(DAEMON_PROTOCOL);
+        bad |= client_field(config->sys_fs_path);
+        bad |= client_field(output_format_names[config->output_format]);
+        bad |= client_field(flags);
+        bad |= client_field(config->plan->infostr);
+        if (config->configflags & CONFIG_FLAG_BY_NAME) {
+                for (i = 0; i < config->cmdopts.n.n; i++) {
+                        bad |= client_field(config->cmdopts.n.names[i]);
+                }
+                for (i = 0; i < config->cmdopts.n.patterns_n; i++) {
+                        bad |= client_field(config->cmdopts.n.patterns[i]);
+                }
+        }
+        output_lit("\n");
+
+        if (bad || output_send(fd) < 0) {
+                output.len = 0;
+                close(fd);
+                return -1;
+        }
+        shutdown(fd, SHUT_WR);
+
+        for (;;) {
+                char *dest = output_reserve(OUTPUT_BUF_SIZE);
+                if (dest == NULL) {
+                        break;
+                }
+
+                ssize_t n = read(fd, dest, output.cap - output.len);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n <= 0) {
+                        bad = n < 0;
+                        break;
+                }
+                output.len += (size_t) n;
+        }
+        close(fd);
+
+        if (bad || output.len < 3 || memcmp(output.data, "ok\n", 3) != 0) {
+                output.len = 0;
+                return -1;
+        }
+
+        memmove(output.data, output.data + 3, output.len - 3);
+        output.len -= 3;
+
+        if (config->output_format == OUTPUT_FORMAT_CSV && output.len > 0) {
+                config->plan->header_done = 1; // (the daemon output one)
+        }
+
+        return 0;
+}
+
+/** Routine which scans /sys/class/power_supply for batteries, and then calls
+ * list_battery_info for each battery found.
+ * \param cache A pointer to the supply cache, which keeps track of entries
+ * between calls.
+ * \param scan A pointer to the scan structure to read battery information into.
+ * \param config A pointer to the program configuration struct.
+ */
+static void
+list_all_battery_info(struct supply_cache *cache,
+                      struct scan *scan,
+                      struct config *config)
+{
+        size_t i;
+
+        if ((config->configflags & CONFIG_FLAG_CLIENT) && client_query(config) == 0) {
+                output_flush();
+                return;
+        }
+        if ((config->configflags & CONFIG_FLAG_MAX_AGE) && cache_list(cache, scan, config) == 0) {
+                return;
+        }
+
+        scan_battery_info(cache, scan, config);
+
+        battery_info_output_init(config);
+
+        for (i = 0; i < scan->n; i++) {
+                list_battery_info((int) i, scan->batteries[i], config);
+        }
+
+        battery_info_output_deinit(config);
+
+        output_flush();
+}
+
+//------------------------------------------------------------------------------
+// _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
+//------------------------------------------------------------------------------
+
+// A history log (--record) keeps every sample taken, for as long as wanted,
+// in a file which is preallocated HISTORY_GROW blocks at a time and mapped.
+// Each block holds a run of samples column by column, as the integers read
+// from sysfs rather than the doubles worked out from them: a value is stored
+// as a varint of the zigzagged difference from the one before it (for times,
+// of the change in that difference), and a run of zero differences as a
+// single token, so a steadily discharging battery takes a few bytes per
+// sample. The block being filled is rewritten under a sequence number after
+// every sample, so logs can be read back (--replay) while they're being
+// written. As blocks are written in time order, the range of a replay is
+// found by binary search on their headers, and only the blocks in it are
+// decoded. A log which is opened again is appended to from a new block.
+
+_Static_assert(sizeof(struct history_file) == 4096, "history log names must fill a page");
+_Static_assert(sizeof(struct history_block) == HISTORY_BLOCK_SIZE, "history blocks must be HISTORY_BLOCK_SIZE bytes");
+
+/** The statuses which can be recorded, by their value in a block's status
+ * column. Any other status is recorded as "Unknown". */
+static const char *const history_statuses[HISTORY_STATUSES_NUM] = {
+        NULL, "Unknown", "Charging", "Discharging", "Not charging", "Full"
+};
+
+/** Routine to get a block of a mapped history log.
+ * \param file A pointer to the mapped log.
+ * \param i The block's index.
+ * \return A pointer to the block.
+ */
+static struct history_block *
+history_block_at(const struct history_file *file,
+                 uint64_t i)
+{
+        return (struct history_block*) ((char*) file + sizeof(struct history_file) + i * HISTORY_BLOCK_SIZE);
+}
+
+/** Routine to work out how many bytes a value takes as a varint.
+ * \param v The value.
+ * \return The amount of bytes.
+ */
+static size_t
+history_varint_len(uint64_t v)
+{
+        size_t n = 1;
+
+        while (v >= 0x80) {
+                v >>= 7;
+                n++;
+        }
+
+        return n;
+}
+
+/** Routine to encode a value as a varint: 7 bits per byte, least significant
+ * first, with the top bit set on every byte but the last.
+ * \param p Where to encode the value (room for HISTORY_VARINT_MAX bytes).
+ * \param v The value.
+ * \return The amount of bytes written.
+ */
+static size_t
+history_varint_put(uint8_t *p,
+                   uint64_t v)
+{
+        size_t n = 0;
+
+        while (v >= 0x80) {
+                p[n++] = (uint8_t) (v | 0x80);
+                v >>= 7;
+        }
+        p[n++] = (uint8_t) v;
+
+        return n;
+}
+
+/** Routine to decode a varint.
+ * \param p A pointer to the varint's first byte, which is advanced past it.
+ * \param end The end of the data the varint is in.
+ * \param v A pointer to where to place the value.
+ * \return 0 on success, -1 if the varint is truncated or too long.
+ */
+static int
+history_varint_get(const uint8_t **p,
+                   const uint8_t *end,
+                   uint64_t *v)
+{
+        const uint8_t *q = *p;
+        uint64_t r = 0;
+        unsigned shift;
+
+        for (shift = 0; q < end && shift < 64; shift += 7) {
+                uint8_t b = *q++;
+                r |= (uint64_t) (b & 0x7f) << shift;
+                if (!(b & 0x80)) {
+                        *p = q;
+                        *v = r;
+                        return 0;
+                }
+        }
+
+        return -1;
+}
+
+/** Routine to work out how many bytes a run of zero residuals takes once
+ * encoded.
+ * \param run The length of the run.
+ * \return The amount of bytes.
+ */
+static size_t
+history_run_len(uint32_t run)
+{
+        if (run < 2) {
+                return run;
+        }
+
+        return 1 + history_varint_len(run);
+}
+
+/** Routine to encode a run of zero residuals: nothing if it's empty, a single
+ * zero if that's shorter, or else a HISTORY_TOKEN_RUN token and its length.
+ * \param p Where to encode the run (room for history_run_len bytes).
+ * \param run The length of the run.
+ * \return The amount of bytes written.
+ */
+static size_t
+history_run_put(uint8_t *p,
+                uint32_t run)
+{
+        if (run < 2) {
+                if (run == 1) {
+                        p[0] = HISTORY_TOKEN_VALUE; // zigzag(0)
+                }
+                return run;
+        }
+
+        p[0] = HISTORY_TOKEN_RUN;
+        return 1 + history_varint_put(p + 1, run);
+}
+
+/** Routine to add a value to a column of the block being filled.
+ * \param col A pointer to the column.
+ * \param value The value, or INT64_MIN if it's unknown (which times never
+ * are).
+ * \param order 1 to encode the difference from the last value, or 2 to encode
+ * the change in that difference (for times, which are evenly spaced).
+ */
+static void
+history_column_add(struct history_column *col,
+                   int64_t value,
+                   int order)
+{
+        if (value == INT64_MIN) {
+                col->len += history_run_put(col->data + col->len, col->run);
+                col->run = 0;
+                col->data[col->len++] = HISTORY_TOKEN_MISSING;
+                return;
+        }
+
+        int64_t delta = (int64_t) ((uint64_t) value - (uint64_t) col->prev);
+        int64_t residual = delta;
+        if (order == 2) {
+                residual = (int64_t) ((uint64_t) delta - (uint64_t) col->prev_delta);
+                col->prev_delta = delta;
+        }
+        col->prev = value;
+
+        if (residual == 0) {
+                col->run++;
+                return;
+        }
+
+        uint64_t zigzag = ((uint64_t) residual << 1) ^ (uint64_t) (residual >> 63);
+        col->len += history_run_put(col->data + col->len, col->run);
+        col->run = 0;
+        col->len += history_varint_put(col->data + col->len, zigzag + HISTORY_TOKEN_VALUE);
+}
+
+/** Routine to read the next value from a column of a block.
+ * \param cur A pointer to the reader's position in the column.
+ * \param order The order the column was encoded with (see
+ * history_column_add).
+ * \param value A pointer to where to place the value (INT64_MIN if it's
+ * unknown).
+ * \return 0 on success, -1 if the column is corrupt.
+ */
+static int
+history_cursor_next(struct history_cursor *cur,
+                    int order,
+                    int64_t *value)
+{
+        uint64_t u = HISTORY_TOKEN_VALUE;
+
+        if (cur->run > 0) {
+                cur->run--;
+        } else {
+                if (history_varint_get(&cur->p, cur->end, &u) < 0) {
+                        return -1;
+                }
+                if (u == HISTORY_TOKEN_RUN) {
+                        if (history_varint_get(&cur->p, cur->end, &cur->run) < 0 || cur->run == 0) {
+                                return -1;
+                        }
+                        cur->run--;
+                        u = HISTORY_TOKEN_VALUE;
+                } else if (u == HISTORY_TOKEN_MISSING) {
+                        *value = INT64_MIN;
+                        return 0;
+                }
+        }
+
+        u -= HISTORY_TOKEN_VALUE;
+        int64_t delta = (int64_t) ((u >> 1) ^ -(u & 1));
+        if (order == 2) {
+                delta = (int64_t) ((uint64_t) cur->prev_delta + (uint64_t) delta);
+                cur->prev_delta = delta;
+        }
+        cur->prev = (int64_t) ((uint64_t) cur->prev + (uint64_t) delta);
+
+        *value = cur->prev;
+        return 0;
+}
+
+/** Routine to map a history log.
+ * \param fd The log's file.
+ * \param size The size of the file.
+ * \param prot The protection to map it with.
+ * \return A pointer to the mapped log, or NULL on error (errno is set to
+ * EPROTO if it isn't a history log of this version).
+ */
+static struct history_file *
+history_map(int fd,
+            size_t size,
+            int prot)
+{
+        if (size < sizeof(struct history_file)) {
+                errno = EPROTO;
+                return NULL;
+        }
+
+        void *p = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+                return NULL;
+        }
+
+        struct history_file *file = (struct history_file*) p;
+        if (file->header.magic != HISTORY_MAGIC || file->header.version != HISTORY_VERSION ||
+                file->header.block_size != HISTORY_BLOCK_SIZE) {
+                munmap(p, size);
+                errno = EPROTO;
+                return NULL;
+        }
+
+        return file;
+}
+
+/** Routine to preallocate room for HISTORY_GROW more blocks at the end of a
+ * history log (so that writing them can't fail for lack of space), and map
+ * it.
+ * \param h A pointer to the log.
+ * \return 0 on success, -1 on error.
+ */
+static int
+history_grow(struct history *h)
+{
+        size_t old = sizeof(struct history_file) + h->cap * HISTORY_BLOCK_SIZE;
+        size_t size = old + HISTORY_GROW * HISTORY_BLOCK_SIZE;
+
+        int err = posix_fallocate(h->fd, 0, (off_t) size);
+        if (err != 0) {
+                errno = err;
+                return -1;
+        }
+
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, h->fd, 0);
+        if (p == MAP_FAILED) {
+                return -1;
+        }
+
+        munmap(h->file, old);
+        h->file = (struct history_file*) p;
+        h->cap += HISTORY_GROW;
+        return 0;
+}
+
+/** Routine to find a supply's index in a history log's names, adding its name
+ * if it isn't there yet.
+ * \param h A pointer to the log.
+ * \param supply A pointer to the supply.
+ * \return The index, or -1 if the log can't name any more supplies.
+ */
+static int
+history_supply(struct history *h,
+               struct supply *supply)
+{
+        struct history_header *header = &h->file->header;
+        char name[HISTORY_NAME_MAX];
+        uint32_t i;
+
+        if (supply->history_id >= 0) {
+                return supply->history_id;
+        }
+
+        memset(name, 0, sizeof(name));
+        memcpy(name, supply->name, strnlen(supply->name, sizeof(name) - 1));
+        for (i = 0; i < header->supplies_n; i++) {
+                if (!strcmp(h->file->names[i], name)) {
+                        return supply->history_id = (int) i;
+                }
+        }
+
+        if (i == HISTORY_MAX_SUPPLIES) {
+                return -1;
+        }
+
+        memcpy(h->file->names[i], name, sizeof(name));
+        __atomic_store_n(&header->supplies_n, i + 1, __ATOMIC_RELEASE);
+        return supply->history_id = (int) i;
+}
+
+/** Routine to make sure that there is room for the columns of a block in a
+ * history log, and point each at its storage.
+ * \param h A pointer to the log.
+ * \param columns The amount of columns.
+ * \return 0 on success, -1 on error.
+ */
+static int
+history_columns_alloc(struct history *h,
+                      size_t columns)
+{
+        size_t i;
+
+        if (columns > h->columns_cap) {
+                free(h->columns);
+                free(h->saved);
+                free(h->column_data);
+                h->columns = (struct history_column*) counted_realloc(NULL, columns * sizeof(struct history_column));
+                h->saved = (struct history_column*) counted_realloc(NULL, columns * sizeof(struct history_column));
+                h->column_data = (uint8_t*) counted_realloc(NULL, columns * HISTORY_COLUMN_CAP);
+                if (h->columns == NULL || h->saved == NULL || h->column_data == NULL) {
+                        h->columns_cap = 0;
+                        return -1;
+                }
+                h->columns_cap = columns;
+        }
+
+        for (i = 0; i < columns; i++) {
+                h->columns[i].data = h->column_data + i * HISTORY_COLUMN_CAP;
+        }
+
+        return 0;
+}
+
+/** Routine to start filling a new block of a history log, after the current
+ * one if it has any samples.
+ * \param h A pointer to the log.
+ * \param supplies The index of the name of each battery in the block's
+ * samples.
+ * \param n The amount of batteries.
+ * \param time When the first sample was read (in milliseconds).
+ * \return 0 on success, -1 on error.
+ */
+static int
+history_block_start(struct history *h,
+                    const uint8_t *supplies,
+                    uint32_t n,
+                    int64_t time)
+{
+        size_t columns = 1 + (size_t) n * HISTORY_FIELDS;
+        size_t i;
+
+        if (history_columns_alloc(h, columns) < 0) {
+                return -1;
+        }
+
+        if (h->samples > 0) {
+                h->block++;
+                h->samples = 0;
+        }
+        while (h->block >= h->cap) {
+                if (history_grow(h) < 0) {
+                        return -1;
+                }
+        }
+
+        for (i = 0; i < columns; i++) {
+                struct history_column *col = &h->columns[i];
+                col->len = 0;
+                col->prev = 0;
+                col->prev_delta = 0;
+                col->run = 0;
+        }
+        h->columns[0].prev = time;
+
+        memcpy(h->supplies, supplies, n);
+        h->supplies_n = n;
+        h->first_time = time;
+        return 0;
+}
+
+/** Routine to work out how much of a block's data the block being filled
+ * takes.
+ * \param h A pointer to the log.
+ * \return The amount of bytes.
+ */
+static size_t
+history_block_len(const struct history *h)
+{
+        size_t columns = 1 + (size_t) h->supplies_n * HISTORY_FIELDS;
+        size_t len = h->supplies_n;
+        size_t i;
+
+        for (i = 0; i < columns; i++) {
+                size_t col_len = h->columns[i].len + history_run_len(h->columns[i].run);
+                len += history_varint_len(col_len) + col_len;
+        }
+
+        return len;
+}
+
+/** Routine to add a sample to the block being filled in a history log, if it
+ * fits.
+ * \param h A pointer to the log.
+ * \param batteries The sample's batteries, in the block's order.
+ * \param time When the sample was read (in milliseconds).
+ * \return 0 on success, -1 if the block is full (it is left as it was).
+ */
+static int
+history_block_add(struct history *h,
+                  const struct battery_info **batteries,
+                  int64_t time)
+{
+        size_t columns = 1 + (size_t) h->supplies_n * HISTORY_FIELDS;
+        struct history_column *col = &h->columns[1];
+        uint32_t i;
+        int a;
+
+        memcpy(h->saved, h->columns, columns * sizeof(struct history_column));
+
+        history_column_add(&h->columns[0], time, 2);
+        for (i = 0; i < h->supplies_n; i++) {
+                const struct battery_info *info = batteries[i];
+                for (a = 0; a < ATTR_LONG_NUM; a++) {
+                        history_column_add(col++, info->values[a] == LONG_INVALID ? INT64_MIN : info->values[a], 1);
+                }
+
+                int64_t status = INT64_MIN;
+                if (info->status != NULL) {
+                        for (status = 1; status < (int64_t) HISTORY_STATUSES_NUM; status++) {
+                                if (!strcmp(history_statuses[status], info->status)) {
+                                        break;
+                                }
+                        }
+                        if (status == (int64_t) HISTORY_STATUSES_NUM) {
+                                status = 1;
+                        }
+                }
+                history_column_add(col++, status, 1);
+        }
+
+        if (history_block_len(h) > sizeof(((struct history_block*) NULL)->data)) {
+                memcpy(h->columns, h->saved, columns * sizeof(struct history_column));
+                return -1;
+        }
+
+        h->samples++;
+        h->last_time = time;
+        return 0;
+}
+
+/** Routine to write the block being filled into a history log.
+ * \param h A pointer to the log.
+ */
+static void
+history_block_write(struct history *h)
+{
+        struct history_block *block = history_block_at(h->file, h->block);
+        size_t columns = 1 + (size_t) h->supplies_n * HISTORY_FIELDS;
+        size_t i;
+
+        uint64_t seq = block->seq | 1; // (already odd if a writer was killed mid-write)
+        __atomic_store_n(&block->seq, seq, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        uint8_t *p = block->data;
+        memcpy(p, h->supplies, h->supplies_n);
+        p += h->supplies_n;
+        for (i = 0; i < columns; i++) {
+                const struct history_column *col = &h->columns[i];
+                p += history_varint_put(p, col->len + history_run_len(col->run));
+                memcpy(p, col->data, col->len);
+                p += col->len;
+                p += history_run_put(p, col->run);
+        }
+
+        block->first_time = h->first_time;
+        block->last_time = h->last_time;
+        block->samples = (uint16_t) h->samples;
+        block->len = (uint16_t) (p - block->data);
+        block->supplies_n = (uint8_t) h->supplies_n;
+
+        __atomic_store_n(&block->seq, seq + 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&h->file->header.blocks, h->block + 1, __ATOMIC_RELEASE);
+}
+
+/** Routine to append the batteries of a scan to a history log.
+ * \param h A pointer to the log.
+ * \param scan A pointer to the scan structure holding the batteries.
+ * \return 0 on success, -1 if the log couldn't be grown to fit them.
+ */
+static int
+history_append(struct history *h,
+               struct scan *scan)
+{
+        struct history_header *header = &h->file->header;
+        const struct battery_info *batteries[HISTORY_MAX_SUPPLIES];
+        uint8_t supplies[HISTORY_MAX_SUPPLIES];
+        uint32_t n = 0;
+        size_t i;
+
+        for (i = 0; i < scan->n; i++) {
+                int supply = history_supply(h, scan->supplies[i]);
+                if (supply < 0 || n == HISTORY_MAX_SUPPLIES) {
+                        header->dropped++;
+                        continue;
+                }
+                supplies[n] = (uint8_t) supply;
+                batteries[n++] = scan->batteries[i];
+        }
+        if (n == 0) {
+                return 0;
+        }
+
+        // a block only holds samples of the same batteries
+        int64_t time = scan->time / NSEC_PER_MSEC;
+        if (h->samples == 0 || h->samples == HISTORY_BLOCK_SAMPLES_MAX ||
+                n != h->supplies_n || memcmp(supplies, h->supplies, n) != 0) {
+                if (history_block_start(h, supplies, n, time) < 0) {
+                        return -1;
+                }
+        }
+
+        if (history_block_add(h, batteries, time) < 0) {
+                if (h->samples == 0) {
+                        h->file->header.dropped += n; // (too many batteries for a block)
+                        return 0;
+                }
+                if (history_block_start(h, supplies, n, time) < 0) {
+                        return -1;
+                }
+                if (history_block_add(h, batteries, time) < 0) {
+                        h->file->header.dropped += n;
+                        return 0;
+                }
+        }
+
+        history_block_write(h);
+        return 0;
+}
+
+/** Routine to copy a consistent block out of a history log, which might be
+ * being rewritten.
+ * \param src A pointer to the block in the log.
+ * \param dst A pointer to where to copy it.
+ * \return 0 on success, -1 if it was being rewritten every time it was read.
+ */
+static int
+history_block_read(const struct history_block *src,
+                   struct history_block *dst)
+{
+        int tries;
+
+        for (tries = 0; tries < HISTORY_READ_TRIES; tries++) {
+                uint64_t seq = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE);
+                if (seq & 1) {
+                        continue; // being written
+                }
+
+                memcpy(dst, src, sizeof(struct history_block));
+
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&src->seq, __ATOMIC_RELAXED) == seq) {
+                        return 0;
+                }
+        }
+
+        return -1;
+}
+
+/** Routine to find the columns of a block.
+ * \param block A pointer to the block.
+ * \param cursors An array of 1 + block->supplies_n * HISTORY_FIELDS cursors,
+ * to place the start of each column into.
+ * \return 0 on success, -1 if the block is corrupt.
+ */
+static int
+history_block_columns(const struct history_block *block,
+                      struct history_cursor *cursors)
+{
+        const uint8_t *p = block->data;
+        const uint8_t *end = block->data + block->len;
+        size_t columns = 1 + (size_t) block->supplies_n * HISTORY_FIELDS;
+        size_t i;
+
+        if (block->len > sizeof(block->data) || block->supplies_n > HISTORY_MAX_SUPPLIES ||
+                block->supplies_n > block->len) {
+                return -1;
+        }
+
+        // (the names' indices are used to index arrays by readers)
+        for (i = 0; i < block->supplies_n; i++) {
+                if (block->data[i] >= HISTORY_MAX_SUPPLIES) {
+                        return -1;
+                }
+        }
+
+        p += block->supplies_n;
+        for (i = 0; i < columns; i++) {
+                uint64_t len;
+                if (history_varint_get(&p, end, &len) < 0 || len > (uint64_t) (end - p)) {
+                        return -1;
+                }
+                cursors[i].p = p;
+                cursors[i].end = p + len;
+                cursors[i].prev = 0;
+                cursors[i].prev_delta = 0;
+                cursors[i].run = 0;
+                p += len;
+        }
+        cursors[0].prev = block->first_time;
+
+        return 0;
+}
+
+/** Routine to carry on filling the last block of a history log which has
+ * been opened again, so that recording a sample at a time (running
+ * batteryinfo -r once per sample) doesn't take a block per sample.
+ * \param h A pointer to the log, which has at least one block.
+ * \return 0 on success, -1 if the block can't be carried on with (in which
+ * case the next sample starts a new one).
+ */
+static int
+history_block_resume(struct history *h)
+{
+        const struct history_block *block = history_block_at(h->file, h->block - 1);
+        struct history_cursor cursors[1 + HISTORY_MAX_SUPPLIES * HISTORY_FIELDS];
+        size_t columns = 1 + (size_t) block->supplies_n * HISTORY_FIELDS;
+        size_t i;
+        uint32_t k;
+
+        // (an odd sequence number means the last writer was killed mid-write)
+        if ((block->seq & 1) || block->samples == 0 || block->samples >= HISTORY_BLOCK_SAMPLES_MAX ||
+                history_block_columns(block, cursors) < 0 || history_columns_alloc(h, columns) < 0) {
+                return -1;
+        }
+
+        // the values are decoded for the last of each column, which the next
+        // sample's are encoded against; runs are left as they were encoded
+        for (i = 0; i < columns; i++) {
+                struct history_cursor *cur = &cursors[i];
+                struct history_column *col = &h->columns[i];
+                const uint8_t *start = cur->p;
+                int64_t v;
+
+                for (k = 0; k < block->samples; k++) {
+                        if (history_cursor_next(cur, i == 0 ? 2 : 1, &v) < 0) {
+                                return -1;
+                        }
+                }
+                if (cur->p != cur->end || cur->run != 0) {
+                        return -1;
+                }
+
+                col->len = (size_t) (cur->end - start);
+                memcpy(col->data, start, col->len);
+                col->prev = cur->prev;
+                col->prev_delta = cur->prev_delta;
+                col->run = 0;
+        }
+
+        h->block--;
+        h->samples = block->samples;
+        h->supplies_n = block->supplies_n;
+        memcpy(h->supplies, block->data, block->supplies_n);
+        h->first_time = block->first_time;
+        h->last_time = block->last_time;
+        return 0;
+}
+
+/** Routine to open a history log for appending, creating it if it doesn't
+ * exist.
+ * \param h A pointer to the structure to open the log into.
+ * \param path The log's path.
+ * \return 0 on success, -1 on error (errno is set to EWOULDBLOCK if another
+ * process is appending to it, or EPROTO if it isn't a history log of this
+ * version).
+ */
+static int
+history_open(struct history *h,
+             const char *path)
+{
+        struct stat st;
+
+        memset(h, 0, sizeof(*h));
+        h->path = path;
+
+        if ((h->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+                return -1;
+        }
+        if (flock(h->fd, LOCK_EX | LOCK_NB) < 0 || fstat(h->fd, &st) < 0) {
+                goto fail;
+        }
+
+        if (st.st_size == 0) {
+                int err = posix_fallocate(h->fd, 0, sizeof(struct history_file) + HISTORY_GROW * HISTORY_BLOCK_SIZE);
+                if (err != 0) {
+                        errno = err;
+                        goto fail;
+                }
+
+                void *p = mmap(NULL, sizeof(struct history_file), PROT_READ | PROT_WRITE, MAP_SHARED, h->fd, 0);
+                if (p == MAP_FAILED) {
+                        goto fail;
+                }
+                struct history_file *file = (struct history_file*) p;
+                file->header.version = HISTORY_VERSION;
+                file->header.block_size = HISTORY_BLOCK_SIZE;
+                __atomic_store_n(&file->header.magic, HISTORY_MAGIC, __ATOMIC_RELEASE);
+                munmap(p, sizeof(struct history_file));
+
+                st.st_size = (off_t) (sizeof(struct history_file) + HISTORY_GROW * HISTORY_BLOCK_SIZE);
+        }
+
+        h->cap = ((size_t) st.st_size - sizeof(struct history_file)) / HISTORY_BLOCK_SIZE;
+        h->file = history_map(h->fd, sizeof(struct history_file) + h->cap * HISTORY_BLOCK_SIZE, PROT_READ | PROT_WRITE);
+        if (h->file == NULL) {
+                goto fail;
+        }
+        if (h->file->header.blocks > h->cap) {
+                errno = EPROTO; // (truncated)
+                goto fail;
+        }
+        h->block = h->file->header.blocks;
+        if (h->block > 0) {
+                history_block_resume(h);
+        }
+
+        return 0;
+
+fail:;
+        int err = errno;
+        if (h->file != NULL) {
+                munmap(h->file, sizeof(struct history_file) + h->cap * HISTORY_BLOCK_SIZE);
+        }
+        close(h->fd);
+        errno = err;
+        return -1;
+}
+
+/** Routine to close a history log.
+ * \param h A pointer to the log.
+ */
+static void
+history_close(struct history *h)
+{
+        munmap(h->file, sizeof(struct history_file) + h->cap * HISTORY_BLOCK_SIZE);
+        close(h->fd);
+        free(h->columns);
+        free(h->saved);
+        free(h->column_data);
+}
+
+/** Routine to read the next sample of a block into battery_info structures.
+ * Their names point into the log.
+ * \param file A pointer to the mapped log.
+ * \param supplies_n The amount of supply names in the log.
+ * \param block A pointer to the block.
+ * \param cursors The block's columns (see history_block_columns).
+ * \param infos An array of block->supplies_n structures to fill in.
+ * \param time A pointer to where to place when the sample was read (in
+ * milliseconds).
+ * \return 0 on success, -1 if the block is corrupt.
+ */
+static int
+history_block_next(const struct history_file *file,
+                   uint32_t supplies_n,
+                   const struct history_block *block,
+                   struct history_cursor *cursors,
+                   struct battery_info *infos,
+                   int64_t *time)
+{
+        struct history_cursor *cur = &cursors[1];
+        uint32_t i;
+        int a;
+
+        if (history_cursor_next(&cursors[0], 2, time) < 0) {
+                return -1;
+        }
+
+        for (i = 0; i < block->supplies_n; i++) {
+                struct battery_info *info = &infos[i];
+                int64_t v;
+
+                battery_info_init(info);
+                for (a = 0; a < ATTR_LONG_NUM; a++) {
+                        if (history_cursor_next(cur++, 1, &v) < 0) {
+                                return -1;
+                        }
+                        info->values[a] = v == INT64_MIN ? LONG_INVALID : (long) v;
+                }
+                if (history_cursor_next(cur++, 1, &v) < 0) {
+                        return -1;
+                }
+                if (v > 0 && v < (int64_t) HISTORY_STATUSES_NUM) {
+                        info->status = (char*) history_statuses[v];
+                }
+
+                battery_info_compute(info, info->values);
+                info->time = (double) *time / 1000;
+                if (block->data[i] < supplies_n) {
+                        info->name = (char*) file->names[block->data[i]];
+                }
+        }
+
+        return 0;
+}
+
+/** Routine to map the history log to read for --replay or --query, printing
+ * an error if it can't be.
+ * \param config A pointer to the program configuration struct.
+ * \param size A pointer to where to place the size of the mapping.
+ * \param n A pointer to where to place the amount of blocks in the log.
+ * \return A pointer to the mapped log, or NULL on error.
+ */
+static const struct history_file *
+history_map_read(struct config *config,
+                 size_t *size,
+                 uint64_t *n)
+{
+        struct stat st;
+        int fd = open(config->history_path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st) < 0) {
+                error("couldn't open %s: %s\n", config->history_path, strerror(errno));
+                if (fd >= 0) {
+                        close(fd);
+                }
+                return NULL;
+        }
+
+        const struct history_file *file = history_map(fd, (size_t) st.st_size, PROT_READ);
+        close(fd);
+        if (file == NULL) {
+                error("couldn't read %s: %s\n", config->history_path, errno == EPROTO ? "not a history log" : strerror(errno));
+                return NULL;
+        }
+
+        size_t cap = ((size_t) st.st_size - sizeof(struct history_file)) / HISTORY_BLOCK_SIZE;
+        *n = __atomic_load_n(&file->header.blocks, __ATOMIC_ACQUIRE);
+        if (*n > cap) {
+                *n = cap;
+        }
+        *size = (size_t) st.st_size;
+        return file;
+}
+
+/** Routine to find the first block of a history log which ends at or after
+ * a time, by binary search.
+ * \param file A pointer to the mapped log.
+ * \param n The amount of blocks in the log.
+ * \param since The time (CLOCK_REALTIME, in nanoseconds).
+ * \return The block's index, or n if there isn't one.
+ */
+static uint64_t
+history_block_find(const struct history_file *file,
+                   uint64_t n,
+                   int64_t since)
+{
+        uint64_t lo = 0, hi = n;
+
+        while (lo < hi) {
+                uint64_t mid = lo + (hi - lo) / 2;
+                if (__atomic_load_n(&history_block_at(file, mid)->last_time, __ATOMIC_RELAXED) * NSEC_PER_MSEC < since) {
+                        lo = mid + 1;
+                } else {
+                        hi = mid;
+                }
+        }
+
+        return lo;
+}
+
+/** Routine to output the samples recorded in a history log between --since
+ * and --until, as if each had just been read (only the numbers, the flags,
+ * the status and the names are known).
+ * \param config A pointer to the program configuration struct.
+ * \return 0 on success, -1 on error.
+ */
+static int
+history_replay(struct config *config)
+{
+        size_t size;
+        uint64_t n;
+        const struct history_file *file = history_map_read(config, &size, &n);
+        if (file == NULL) {
+                return -1;
+        }
+
+        uint32_t supplies_n = __atomic_load_n(&file->header.supplies_n, __ATOMIC_ACQUIRE);
+        uint64_t lo = history_block_find(file, n, config->cmdopts.s);
+
+        struct history_block block;
+        struct history_cursor cursors[1 + HISTORY_MAX_SUPPLIES * HISTORY_FIELDS];
+        struct battery_info infos[HISTORY_MAX_SUPPLIES];
+        struct battery_info *batteries[HISTORY_MAX_SUPPLIES];
+        struct rolling *rollings[HISTORY_MAX_SUPPLIES]; // by name
+        unsigned long samples = 0;
+        uint64_t b;
+        uint32_t i, k;
+
+        for (i = 0; i < HISTORY_MAX_SUPPLIES; i++) {
+                batteries[i] = &infos[i];
+                rollings[i] = NULL;
+        }
+
+        for (b = lo; b < n; b++) {
+                if (history_block_read(history_block_at(file, b), &block) < 0 ||
+                        history_block_columns(&block, cursors) < 0) {
+                        warning("skipping corrupt block %llu of %s\n", (unsigned long long) b, config->history_path);
+                        continue;
+                }
+                if (block.samples > 0 && block.first_time * NSEC_PER_MSEC > config->cmdopts.u) {
+                        break;
+                }
+
+                for (k = 0; k < block.samples; k++) {
+                        int64_t time;
+                        if (history_block_next(file, supplies_n, &block, cursors, infos, &time) < 0) {
+                                warning("skipping corrupt block %llu of %s\n", (unsigned long long) b, config->history_path);
+                                break;
+                        }
+                        if (time * NSEC_PER_MSEC < config->cmdopts.s) {
+                                continue;
+                        }
+                        if (time * NSEC_PER_MSEC > config->cmdopts.u) {
+                                goto done;
+                        }
+                        if (config->configflags & CONFIG_FLAG_ROLLING) {
+                                for (i = 0; i < block.supplies_n; i++) {
+                                        rolling_update(&rollings[block.data[i]], &infos[i], config);
+                                }
+                        }
+
+                        battery_info_output_init(config);
+                        list_scanned_battery_info(batteries, block.supplies_n, config);
+                        battery_info_output_deinit(config);
+
+                        if (output.len >= OUTPUT_BUF_SIZE) {
+                                output_flush();
+                        }
+                        if (config->cmdopts.c != 0 && ++samples >= config->cmdopts.c) {
+                                goto done;
+                        }
+                }
+        }
+
+done:
+        output_flush();
+
+        for (i = 0; i < HISTORY_MAX_SUPPLIES; i++) {
+                free_if_not_null(rollings[i]);
+        }
+        munmap((void*) file, size);
+        return 0;
+}
+
+/** Routine to take a single sample, and append it to the --record history
+ * log.
+ * \param cache A pointer to the supply cache.
+ * \param scan A pointer to the scan structure to read battery information into.
+ * \param config A pointer to the program configuration struct.
+ * \return 0 on success, -1 on error.
+ */
+static int
+history_sample(struct supply_cache *cache,
+               struct scan *scan,
+               struct config *config)
+{
+        scan_battery_info(cache, scan, config);
+
+        if (history_append(config->history, scan) < 0) {
+                error("couldn't grow %s: %s\n", config->history->path, strerror(errno));
+                return -1;
+        }
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
+//------------------------------------------------------------------------------
+
+// A query (--query) aggregates the samples of a history log between --since
+// and --until, split into --buckets equal spans of time: for each battery with
+// samples in a bucket, the minimum, mean and maximum of each number, estimates
+// of percentiles of the current, and how long was spent in each status. The
+// log is read a block at a time, and its samples decoded QUERY_CHUNK at a time
+// into a column per number per battery, which is then aggregated in one pass.
+// Nothing is kept between buckets but each battery's running aggregates, so
+// the memory used doesn't depend on how much of the log is queried.
+
+/** The percentiles of the current which --query estimates, as quantiles. */
+static const double query_quantiles[QUERY_QUANTILES_NUM] = { 0.5, 0.9, 0.99 };
+
+/** Routine to initialize a quantile estimator.
+ * \param e A pointer to the estimator.
+ * \param p The quantile to estimate (0-1).
+ */
+static void
+quantile_init(struct quantile *e,
+              double p)
+{
+        e->p = p;
+        e->count = 0;
+}
+
+/** Routine to add a value to a quantile estimator (see Jain and Chlamtac,
+ * "The P-square algorithm for dynamic calculation of quantiles and histograms
+ * without storing observations").
+ * \param e A pointer to the estimator.
+ * \param x The value.
+ */
+static void
+quantile_add(struct quantile *e,
+             double x)
+{
+        int i, k;
+
+        if (e->count < 5) {
+                // the first five values are the markers, in order
+                for (i = (int) e->count; i > 0 && e->q[i - 1] > x; i--) {
+                        e->q[i] = e->q[i - 1];
+                }
+                e->q[i] = x;
+
+                if (++e->count == 5) {
+                        for (i = 0; i < 5; i++) {
+                                e->n[i] = i;
+                        }
+                        e->want[0] = 0;
+                        e->want[1] = 2 * e->p;
+                        e->want[2] = 4 * e->p;
+                        e->want[3] = 2 + 2 * e->p;
+                        e->want[4] = 4;
+                }
+                return;
+        }
+        e->count++;
+
+        if (x < e->q[0]) {
+                e->q[0] = x;
+                k = 0;
+        } else if (x >= e->q[4]) {
+                e->q[4] = x;
+                k = 3;
+        } else {
+                for (k = 0; x >= e->q[k + 1]; k++) {
+                }
+        }
+
+        for (i = k + 1; i < 5; i++) {
+                e->n[i]++;
+        }
+        e->want[1] += e->p / 2;
+        e->want[2] += e->p;
+        e->want[3] += (1 + e->p) / 2;
+        e->want[4] += 1;
+
+        // move the middle markers which are a position or more from where
+        // they should be, predicting their new heights with a parabola (or a
+        // line, if the parabola would put them out of order)
+        for (i = 1; i < 4; i++) {
+                double d = e->want[i] - e->n[i];
+                if ((d >= 1 && e->n[i + 1] - e->n[i] > 1) || (d <= -1 && e->n[i - 1] - e->n[i] < -1)) {
+                        double s = d >= 0 ? 1 : -1;
+                        double q = e->q[i] + s / (e->n[i + 1] - e->n[i - 1]) *
+                                ((e->n[i] - e->n[i - 1] + s) * (e->q[i + 1] - e->q[i]) / (e->n[i + 1] - e->n[i]) +
+                                 (e->n[i + 1] - e->n[i] - s) * (e->q[i] - e->q[i - 1]) / (e->n[i] - e->n[i - 1]));
+                        if (!(e->q[i - 1] < q && q < e->q[i + 1])) {
+                                int j = i + (int) s;
+                                q = e->q[i] + s * (e->q[j] - e->q[i]) / (e->n[j] - e->n[i]);
+                        }
+                        e->q[i] = q;
+                        e->n[i] += s;
+                }
+        }
+}
+
+/** Routine to get a quantile estimator's estimate.
+ * \param e A pointer to the estimator.
+ * \return The estimate (exact, for fewer than five values), or DOUBLE_INVALID
+ * if no values have been added.
+ */
+static double
+quantile_value(const struct quantile *e)
+{
+        if (e->count == 0) {
+                return DOUBLE_INVALID;
+        }
+        if (e->count < 5) {
+                return e->q[(size_t) ((double) (e->count - 1) * e->p + 0.5)];
+        }
+
+        return e->q[2];
+}
+
+/** Routine to empty a battery's running aggregates.
+ * \param acc A pointer to the aggregates.
+ */
+static void
+query_acc_reset(struct query_acc *acc)
+{
+        int i;
+
+        acc->samples = 0;
+        for (i = 0; i < QUERY_NUM; i++) {
+                acc->min[i] = INFINITY;
+                acc->max[i] = -INFINITY;
+                acc->sum[i] = 0;
+                acc->n[i] = 0;
+        }
+        for (i = 0; i < QUERY_QUANTILES_NUM; i++) {
+                quantile_init(&acc->current_p[i], query_quantiles[i]);
+        }
+        for (i = 0; i < QUERY_STATUSES_NUM; i++) {
+                acc->status_time[i] = 0;
+        }
+}
+
+/** Routine to add a column of a number's values to a battery's running
+ * aggregates. The loop doesn't branch, so that it can be vectorized.
+ * \param acc A pointer to the aggregates.
+ * \param num The number, from QUERY_*.
+ * \param v The values (DOUBLE_INVALID where unknown).
+ * \param n The amount of values.
+ */
+static void
+query_acc_column(struct query_acc *acc,
+                 int num,
+                 const double *v,
+                 size_t n)
+{
+        double min = acc->min[num], max = acc->max[num], sum = 0;
+        unsigned long known = 0;
+        size_t i;
+
+        for (i = 0; i < n; i++) {
+                double x = v[i];
+                int ok = x != DOUBLE_INVALID;
+                min = ok && x < min ? x : min;
+                max = ok && x > max ? x : max;
+                sum += ok ? x : 0.0;
+                known += (unsigned long) ok;
+        }
+
+        acc->min[num] = min;
+        acc->max[num] = max;
+        acc->sum[num] += sum;
+        acc->n[num] += known;
+}
+
+/** Routine to add the samples in a chunk to their batteries' running
+ * aggregates, and empty it. The time from one of a battery's samples to the
+ * next counts towards the first one's status (in the bucket of the second).
+ * \param chunk A pointer to the chunk.
+ * \param supplies The state of each battery, by name index.
+ */
+static void
+query_chunk_flush(struct query_chunk *chunk,
+                  struct query_supply *supplies)
+{
+        size_t i;
+        uint32_t p;
+        int num, q;
+
+        for (p = 0; p < chunk->supplies_n; p++) {
+                struct query_supply *qs = &supplies[chunk->supplies[p]];
+                struct query_acc *acc = &qs->acc;
+
+                acc->samples += chunk->n;
+                for (num = 0; num < QUERY_NUM; num++) {
+                        query_acc_column(acc, num, chunk->values[p][num], chunk->n);
+                }
+
+                const double *current = chunk->values[p][QUERY_CURRENT];
+                for (i = 0; i < chunk->n; i++) {
+                        if (current[i] != DOUBLE_INVALID) {
+                                for (q = 0; q < QUERY_QUANTILES_NUM; q++) {
+                                        quantile_add(&acc->current_p[q], current[i]);
+                                }
+                        }
+                }
+
+                for (i = 0; i < chunk->n; i++) {
+                        int64_t t = chunk->time[i];
+                        if (qs->last_time != INT64_MIN) {
+                                int64_t dt = t - qs->last_time;
+                                if (dt >= 0 && (qs->last_interval == 0 || dt <= qs->last_interval * QUERY_GAP_FACTOR)) {
+                                        acc->status_time[qs->last_status] += dt;
+                                }
+                                qs->last_interval = dt;
+                        }
+                        qs->last_time = t;
+                        qs->last_status = chunk->status[p][i];
+                }
+        }
+
+        chunk->n = 0;
+}
+
+/** Routine to output every battery's aggregates over a bucket, and empty
+ * them.
+ * \param file A pointer to the mapped log.
+ * \param names_n The amount of supply names in the log.
+ * \param supplies The state of each battery, by name index.
+ * \param start When the bucket starts (in milliseconds).
+ * \param end When the bucket ends.
+ * \param config A pointer to the program configuration struct.
+ */
+static void
+query_output_bucket(const struct history_file *file,
+                    uint32_t names_n,
+                    struct query_supply *supplies,
+                    int64_t start,
+                    int64_t end,
+                    struct config *config)
+{
+        const struct output_step *steps = config->plan->steps;
+        size_t n = config->plan->n, i;
+        int s, num, index = 0;
+
+        for (s = 0; s < HISTORY_MAX_SUPPLIES; s++) {
+                struct query_acc *acc = &supplies[s].acc;
+                struct query_stats stats;
+
+                if (acc->samples == 0) {
+                        continue;
+                }
+
+                stats.name = (uint32_t) s < names_n ? (char*) file->names[s] : NULL;
+                if ((config->configflags & CONFIG_FLAG_BY_NAME) &&
+                        (stats.name == NULL || !name_set_match(&config->cmdopts.n, stats.name))) {
+                        query_acc_reset(acc);
+                        continue;
+                }
+                stats.start = (double) start / 1000;
+                stats.end = (double) end / 1000;
+                stats.samples = acc->samples;
+                for (num = 0; num < QUERY_NUM; num++) {
+                        if (acc->n[num] == 0) {
+                                stats.aggs[num].min = DOUBLE_INVALID;
+                                stats.aggs[num].mean = DOUBLE_INVALID;
+                                stats.aggs[num].max = DOUBLE_INVALID;
+                        } else {
+                                stats.aggs[num].min = acc->min[num];
+                                stats.aggs[num].mean = acc->sum[num] / (double) acc->n[num];
+                                stats.aggs[num].max = acc->max[num];
+                        }
+                }
+                for (i = 0; i < QUERY_QUANTILES_NUM; i++) {
+                        stats.current_p[i] = quantile_value(&acc->current_p[i]);
+                }
+                for (i = 0; i < QUERY_STATUSES_NUM; i++) {
+                        stats.status_time[i] = (double) acc->status_time[i] / 1000;
+                }
+
+                battery_info_output_start(index++, config);
+                for (i = 0; i < n; i++) {
+                        output_mem(steps[i].label, steps[i].label_len);
+                        steps[i].fn((const char*) &stats + steps[i].offset);
+                }
+                battery_info_output_end(config);
+
+                query_acc_reset(acc);
+        }
+
+        if (output.len >= OUTPUT_BUF_SIZE) {
+                output_flush();
+        }
+}
+
+/** Routine to output aggregates of the samples recorded in a history log
+ * between --since and --until, for each of --buckets equal spans of that time
+ * (which, without --since or --until, starts or ends with the samples).
+ * \param config A pointer to the program configuration struct.
+ * \return 0 on success, -1 on error.
+ */
+static int
+history_query(struct config *config)
+{
+        size_t size;
+        uint64_t n;
+        const struct history_file *file = history_map_read(config, &size, &n);
+        if (file == NULL) {
+                return -1;
+        }
+
+        struct query_chunk *chunk = malloc(sizeof(struct query_chunk));
+        struct query_supply *supplies = malloc(HISTORY_MAX_SUPPLIES * sizeof(struct query_supply));
+        if (chunk == NULL || supplies == NULL) {
+                error("out of memory\n");
+                free_if_not_null(chunk);
+                free_if_not_null(supplies);
+                munmap((void*) file, size);
+                return -1;
+        }
+        int i;
+        for (i = 0; i < HISTORY_MAX_SUPPLIES; i++) {
+                query_acc_reset(&supplies[i].acc);
+                supplies[i].last_time = INT64_MIN;
+                supplies[i].last_interval = 0;
+                supplies[i].last_status = 0;
+        }
+        chunk->n = 0;
+
+        uint32_t names_n = __atomic_load_n(&file->header.supplies_n, __ATOMIC_ACQUIRE);
+        uint64_t lo = history_block_find(file, n, config->cmdopts.s);
+
+        battery_info_output_init(config);
+        if (lo == n) {
+                goto done;
+        }
+
+        int64_t start = config->cmdopts.s == INT64_MIN ?
+                __atomic_load_n(&history_block_at(file, lo)->first_time, __ATOMIC_RELAXED) :
+                config->cmdopts.s / NSEC_PER_MSEC;
+        int64_t end = config->cmdopts.u == INT64_MAX ?
+                __atomic_load_n(&history_block_at(file, n - 1)->last_time, __ATOMIC_RELAXED) :
+                config->cmdopts.u / NSEC_PER_MSEC;
+        if (end < start) {
+                goto done;
+        }
+        uint64_t span = (uint64_t) (end - start) + 1;
+        uint64_t buckets = config->cmdopts.b;
+        uint64_t bucket = 0;
+
+        struct history_block block;
+        struct history_cursor cursors[1 + HISTORY_MAX_SUPPLIES * HISTORY_FIELDS];
+        struct battery_info infos[HISTORY_MAX_SUPPLIES];
+        uint64_t b;
+        uint32_t k, p;
+
+        for (b = lo; b < n; b++) {
+                if (history_block_read(history_block_at(file, b), &block) < 0 ||
+                        history_block_columns(&block, cursors) < 0) {
+                        warning("skipping corrupt block %llu of %s\n", (unsigned long long) b, config->history_path);
+                        continue;
+                }
+                if (block.samples > 0 && block.first_time > end) {
+                        break;
+                }
+
+                // the chunk's columns are laid out by the block's batteries
+                chunk->supplies_n = block.supplies_n;
+                memcpy(chunk->supplies, block.data, block.supplies_n);
+
+                for (k = 0; k < block.samples; k++) {
+                        int64_t time;
+                        if (history_block_next(file, names_n, &block, cursors, infos, &time) < 0) {
+                                warning("skipping corrupt block %llu of %s\n", (unsigned long long) b, config->history_path);
+                                break;
+                        }
+                        if (time * NSEC_PER_MSEC < config->cmdopts.s) {
+                                continue;
+                        }
+                        if (time > end) {
+                                goto last;
+                        }
+
+                        uint64_t sample_bucket = (uint64_t) (time - start) * buckets / span;
+                        if (sample_bucket != bucket) {
+                                query_chunk_flush(chunk, supplies);
+                                query_output_bucket(file, names_n, supplies,
+                                                    start + (int64_t) (bucket * span / buckets),
+                                                    start + (int64_t) ((bucket + 1) * span / buckets), config);
+                                bucket = sample_bucket;
+                        }
+                        if (chunk->n == QUERY_CHUNK) {
+                                query_chunk_flush(chunk, supplies);
+                        }
+
+                        size_t j = chunk->n++;
+                        chunk->time[j] = time;
+                        for (p = 0; p < block.supplies_n; p++) {
+                                const struct battery_info *info = &infos[p];
+                                chunk->values[p][QUERY_CHARGE][j] = info->charge;
+                                chunk->values[p][QUERY_MAX_CHARGE][j] = info->max_charge;
+                                chunk->values[p][QUERY_VOLTAGE][j] = info->voltage;
+                                chunk->values[p][QUERY_CURRENT][j] = info->current;
+                                chunk->values[p][QUERY_TEMPERATURE][j] = info->temperature;
+                                chunk->values[p][QUERY_ETD][j] = info->etd;
+
+                                // (statuses point into history_statuses; none counts as "Unknown")
+                                int status = 1;
+                                while (status < (int) HISTORY_STATUSES_NUM && info->status != history_statuses[status]) {
+                                        status++;
+                                }
+                                if (status == (int) HISTORY_STATUSES_NUM) {
+                                        status = 1;
+                                }
+                                chunk->status[p][j] = (uint8_t) (status - 1);
+                        }
+                }
+                query_chunk_flush(chunk, supplies);
+        }
+
+last:
+        query_chunk_flush(chunk, supplies);
+        query_output_bucket(file, names_n, supplies,
+                            start + (int64_t) (bucket * span / buckets),
+                            start + (int64_t) ((bucket + 1) * span / buckets), config);
+
+done:
+        battery_info_output_deinit(config);
+        output_flush();
+
+        free(chunk);
+        free(supplies);
+        munmap((void*) file, size);
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
+//------------------------------------------------------------------------------
+
+static volatile sig_atomic_t watch_stop = 0; ///< Set by the signal handler to stop watch mode.
+
+/** Signal handler which asks the watch loop to stop after the current sample.
+ * \param sig The signal number (unused).
+ */
+static void
+watch_signal_handler(int sig)
+{
+        (void) sig;
+        watch_stop = 1;
+}
+
+/** Routine to make SIGINT and SIGTERM stop watch (or follow) mode, rather than
+ * the program.
+ */
+static void
+watch_signals_init(void)
+{
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = watch_signal_handler;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+}
+
+/** Utility routine for parsing an interval in (possibly fractional) seconds.
+ * \param s The string to parse.
+ * \param dest A pointer to the timespec in which to place the result.
+ * \return 0 on success, -1 on error (including zero or negative intervals).
+ */
+static int
+parse_interval(const char *s,
+               struct timespec *dest)
+{
+        errno = 0;
+        char *endptr;
+        double d = strtod(s, &endptr);
+
+        if (errno != 0 || endptr == s || *endptr != '\0' ||
+                !(d > 0.0) || d > (double) (INT32_MAX)) {
+                return -1;
+        }
+
+        int64_t ns = (int64_t) (d * (double) NSEC_PER_SEC);
+        if (ns <= 0) {
+                return -1;
+        }
+
+        ns_to_timespec(ns, dest);
+        return 0;
+}
+
+/** Utility routine for parsing a point in time: a (possibly fractional) amount
+ * of seconds since the epoch, or if negative, before now.
+ * \param s The string to parse.
+ * \param dest A pointer to where to place the result (CLOCK_REALTIME, in
+ * nanoseconds).
+ * \return 0 on success, -1 on error.
+ */
+static int
+parse_time(const char *s,
+           int64_t *dest)
+{
+        errno = 0;
+        char *endptr;
+        double d = strtod(s, &endptr);
+
+        if (errno != 0 || endptr == s || *endptr != '\0' || !(fabs(d) < (double) INT32_MAX * 4)) {
+                return -1;
+        }
+
+        *dest = (int64_t) (d * (double) NSEC_PER_SEC);
+        if (d < 0.0) {
+                *dest += realtime_ns();
+        }
+        return 0;
+}
+
+/** Routine to record how late a sample was taken.
+ * \param stats A pointer to the statistics structure to update.
+ * \param late The sample's lateness, in nanoseconds.
+ */
+static void
+watch_stats_add(struct watch_stats *stats,
+                int64_t late)
+{
+        if (stats->samples == 0 || late < stats->min_late) {
+                stats->min_late = late;
+        }
+        if (stats->samples == 0 || late > stats->max_late) {
+                stats->max_late = late;
+        }
+        stats->total_late += late;
+        stats->samples++;
+}
+
+/** Routine to output the sampling statistics gathered in watch mode to stderr.
+ * \param stats A pointer to the statistics structure to output.
+ */
+static void
+watch_stats_report(const struct watch_stats *stats)
+{
+        if (stats->samples == 0) {
+                fputs("watch: no samples taken\n", stderr);
+                return;
+        }
+
+        fprintf(stderr, "watch: %lu samples, %lu missed, lateness min/avg/max: %.3f/%.3f/%.3f ms\n",
+                stats->samples, stats->missed,
+                (double) stats->min_late / 1e6,
+                (double) stats->total_late / (double) stats->samples / 1e6,
+                (double) stats->max_late / 1e6);
+}
+
+/** Routine which repeatedly calls list_all_battery_info on a fixed schedule.
+ *
+ * Samples are scheduled at absolute times (start + k * interval) using a
+ * timerfd, so time spent reading and outputting battery information doesn't
+ * accumulate into the period. If a sample overruns one or more periods, the
+ * overrun ticks are counted as missed and sampling continues on the original
+ * schedule. The loop runs until the sample limit is reached or SIGINT/SIGTERM
+ * is received, after which the sampling jitter is reported on stderr.
+ * \param cache A pointer to the supply cache, which keeps battery files open
+ * between samples.
+ * \param scan A pointer to the scan structure to read battery information into.
+ * \param config A pointer to the program configuration struct.
+ * \return 0 on success, -1 on error.
+ */
+static int
+watch_battery_info(struct supply_cache *cache,
+                   struct scan *scan,
+                   struct config *config)
+{
+        watch_signals_init();
+
+        int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (tfd < 0) {
+                error("couldn't create timer: %s\n", strerror(errno));
+                return -1;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        int64_t interval = timespec_to_ns(&config->cmdopts.w);
+        int64_t scheduled = timespec_to_ns(&now);
+
+        // the first sample is taken immediately; the timer then fires at
+        // absolute multiples of the interval from this point onwards.
+        struct itimerspec its;
+        ns_to_timespec(scheduled + interval, &its.it_value);
+        its.it_interval = config->cmdopts.w;
+        if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+                error("couldn't arm timer: %s\n", strerror(errno));
+                close(tfd);
+                return -1;
+        }
+
+        struct watch_stats stats;
+        memset(&stats, 0, sizeof(stats));
+        unsigned long first_allocs = 0;
+
+        while (!watch_stop) {
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                watch_stats_add(&stats, timespec_to_ns(&now) - scheduled);
+
+                if (config->history != NULL) {
+                        if (history_sample(cache, scan, config) < 0) {
+                                break;
+                        }
+                } else {
+                        list_all_battery_info(cache, scan, config);
+                }
+
+                if (stats.samples == 1) {
+                        first_allocs = alloc_count;
+                }
+
+                if (config->cmdopts.c != 0 && stats.samples >= config->cmdopts.c) {
+                        break;
+                }
+
+                uint64_t expirations;
+                if (read(tfd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        error("couldn't read timer: %s\n", strerror(errno));
+                        break;
+                }
+
+                // sample against the most recent tick; any earlier ones were missed
+                scheduled += (int64_t) expirations * interval;
+                stats.missed += (unsigned long) (expirations - 1);
+        }
+
+        close(tfd);
+        watch_stats_report(&stats);
+
+        // once everything has grown to fit the first sample, later samples
+        // shouldn't need to allocate anything unless batteries are added.
+        fprintf(stderr, "watch: %lu allocations for the first sample, %lu since\n",
+                first_allocs, alloc_count - first_allocs);
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
+//------------------------------------------------------------------------------
+
+// Follow mode (--follow) listens for the kernel's uevents on a
+// NETLINK_KOBJECT_UEVENT socket. A power_supply "change" event carries the
+// same POWER_SUPPLY_* lines as the supply's uevent file, so the battery's
+// information is parsed straight out of the message, with only device/uevent
+// read (for the driver, if it's output). Anything else (a supply being added
+// or removed, an event for a supply which hasn't been seen, or the socket's
+// buffer overflowing) makes every supply be read again. Each battery's last
+// record is kept, and a record is only output when it differs from that.
+//
+// Not every driver sends change events as its values move, so every supply is
+// also read again every -w interval (FOLLOW_DEFAULT_INTERVAL seconds by
+// default). With -R, the kernel's events don't describe the supplies being
+// read, so only that polling is used.
+
+/** Routine to open a socket which receives the kernel's uevents.
+ * \return The socket's file descriptor, or -1 on error.
+ */
+static int
+follow_socket(void)
+{
+        int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+        if (fd < 0) {
+                return -1;
+        }
+
+        // (a bigger buffer is only a nicety: overflowing it causes a rescan)
+        int rcvbuf = UEVENT_SOCKET_RCVBUF;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+        struct sockaddr_nl addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.nl_family = AF_NETLINK;
+        addr.nl_groups = 1; // the kernel's own events (udev's are in group 2)
+        if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+                int err = errno;
+                close(fd);
+                errno = err;
+                return -1;
+        }
+
+        return fd;
+}
+
+/** Routine to output a battery's record, unless it is the same as the last
+ * one output for it.
+ * \param supply A pointer to the battery's cached supply.
+ * \param index The battery's index.
+ * \param info A pointer to the battery's information.
+ * \param config A pointer to the program configuration struct.
+ */
+static void
+follow_output(struct supply *supply,
+              int index,
+              struct battery_info *info,
+              struct config *config)
+{
+        size_t start = output.len;
+        struct output_plan state = *config->plan;
+        list_battery_info(index, info, config);
+
+        // (compared without any CSV header or JSON separator before it)
+        size_t record = config->plan->record;
+        size_t len = output.len - record;
+
+        if (supply->record != NULL && supply->record_len == len &&
+                !memcmp(supply->record, output.data + record, len)) {
+                output.len = start; // unchanged
+                *config->plan = state;
+                return;
+        }
+
+        if (len > supply->record_cap) {
+                char *record = (char*) counted_realloc(supply->record, len);
+                if (record == NULL) {
+                        return;
+                }
+                supply->record = record;
+                supply->record_cap = len;
+        }
+        memcpy(supply->record, output.data + record, len);
+        supply->record_len = len;
+}
+
+/** Routine which reads every supply, and outputs the batteries which have
+ * changed since they were last output.
+ * \param cache A pointer to the supply cache.
+ * \param scan A pointer to the scan structure to read battery information into.
+ * \param config A pointer to the program configuration struct.
+ */
+static void
+follow_scan(struct supply_cache *cache,
+            struct scan *scan,
+            struct config *config)
+{
+        size_t i;
+
+        scan_battery_info(cache, scan, config);
+
+        for (i = 0; i < scan->n; i++) {
+                scan->supplies[i]->record_index = (int) i;
+                follow_output(scan->supplies[i], (int) i, scan->batteries[i], config);
+        }
+}
+
+/** Routine to handle a uevent from the kernel: if it's a change to a battery
+ * which has already been output, its information is parsed from the event and
+ * output if it has changed.
+ * \param cache A pointer to the supply cache.
+ * \param scan A pointer to the scan structure (only its worker threads, if
+ * any, are looked at).
+ * \param arena A pointer to the arena to parse the event into.
+ * \param msg The event, NUL-terminated at len.
+ * \param len The length of the event.
+ * \param config A pointer to the program configuration struct.
+ * \return 1 if every supply needs to be read again, 0 otherwise.
+ */
+static int
+follow_event(struct supply_cache *cache,
+             struct scan *scan,
+             struct arena *arena,
+             const char *msg,
+             size_t len,
+             struct config *config)
+{
+        const char *action = NULL, *devpath = NULL, *subsystem = NULL;
+        const char *end = msg + len, *field;
+
+        // the "<action>@<devpath>" header is followed by KEY=value fields
+        for (field = msg + strlen(msg) + 1; field < end; field += strlen(field) + 1) {
+                if (!strncmp(field, "ACTION=", 7)) {
+                        action = field + 7;
+                } else if (!strncmp(field, "DEVPATH=", 8)) {
+                        devpath = field + 8;
+                } else if (!strncmp(field, "SUBSYSTEM=", 10)) {
+                        subsystem = field + 10;
+                }
+        }
+
+        if (subsystem == NULL || strcmp(subsystem, "power_supply") != 0) {
+                return 0;
+        }
+        if (action == NULL || devpath == NULL || strcmp(action, "change") != 0) {
+                return 1;
+        }
+
+        const char *name = strrchr(devpath, '/');
+        name = name != NULL ? name + 1 : devpath;
+        if ((config->configflags & CONFIG_FLAG_BY_NAME) && !name_set_match(&config->cmdopts.n, name)) {
+                return 0;
+        }
+
+        struct supply *supply = supply_cache_find(cache, name);
+        if (supply == NULL || !supply->classified) {
+                return 1;
+        }
+        if (!supply->is_battery) {
+                return 0;
+        }
+        if (supply->record == NULL) {
+                return 1; // (it couldn't be read last time)
+        }
+
+        if (scan->pool != NULL) {
+                // a worker which is stuck reading the battery still owns it
+                pthread_mutex_lock(&scan_pool_lock);
+                int busy = supply->busy;
+                pthread_mutex_unlock(&scan_pool_lock);
+                if (busy) {
+                        return 0;
+                }
+        }
+
+        // the fields are parsed in place, so they must outlive msg
+        char *copy = (char*) arena_alloc(arena, len + 1);
+        struct battery_info *info = (struct battery_info*) arena_alloc(arena, sizeof(struct battery_info));
+        if (copy == NULL || info == NULL) {
+                return 1;
+        }
+        memcpy(copy, msg, len + 1);
+        battery_info_init(info);
+
+        char *p;
+        for (p = copy + strlen(copy) + 1; p < copy + len; p += strlen(p) + 1) {
+                parse_uevent_line(p, strlen(p), info->values, info);
+        }
+        info->name = supply->name;
+
+        if (config->attrs & ATTR_MASK_DRIVER) {
+                read_battery_driver(arena, supply, cache->dir_fd, info);
+        }
+
+        battery_info_compute(info, info->values);
+        info->time = (double) realtime_ns() / NSEC_PER_SEC;
+        if (config->configflags & CONFIG_FLAG_ROLLING) {
+                rolling_update(&supply->rolling, info, config);
+        }
+        follow_output(supply, supply->record_index, info, config);
+
+        return 0;
+}
+
+/** Routine to handle every uevent waiting on the socket.
+ * \param cache A pointer to the supply cache.
+ * \param scan A pointer to the scan structure.
+ * \param arena A pointer to the arena to parse events into.
+ * \param fd The uevent socket.
+ * \param config A pointer to the program configuration struct.
+ * \return 1 if every supply needs to be read again, 0 otherwise.
+ */
+static int
+follow_events(struct supply_cache *cache,
+              struct scan *scan,
+              struct arena *arena,
+              int fd,
+              struct config *config)
+{
+        char msg[UEVENT_MSG_MAX + 1];
+        struct sockaddr_nl addr;
+        struct iovec iov = { msg, UEVENT_MSG_MAX };
+        struct msghdr hdr;
+        int rescan = 0;
+
+        arena_reset(arena);
+
+        for (;;) {
+                memset(&hdr, 0, sizeof(hdr));
+                hdr.msg_name = &addr;
+                hdr.msg_namelen = sizeof(addr);
+                hdr.msg_iov = &iov;
+                hdr.msg_iovlen = 1;
+
+                ssize_t n = recvmsg(fd, &hdr, 0);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        // ENOBUFS means that events were dropped
+                        return errno == EAGAIN ? rescan : 1;
+                }
+
+                // only trust the kernel itself
+                if (n == 0 || addr.nl_pid != 0 || (hdr.msg_flags & MSG_TRUNC)) {
+                        continue;
+                }
+
+                msg[n] = '\0';
+                rescan |= follow_event(cache, scan, arena, msg, (size_t) n, config);
+        }
+}
+
+/** Routine which outputs every battery, and then outputs each battery again
+ * whenever it changes, until the sample limit (-c) is reached or SIGINT or
+ * SIGTERM is received.
+ * \param cache A pointer to the supply cache.
+ * \param scan A pointer to the scan structure to read battery information into.
+ * \param config A pointer to the program configuration struct.
+ * \return 0 on success, -1 on error.
+ */
+static int
+follow_battery_info(struct supply_cache *cache,
+                    struct scan *scan,
+                    struct config *config)
+{
+        watch_signals_init();
+
+        int nl = -1;
+        if (!strcmp(config->sys_fs_path, SYS_FS_BATTERY_BASE_PATH) && (nl = follow_socket()) < 0) {
+                warning("couldn't listen for power supply events (%s), only polling\n", strerror(errno));
+        }
+
+        int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (tfd < 0) {
+                error("couldn't create timer: %s\n", strerror(errno));
+                if (nl >= 0) {
+                        close(nl);
+                }
+                return -1;
+        }
 
-        while (fgets(buf, sizeof(buf), f) != NULL) {
-                // strip any whitespace at the end
-                size_t i = strlen((const char*) buf) - 1;
-                while (i > 0 && isspace((int) buf[i])) i--;
+        struct itimerspec its;
+        if (config->configflags & CONFIG_FLAG_WATCH) {
+                its.it_interval = config->cmdopts.w;
+        } else {
+                its.it_interval.tv_sec = FOLLOW_DEFAULT_INTERVAL;
+                its.it_interval.tv_nsec = 0;
+        }
+        its.it_value = its.it_interval;
+        timerfd_settime(tfd, 0, &its, NULL);
 
-                if (i == 0) {
-                        continue;
-                }
+        struct pollfd fds[2] = {
+                { tfd, POLLIN, 0 },
+                { nl, POLLIN, 0 }, // (ignored by poll if nl is -1)
+        };
+        struct arena arena;
+        arena_init(&arena);
+        unsigned long updates = 0;
+        int rescan = 1, events = 0;
 
-                buf[i + 1] = '\0';
-
-                // checking whether strtol_helper and strcpy_helper return >= 0 isn't really
-                // necessary, but implemented in case some code is added below the large
-                // if_startswith block which should be skipped if an error occurs with one
-                // of the _helper routines.
-                if_startswith("POWER_SUPPLY_CAPACITY") {
-                        // some systems provide the capacity field, others don't. if they do, then the
-                        // value can be directly used as the battery charge percentage. otherwise, work
-                        // it out from the charge_now and charge_full values.
-                        if (strtol_helper(buf + 22, &capacity) < 0) { continue; }
-                } else if_startswith("POWER_SUPPLY_CHARGE_NOW") {
-                        if (strtol_helper(buf + 24, &charge_now) < 0) { continue; }
-                } else if_startswith("POWER_SUPPLY_CHARGE_FULL_DESIGN") {
-                        // check for this one first, otherwise POWER_SUPPLY_CHARGE_FULL will be matched
-                        if (strtol_helper(buf + 32, &charge_full_design) < 0) { continue; }
-                } else if_startswith("POWER_SUPPLY_CHARGE_FULL") {
-                        if (strtol_helper(buf + 25, &charge_full) < 0) { continue; }
-                } else if_startswith("POWER_SUPPLY_VOLTAGE_NOW") {
-                        if (strtol_helper(buf + 25, &voltage_now) < 0) { continue; }
-                } else if_startswith("POWER_SUPPLY_CURRENT_NOW") {
-                        if (strtol_helper(buf + 25, &current_now) < 0) { continue; }
-                } else if_startswith("POWER_SUPPLY_TEMP") {
-                        if (strtol_helper(buf + 18, &temp) < 0) { continue; }
-                } else if_startswith("POWER_SUPPLY_NAME") {
-                        if (strcpy_helper(buf + 18, &info->name) < 0) { continue; }
-                } else if_startswith("POWER_SUPPLY_MODEL_NAME") {
-                        if (strcpy_helper(buf + 24, &info->model) < 0) { continue; }
-                } else if_startswith("POWER_SUPPLY_MANUFACTURER") {
-                        if (strcpy_helper(buf + 26, &info->manufacturer) < 0) { continue; }
-                } else if_startswith("POWER_SUPPLY_TECHNOLOGY") {
-                        if (strcpy_helper(buf + 24, &info->technology) < 0) { continue; }
-                } else if_startswith("POWER_SUPPLY_STATUS") {
-                        if (strcpy_helper(buf + 20, &info->status) < 0) { continue; }
-                } else if_startswith("POWER_SUPPLY_HEALTH") {
-                        if (strcpy_helper(buf + 20, &info->health) < 0) { continue; }
-                } else if_startswith("POWER_SUPPLY_SERIAL_NUMBER") {
-                        if (strcpy_helper(buf + 27, &info->serial_number) < 0) { continue; }
-                } else if_startswith("POWER_SUPPLY_CHARGE_TYPE") {
-                        if (strcpy_helper(buf + 25, &info->charge_type) < 0) { continue; }
-                } else if_startswith("POWER_SUPPLY_CHARGE_RATE") {
-                        if(strcpy_helper(buf + 25, &info->charge_rate) < 0) { continue; }
-                } else if_startswith("POWER_SUPPLY_PRESENT") {
-                        if (strtol_helper(buf + 21, &present) < 0) { continue; }
-                } else if_startswith("POWER_SUPPLY_ONLINE") {
-                        if (strtol_helper(buf + 21, &online) < 0) { continue; }
-                } else if_startswith("POWER_SUPPLY_CHARGING_ENABLED") {
-                        if (strtol_helper(buf + 30, &charging_enabled) < 0) { continue; }
-                }
-        }
-
-        fclose(f);
+        while (!watch_stop) {
+                size_t base = output.len;
+                battery_info_output_init(config);
+                size_t body = output.len;
 
-read_device_uevent:
-        strcpy((char*) pathbuf, path);
-        strcat((char*) pathbuf, "/device/uevent");
-        if ((f = fopen(pathbuf, "r")) == NULL) {
-                if (++failed_opens == 2) {
-                        // skip processing anything if we couldn't open anything
-                        goto end;
+                if (events && follow_events(cache, scan, &arena, nl, config)) {
+                        rescan = 1;
+                }
+                if (rescan) {
+                        follow_scan(cache, scan, config);
                 }
-                goto process;
-        }
-
-        while (fgets(buf, sizeof(buf), f) != NULL) {
-                size_t i = strlen((const char*) buf) - 1;
-                while (i > 0 && isspace((int) buf[i])) i--;
 
-                if (i == 0) {
-                        continue;
+                if (output.len > body) {
+                        battery_info_output_deinit(config);
+                        output_flush();
+                        updates++;
+                        if (config->cmdopts.c != 0 && updates >= config->cmdopts.c) {
+                                break;
+                        }
+                } else {
+                        output.len = base;
                 }
 
-                buf[i + 1] = '\0';
+                if (poll(fds, 2, -1) < 0) {
+                        if (errno == EINTR) {
+                                rescan = events = 0;
+                                continue;
+                        }
+                        error("couldn't wait for events: %s\n", strerror(errno));
+                        break;
+                }
 
-                if_startswith("DRIVER") {
-                        if (strcpy_helper(buf + 7, &info->driver) < 0) { continue; }
+                rescan = 0;
+                if (fds[0].revents & POLLIN) {
+                        uint64_t expirations;
+                        rescan = read(tfd, &expirations, sizeof(expirations)) == sizeof(expirations);
                 }
+                events = (fds[1].revents & POLLIN) != 0;
         }
 
-        fclose(f);
-
-process:
-        if (capacity != LONG_INVALID && capacity >= 0 && capacity <= 100) {
-                info->charge = (double) capacity;
-        } else if (charge_now != LONG_INVALID && charge_full != LONG_INVALID) {
-                info->charge = (double) charge_now / (double) charge_full * 100;
+        arena_cleanup(&arena);
+        close(tfd);
+        if (nl >= 0) {
+                close(nl);
         }
 
-        if (!(config->configflags & CONFIG_FLAG_DISABLE_CHARGE_CAP) &&
-                info->charge > 100.0) {
-                info->charge = 100.0;
-        }
+        return 0;
+}
 
-        if (charge_full != LONG_INVALID && charge_full_design != LONG_INVALID) {
-                info->max_charge = (double) charge_full / (double) charge_full_design * 100;
-        }
+//------------------------------------------------------------------------------
+// _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
+//------------------------------------------------------------------------------
 
-        // TODO fix: make sure this is right (the units)
-        if (voltage_now != LONG_INVALID) {
-                info->voltage = (double) voltage_now / (double) 1000000.0;
-        }
+// Daemon mode (--daemon) reads every supply every -w interval
+// (DAEMON_DEFAULT_INTERVAL seconds by default), and answers the requests of
+// --client invocations (see client_query) from the batteries of the last
+// scan, so that however many programs want battery information, sysfs is only
+// read by one. It reads every attribute, whatever the output sequence, so
+// that each request can be answered as it asks. Requests are answered one at
+// a time, between scans. With --shm, each scan is also published into a
+// snapshot, and with --record, appended to a history log.
 
-        // TODO fix: ^
-        if (current_now != LONG_INVALID) {
-                info->current = (double) current_now / (double) 100000.0;
+/** Routine to create the daemon's listening socket, replacing one left behind
+ * by a daemon which didn't exit cleanly.
+ * \param path The socket's path.
+ * \return The socket, or -1 on error. errno is set to EADDRINUSE if another
+ * daemon is listening on path.
+ */
+static int
+daemon_socket(const char *path)
+{
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+                errno = ENAMETOOLONG;
+                return -1;
         }
+        strcpy(addr.sun_path, path);
 
-        // TODO fix: ^
-        if (temp != LONG_INVALID) {
-                info->temperature = (double) temp / (double) 10.0;
+        int fd = client_connect(path);
+        if (fd >= 0) {
+                close(fd);
+                errno = EADDRINUSE;
+                return -1;
         }
 
-        if (charge_full != LONG_INVALID && charge_full != LONG_INVALID &&
-                current_now != LONG_INVALID) {
-                info->etd = (((double) charge_full - (double) charge_now) / (double) current_now) * 10;
+        struct stat st;
+        if (errno == ECONNREFUSED && lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+                unlink(path);
         }
 
-        if (present == 1 || present == 0) {
-                info->present = (char) present;
-        }
-        if (online == 1 || online == 0) {
-                info->online = (char) online;
+        if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) < 0) {
+                return -1;
         }
-        if (charging_enabled == 1 || charging_enabled == 0) {
-                info->charging_enabled = (char) charging_enabled;
+
+        // anyone who can read sysfs may ask
+        if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+                chmod(path, 0666) < 0 ||
+                listen(fd, SOMAXCONN) < 0) {
+                int err = errno;
+                close(fd);
+                errno = err;
+                return -1;
         }
 
-end:
-        return failed_opens >= 2 ? -1 : 0; // if we manage to read at least something, count it as a success.
+        return fd;
 }
 
-#undef if_startswith
-
-/** Routine to get and list information about a specific battery, given a path
- * to its uevent file.
- * \param battery An index for the battery.
- * \param path The path of the battery's uevent file.
- * \param infostr The sequence of characters which denotes what information is
- * outputted, and its order.
- * \param configflags A set of flags which denote program-wide configuration
- * parameters.
- * \return 0 on success, -1 on failure.
+/** Routine to parse a request (see client_query) into a configuration to
+ * answer it with.
+ * \param line The request, without its newline. It is split in place, and the
+ * names in req point into it.
+ * \param req A pointer to the configuration to fill in, initialized with
+ * config_init.
+ * \param plan A pointer to where to compile the request's output sequence
+ * (which req is pointed at). Free it with output_plan_cleanup, even on error.
+ * \param config A pointer to the daemon's configuration.
+ * \return NULL on success, or the reason why the request can't be answered.
  */
-static int
-list_battery_info(int battery,
-                  const char *path,
-                  char *infostr,
-                  struct config *config)
+static const char *
+daemon_request(char *line,
+               struct config *req,
+               struct output_plan *plan,
+               const struct config *config)
 {
-        struct battery_info info;
-        battery_info_init(&info);
+        char *save = NULL, *field;
+        int header_done = 0;
 
-        if (get_battery_info(path, &info, config) < 0) {
-                return -1;
+        if ((field = strtok_r(line, "\t", &save)) == NULL || strcmp(field, DAEMON_PROTOCOL) != 0) {
+                return "unsupported protocol";
         }
 
-        battery_info_output_start(battery, config);
-
-        char *p = infostr;
+        if ((field = strtok_r(NULL, "\t", &save)) == NULL || strcmp(field, config->sys_fs_path) != 0) {
+                return "different sysfs root";
+        }
 
-        if (config->configflags & CONFIG_FLAG_OUTPUT_ALL) {
-                p = COMPLETE_OUTPUT_SEQUENCE;
+        if ((field = strtok_r(NULL, "\t", &save)) == NULL) {
+                return "missing format";
+        } else if ((req->output_format = output_format_find(field)) < 0) {
+                return "unknown format";
         }
 
-        while (*p != '\0') {
-                switch((int) *p) {
-                        case 'n': {
-                                battery_info_output_str(info.name, "name", config);
-                                break;
-                        }
-                        case 'c': {
-                                battery_info_output_double_percent(info.charge, "charge", config);
-                                break;
-                        }
-                        case 't': {
-                                battery_info_output_double_percent(info.max_charge, "max_charge", config);
-                                break;
-                        }
-                        case 'v': {
-                                battery_info_output_double(info.voltage, "voltage", config);
-                                break;
-                        }
-                        case 'C': {
-                                battery_info_output_double(info.current, "current", config);
-                                break;
-                        }
-                        case 'T': {
-                                battery_info_output_double(info.temperature, "temperature", config);
-                                break;
-                        }
-                        case 'D': {
-                                battery_info_output_double(info.etd, "etd", config);
-                                break;
-                        }
+        if ((field = strtok_r(NULL, "\t", &save)) == NULL) {
+                return "missing flags";
+        }
+        for (; *field != '\0'; field++) {
+                switch (*field) {
                         case 'd': {
-                                battery_info_output_str(info.driver, "driver", config);
-                                break;
-                        }
-                        case 'm': {
-                                battery_info_output_str(info.model, "model", config);
-                                break;
-                        }
-                        case 'M': {
-                                battery_info_output_str(info.manufacturer, "manufacturer", config);
+                                req->configflags |= CONFIG_FLAG_DIGITS;
                                 break;
                         }
-                        case 'e': {
-                                battery_info_output_str(info.technology, "technology", config);
-                                break;
-                        }
-                        case 's': {
-                                battery_info_output_str(info.status, "status", config);
+                        case 'N': {
+                                req->configflags |= CONFIG_FLAG_DISABLE_CHARGE_CAP;
                                 break;
                         }
                         case 'h': {
-                                battery_info_output_str(info.health, "health", config);
-                                break;
-                        }
-                        case 'S': {
-                                battery_info_output_str(info.serial_number, "serial_number", config);
-                                break;
-                        }
-                        case 'H': {
-                                battery_info_output_str(info.charge_type, "charge_type", config);
-                                break;
-                        }
-                        case 'r': {
-                                battery_info_output_str(info.charge_rate, "charge_rate", config);
+                                header_done = 1;
                                 break;
                         }
-                        case 'p': {
-                                battery_info_output_flag(info.present, "present", config);
+                        case '-': {
                                 break;
                         }
-                        case 'o': {
-                                battery_info_output_flag(info.online, "online", config);
-                                break;
-                        }
-                        case 'g': {
-                                battery_info_output_flag(info.charging_enabled, "charging_enabled", config);
-                                break;
-                        }
-                        default: break;
+                        default:
+                                return "unknown flag";
                 }
-                p++;
         }
 
-        battery_info_cleanup(&info);
+        if ((field = strtok_r(NULL, "\t", &save)) == NULL) {
+                return "missing output sequence";
+        }
+        if (output_plan_compile(plan, field, req) < 0) {
+                return errno == EINVAL ? "invalid output sequence" : "out of memory";
+        }
+        plan->header_done = header_done;
+        req->plan = plan;
 
-        battery_info_output_end(config);
+        while ((field = strtok_r(NULL, "\t", &save)) != NULL) {
+                if (name_set_add(&req->cmdopts.n, field) < 0) {
+                        return "invalid name";
+                }
+                req->configflags |= CONFIG_FLAG_BY_NAME;
+        }
 
-        return 0;
+        if ((req->configflags & CONFIG_FLAG_BY_NAME) && name_set_build(&req->cmdopts.n) < 0) {
+                return "out of memory";
+        }
+
+        return NULL;
 }
 
-#define set_path_to_dir() do { \
-                strcpy(path, sys_fs_path); \
-                strcat(path, (const char*) dir->d_name); \
-        } while (0)
+/** Routine to read a client's request, and answer it from the last scan.
+ * \param fd The client's socket.
+ * \param scan A pointer to the scan structure holding the last scan.
+ * \param config A pointer to the daemon's configuration.
+ */
+static void
+daemon_serve(int fd,
+             struct scan *scan,
+             const struct config *config)
+{
+        char line[DAEMON_REQUEST_MAX], *nl = NULL;
+        size_t len = 0;
 
-/** Routine which goes through each entry in /sys/class/power_supply, checks
- * whether it's a battery, and then calls list_battery_info for each battery found.
- * \param infostr The sequence of characters which denotes what information is
- * outputted, and its order.
- * \param configflags A set of flags which denote program-wide configuration
-  * parameters.
+        while (len < sizeof(line) && (nl = (char*) memchr(line, '\n', len)) == NULL) {
+                ssize_t n = read(fd, line + len, sizeof(line) - len);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n <= 0) {
+                        break;
+                }
+                len += (size_t) n;
+        }
+
+        struct config req;
+        config_init(&req);
+        struct output_plan plan = OUTPUT_PLAN_INIT;
+        const char *err = "incomplete request";
+
+        if (nl != NULL) {
+                *nl = '\0';
+                err = daemon_request(line, &req, &plan, config);
+        }
+
+        if (err != NULL) {
+                output_lit("error ");
+                output_mem(err, strlen(err));
+                output_lit("\n");
+        } else {
+                output_lit("ok\n");
+                battery_info_output_init(&req);
+                list_scanned_battery_info(scan->batteries, scan->n, &req);
+                battery_info_output_deinit(&req);
+        }
+
+        output_send(fd);
+        output_plan_cleanup(&plan);
+        name_set_cleanup(&req.cmdopts.n);
+}
+
+/** Routine to read every supply for the daemon, and publish and record the
+ * batteries found.
+ * \param cache A pointer to the supply cache.
+ * \param scan A pointer to the scan structure to read battery information into.
+ * \param shm A pointer to the --shm snapshot, or NULL.
+ * \param config A pointer to the program configuration struct.
  */
 static void
-list_all_battery_info(char *infostr,
-                      struct config *config)
+daemon_scan(struct supply_cache *cache,
+            struct scan *scan,
+            struct batteryinfo_shm *shm,
+            struct config *config)
 {
-        const char *sys_fs_path = SYS_FS_BATTERY_BASE_PATH;
-        DIR *basedir = opendir(sys_fs_path);
-        if (basedir == NULL) {
-                fprintf(stderr, "error: couldn't open directory \"%s\": %s\n", sys_fs_path, strerror(errno));
-                exit(1);
+        scan_battery_info(cache, scan, config);
+
+        if (shm != NULL) {
+                shm_publish(shm, scan);
+        }
+        if (config->history != NULL && history_append(config->history, scan) < 0) {
+                error("couldn't grow %s, no longer recording: %s\n", config->history->path, strerror(errno));
+                config->history = NULL;
         }
+}
 
-        struct dirent *dir;
-        int battery = 0;
-        char path[SYS_FS_BATTERY_BASE_PATH_LEN + 264];
+/** Routine which reads every supply periodically, and answers requests from
+ * clients, until SIGINT or SIGTERM is received.
+ * \param cache A pointer to the supply cache.
+ * \param scan A pointer to the scan structure to read battery information into.
+ * \param config A pointer to the program configuration struct.
+ * \return 0 on success, -1 on error.
+ */
+static int
+daemon_battery_info(struct supply_cache *cache,
+                    struct scan *scan,
+                    struct config *config)
+{
+        watch_signals_init();
 
-        battery_info_output_init(config);
+        int lfd = daemon_socket(config->socket_path);
+        if (lfd < 0) {
+                error("couldn't listen on %s: %s\n", config->socket_path, strerror(errno));
+                return -1;
+        }
 
-        while ((dir = readdir(basedir)) != NULL) {
-                if (/*!(dir->d_type & DT_DIR || dir->d_type & DT_LNK) ||*/ dir->d_name[0] == '.') {
-                        continue;
-                }
+        int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (tfd < 0) {
+                error("couldn't create timer: %s\n", strerror(errno));
+                close(lfd);
+                unlink(config->socket_path);
+                return -1;
+        }
 
-                // is this a battery path?
-                set_path_to_dir();
-                strcat(path, "/type");
+        struct itimerspec its;
+        if (config->configflags & CONFIG_FLAG_WATCH) {
+                its.it_interval = config->cmdopts.w;
+        } else {
+                its.it_interval.tv_sec = DAEMON_DEFAULT_INTERVAL;
+                its.it_interval.tv_nsec = 0;
+        }
+        its.it_value = its.it_interval;
+        timerfd_settime(tfd, 0, &its, NULL);
 
-                if (!compare_file_contents((const char*) path, "Battery")) {
-                        // found a battery. was a specific battery name provided?
-                        if (config->configflags & CONFIG_FLAG_BY_NAME) {
-                                // does this name match?
-                                if (!strcmp((const char*) dir->d_name, (const char*) config->cmdopts.n)) {
-                                        // yes
-                                        set_path_to_dir();
-                                        list_battery_info(0, path, infostr, config);
-                                        break;
-                                } else {
-                                        continue; // no
-                                }
+        struct batteryinfo_shm *shm = NULL;
+        if (config->shm_path != NULL && (shm = shm_create(config->shm_path)) == NULL) {
+                error("couldn't create %s: %s\n", config->shm_path, strerror(errno));
+                close(tfd);
+                close(lfd);
+                unlink(config->socket_path);
+                return -1;
+        }
+
+        struct pollfd fds[2] = {
+                { tfd, POLLIN, 0 },
+                { lfd, POLLIN, 0 },
+        };
+
+        daemon_scan(cache, scan, shm, config);
+
+        while (!watch_stop) {
+                if (poll(fds, 2, -1) < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        error("couldn't wait for requests: %s\n", strerror(errno));
+                        break;
+                }
+
+                if (fds[0].revents & POLLIN) {
+                        uint64_t expirations;
+                        if (read(tfd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+                                daemon_scan(cache, scan, shm, config);
                         }
+                }
 
-                        set_path_to_dir();
-                        list_battery_info(battery, path, infostr, config);
+                if (fds[1].revents & POLLIN) {
+                        int fd;
+                        while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+                                // a client which stops reading or writing can
+                                // only hold everyone else up for so long
+                                struct timeval tv = { DAEMON_IO_TIMEOUT, 0 };
+                                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+                                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
 
-                        battery++;
+                                daemon_serve(fd, scan, config);
+                                close(fd);
+                        }
                 }
         }
 
-        closedir(basedir);
+        if (shm != NULL) {
+                munmap(shm, sizeof(struct batteryinfo_shm));
+                unlink(config->shm_path);
+        }
+        close(tfd);
+        close(lfd);
+        unlink(config->socket_path);
 
-        battery_info_output_deinit(config);
+        return 0;
 }
 
-#undef set_path_from_dir
-
 //------------------------------------------------------------------------------
 // _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
 //------------------------------------------------------------------------------
@@ -1047,15 +7887,31 @@ main(int argc,
         opterr = 0;
 
         char *infostr = (char*) DEFAULT_OUTPUT_SEQUENCE;
+        char *queryinfostr = (char*) QUERY_DEFAULT_OUTPUT_SEQUENCE;
 
         struct config config;
         config_init(&config);
 
+        const char *env_root = getenv(SYS_FS_ROOT_ENV);
+        if (env_root != NULL && set_sys_fs_path(&config, env_root) < 0) {
+                fprintf(stderr, "error: " SYS_FS_ROOT_ENV " must be a non-empty string.\n");
+                exit(EXIT_FAILURE);
+        }
+
+        const char *env_socket = getenv(DAEMON_SOCKET_ENV);
+        if (env_socket != NULL) {
+                if (*env_socket == '\0') {
+                        fprintf(stderr, "error: " DAEMON_SOCKET_ENV " must be a non-empty string.\n");
+                        exit(EXIT_FAILURE);
+                }
+                config.socket_path = env_socket;
+        }
+
         if (argc > 1) {
                 // parse arguments
                 int c;
                 char *infoflagstr = NULL;
-                while ((c = getopt_long(argc, argv, "-hvladjn:N", (const struct option*) long_command_line_opts, NULL)) != -1) {
+                while ((c = getopt_long(argc, argv, "-hvladjF:n:Nw:c:LR:P:T:UfDCS:M:A:r:y:s:u:q:b:W:", (const struct option*) long_command_line_opts, NULL)) != -1) {
                         switch (c) {
                                 case 'h':
                                         usage(EXIT_SUCCESS);
@@ -1075,12 +7931,20 @@ main(int argc,
                                         config.output_format = OUTPUT_FORMAT_JSON;
                                         break;
                                 }
+                                case 'F': {
+                                        int format = output_format_find(optarg);
+                                        if (format < 0) {
+                                                fprintf(stderr, "error: format must be one of plain, csv, json or ndjson for argument `-F'.\n");
+                                                exit(EXIT_FAILURE);
+                                        }
+                                        config.output_format = format;
+                                        break;
+                                }
                                 case 'n': {
-                                        if (strlen((const char*) optarg) < 1) {
-                                                fprintf(stderr, "error: battery name must be a non-empty string for argument `-n'.\n");
+                                        if (name_set_add(&config.cmdopts.n, optarg) < 0) {
+                                                fprintf(stderr, "error: battery names must be non-empty, and can't contain `/', for argument `-n'.\n");
                                                 exit(EXIT_FAILURE);
                                         }
-                                        config.cmdopts.n = optarg;
                                         config.configflags |= CONFIG_FLAG_BY_NAME;
                                         break;
                                 }
@@ -1088,6 +7952,132 @@ main(int argc,
                                         config.configflags |= CONFIG_FLAG_DISABLE_CHARGE_CAP;
                                         break;
                                 }
+                                case 'R': {
+                                        if (set_sys_fs_path(&config, (const char*) optarg) < 0) {
+                                                fprintf(stderr, "error: directory must be a non-empty string for argument `-R'.\n");
+                                                exit(EXIT_FAILURE);
+                                        }
+                                        break;
+                                }
+                                case 'L': {
+                                        config.configflags |= CONFIG_FLAG_LAZY;
+                                        break;
+                                }
+                                case 'P': {
+                                        long threads;
+                                        if (strtol_helper(optarg, &threads) < 0 || threads < 1 || threads > SCAN_POOL_MAX_THREADS) {
+                                                fprintf(stderr, "error: thread count must be an integer from 1 to %d for argument `-P'.\n", SCAN_POOL_MAX_THREADS);
+                                                exit(EXIT_FAILURE);
+                                        }
+                                        config.cmdopts.P = (unsigned long) threads;
+                                        config.configflags |= CONFIG_FLAG_PARALLEL;
+                                        break;
+                                }
+                                case 'T': {
+                                        if (parse_interval((const char*) optarg, &config.cmdopts.T) < 0) {
+                                                fprintf(stderr, "error: timeout must be a positive number of seconds for argument `-T'.\n");
+                                                exit(EXIT_FAILURE);
+                                        }
+                                        config.configflags |= CONFIG_FLAG_PARALLEL;
+                                        break;
+                                }
+                                case 'U': {
+                                        config.configflags |= CONFIG_FLAG_IO_URING;
+                                        break;
+                                }
+                                case 'f': {
+                                        config.configflags |= CONFIG_FLAG_FOLLOW;
+                                        break;
+                                }
+                                case 'D': {
+                                        config.configflags |= CONFIG_FLAG_DAEMON;
+                                        break;
+                                }
+                                case 'C': {
+                                        config.configflags |= CONFIG_FLAG_CLIENT;
+                                        break;
+                                }
+                                case 'S': {
+                                        if (*optarg == '\0') {
+                                                fprintf(stderr, "error: path must be a non-empty string for argument `-S'.\n");
+                                                exit(EXIT_FAILURE);
+                                        }
+                                        config.socket_path = optarg;
+                                        break;
+                                }
+                                case 'M': {
+                                        if (*optarg == '\0') {
+                                                fprintf(stderr, "error: path must be a non-empty string for argument `-M'.\n");
+                                                exit(EXIT_FAILURE);
+                                        }
+                                        config.shm_path = optarg;
+                                        break;
+                                }
+                                case 'A': {
+                                        long age;
+                                        if (strtol_helper(optarg, &age) < 0 || age < 0) {
+                                                fprintf(stderr, "error: age must be a non-negative number of milliseconds for argument `-A'.\n");
+                                                exit(EXIT_FAILURE);
+                                        }
+                                        config.cmdopts.A = (unsigned long) age;
+                                        config.configflags |= CONFIG_FLAG_MAX_AGE;
+                                        break;
+                                }
+                                case 'r':
+                                case 'y':
+                                case 'q': {
+                                        if (*optarg == '\0') {
+                                                fprintf(stderr, "error: path must be a non-empty string for argument `-%c'.\n", c);
+                                                exit(EXIT_FAILURE);
+                                        }
+                                        config.history_path = optarg;
+                                        config.configflags &= ~(CONFIG_FLAG_RECORD | CONFIG_FLAG_REPLAY | CONFIG_FLAG_QUERY);
+                                        config.configflags |= c == 'r' ? CONFIG_FLAG_RECORD : c == 'y' ? CONFIG_FLAG_REPLAY : CONFIG_FLAG_QUERY;
+                                        break;
+                                }
+                                case 'b': {
+                                        long buckets;
+                                        if (strtol_helper(optarg, &buckets) < 0 || buckets < 1 || buckets > QUERY_BUCKETS_MAX) {
+                                                fprintf(stderr, "error: bucket count must be a positive integer (up to %d) for argument `-b'.\n", QUERY_BUCKETS_MAX);
+                                                exit(EXIT_FAILURE);
+                                        }
+                                        config.cmdopts.b = (unsigned long) buckets;
+                                        break;
+                                }
+                                case 'W': {
+                                        long window;
+                                        if (strtol_helper(optarg, &window) < 0 || window < 1 || window > ROLLING_MAX_WINDOW) {
+                                                fprintf(stderr, "error: window must be a positive amount of samples (up to %d) for argument `-W'.\n", ROLLING_MAX_WINDOW);
+                                                exit(EXIT_FAILURE);
+                                        }
+                                        config.cmdopts.W = (unsigned long) window;
+                                        break;
+                                }
+                                case 's':
+                                case 'u': {
+                                        if (parse_time((const char*) optarg, c == 's' ? &config.cmdopts.s : &config.cmdopts.u) < 0) {
+                                                fprintf(stderr, "error: time must be a number of seconds since the epoch (or if negative, before now) for argument `-%c'.\n", c);
+                                                exit(EXIT_FAILURE);
+                                        }
+                                        break;
+                                }
+                                case 'w': {
+                                        if (parse_interval((const char*) optarg, &config.cmdopts.w) < 0) {
+                                                fprintf(stderr, "error: interval must be a positive number of seconds for argument `-w'.\n");
+                                                exit(EXIT_FAILURE);
+                                        }
+                                        config.configflags |= CONFIG_FLAG_WATCH;
+                                        break;
+                                }
+                                case 'c': {
+                                        long count;
+                                        if (strtol_helper(optarg, &count) < 0 || count < 1) {
+                                                fprintf(stderr, "error: sample count must be a positive integer for argument `-c'.\n");
+                                                exit(EXIT_FAILURE);
+                                        }
+                                        config.cmdopts.c = (unsigned long) count;
+                                        break;
+                                }
                                 case '?': {
                                         fprintf(stderr, "error: invalid option specified -- `%c'\n", (char) optopt);
                                         usage_short(EXIT_FAILURE);
@@ -1102,44 +8092,116 @@ main(int argc,
                         }
                 }
 
-                if (infoflagstr != NULL && !(config.configflags & CONFIG_FLAG_OUTPUT_ALL)) {
+                if (infoflagstr != NULL && (config.configflags & CONFIG_FLAG_QUERY)) {
+                        // --query's fields are different, so its output
+                        // sequence is only checked once it's compiled
+                        queryinfostr = infoflagstr;
+                } else if (infoflagstr != NULL && !(config.configflags & CONFIG_FLAG_OUTPUT_ALL)) {
                         // if CONFIG_FLAG_OUTPUT_ALL is set, it overwrites
                         // whatever the user specifies for the output sequence,
                         // so skip checking it if it was provided.
-                        char *p = infoflagstr;
-                        while (*p != '\0') {
-                                switch ((int) *p) {
-                                        case 'n':
-                                        case 'c':
-                                        case 't':
-                                        case 'v':
-                                        case 'C':
-                                        case 'T':
-                                        case 'D':
-                                        case 'd':
-                                        case 'm':
-                                        case 'M':
-                                        case 'e':
-                                        case 's':
-                                        case 'h':
-                                        case 'S':
-                                        case 'H':
-                                        case 'r':
-                                        case 'p':
-                                        case 'o':
-                                        case 'g':
-                                                break;
-                                        default:
-                                                fprintf(stderr, "error: unrecognised character -- '%c'\n", *p);
-                                                usage_short(EXIT_FAILURE);
+                        char *p;
+                        for (p = infoflagstr; *p != '\0'; p++) {
+                                if (output_field_find(*p) == NULL) {
+                                        fprintf(stderr, "error: unrecognised character -- '%c'\n", *p);
+                                        usage_short(EXIT_FAILURE);
                                 }
-                                p++;
                         }
                         infostr = infoflagstr;
                 }
         }
 
-        list_all_battery_info(infostr, &config);
+        if ((config.configflags & CONFIG_FLAG_BY_NAME) && name_set_build(&config.cmdopts.n) < 0) {
+                error("out of memory\n");
+                exit(EXIT_FAILURE);
+        }
 
-        return 0;
+        if (config.configflags & CONFIG_FLAG_OUTPUT_ALL) {
+                infostr = (char*) COMPLETE_OUTPUT_SEQUENCE;
+        }
+        if (config.configflags & CONFIG_FLAG_QUERY) {
+                infostr = config.configflags & CONFIG_FLAG_OUTPUT_ALL ? (char*) QUERY_COMPLETE_OUTPUT_SEQUENCE : queryinfostr;
+        } else if (strpbrk(infostr, ROLLING_OUTPUT_CHARS) != NULL) {
+                config.configflags |= CONFIG_FLAG_ROLLING;
+        }
+
+        struct output_plan plan;
+        if (output_plan_compile(&plan, infostr, &config) < 0) {
+                if (errno == EINVAL) {
+                        fprintf(stderr, "error: unrecognised character in --query output sequence `%s'\n", infostr);
+                        usage_short(EXIT_FAILURE);
+                }
+                error("out of memory\n");
+                exit(EXIT_FAILURE);
+        }
+        config.plan = &plan;
+        config.attrs = output_sequence_attrs(infostr);
+
+        if (config.configflags & CONFIG_FLAG_DAEMON) {
+                // clients might ask for anything
+                config.configflags &= ~CONFIG_FLAG_BY_NAME;
+                config.attrs = output_sequence_attrs(COMPLETE_OUTPUT_SEQUENCE);
+                config.configflags |= CONFIG_FLAG_ROLLING;
+        } else if (config.configflags & CONFIG_FLAG_MAX_AGE) {
+                // and so might later invocations, which share what's read
+                config.attrs = output_sequence_attrs(COMPLETE_OUTPUT_SEQUENCE);
+        }
+
+        struct history history;
+        if (config.configflags & CONFIG_FLAG_RECORD) {
+                if (config.configflags & CONFIG_FLAG_FOLLOW) {
+                        error("--record can't be used with --follow\n");
+                        exit(EXIT_FAILURE);
+                }
+                if (history_open(&history, config.history_path) < 0) {
+                        error("couldn't open %s: %s\n", config.history_path,
+                              errno == EWOULDBLOCK ? "another batteryinfo is recording to it" :
+                              errno == EPROTO ? "not a history log" : strerror(errno));
+                        exit(EXIT_FAILURE);
+                }
+                config.history = &history;
+                config.attrs = output_sequence_attrs(COMPLETE_OUTPUT_SEQUENCE);
+        }
+
+        struct supply_cache cache;
+        supply_cache_init(&cache);
+
+        struct scan scan;
+        scan_init(&scan);
+
+        if ((config.configflags & CONFIG_FLAG_PARALLEL) && scan_pool_init(&scan, &config) < 0) {
+                error("couldn't start worker threads: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+        if ((config.configflags & (CONFIG_FLAG_IO_URING | CONFIG_FLAG_PARALLEL)) == CONFIG_FLAG_IO_URING &&
+                scan_uring_init(&scan) < 0) {
+                warning("io_uring isn't available (%s), reading files one at a time\n", strerror(errno));
+        }
+
+        int ret = 0;
+        if (config.configflags & CONFIG_FLAG_REPLAY) {
+                ret = history_replay(&config) < 0 ? EXIT_FAILURE : 0;
+        } else if (config.configflags & CONFIG_FLAG_QUERY) {
+                ret = history_query(&config) < 0 ? EXIT_FAILURE : 0;
+        } else if (config.configflags & CONFIG_FLAG_DAEMON) {
+                ret = daemon_battery_info(&cache, &scan, &config) < 0 ? EXIT_FAILURE : 0;
+        } else if (config.configflags & CONFIG_FLAG_FOLLOW) {
+                ret = follow_battery_info(&cache, &scan, &config) < 0 ? EXIT_FAILURE : 0;
+        } else if (config.configflags & CONFIG_FLAG_WATCH) {
+                ret = watch_battery_info(&cache, &scan, &config) < 0 ? EXIT_FAILURE : 0;
+        } else if (config.configflags & CONFIG_FLAG_RECORD) {
+                ret = history_sample(&cache, &scan, &config) < 0 ? EXIT_FAILURE : 0;
+        } else {
+                list_all_battery_info(&cache, &scan, &config);
+        }
+
+        if (config.configflags & CONFIG_FLAG_RECORD) {
+                history_close(&history);
+        }
+        scan_cleanup(&scan);
+        supply_cache_cleanup(&cache);
+        output_plan_cleanup(&plan);
+        name_set_cleanup(&config.cmdopts.n);
+
+        return ret;
 }
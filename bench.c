@@ -0,0 +1,582 @@
+//----------------------------------------------------------------------------//
+// -*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-  //
+//                                                                            //
+// batteryinfo-bench - microbenchmarks for batteryinfo's hot paths.           //
+//                                                                            //
+// Build and run with:                                                        //
+//     make bench                                                             //
+// which generates fixture trees with mkfixture (see BENCH_SIZES and          //
+// BENCH_DIR in the Makefile) and runs this against them. Or by hand:         //
+//     batteryinfo-bench [-t seconds] [-f values] <fixture dir>...            //
+//                                                                            //
+// For each fixture, the time, syscalls and heap allocations per supply (or   //
+// per battery, for the parsing and output benchmarks) are reported for:      //
+// classifying supplies (compare_file_contents), parsing batteries            //
+// (get_battery_info, with and without -L), scanning with a cold and a warm   //
+// supply cache (scan_battery_info, serially, with -P and with -U), rendering //
+// each output format, list_all_battery_info end-to-end in each output        //
+// format, and publishing and reading a --shm snapshot (for up to its first   //
+// BATTERYINFO_SHM_MAX_BATTERIES batteries). Output which would go to stdout  //
+// is sent to /dev/null.                                                      //
+//                                                                            //
+// Afterwards, format_fixed2 is checked against printf's "%.2f" over a sweep  //
+// of values; the exit status is non-zero if they ever differ.                //
+//                                                                            //
+// *-,_,-*'^^'*-,_,-*'^^'*-,_,-*'^^'*-,_,-*'^^'*-,_,-*'^^'*-,_,-*'^^'*-,_,-*  //
+//                                                                            //
+// Copyright (c) 2016 Joe Glancy.                                             //
+//                                                                            //
+// This program is free software: you can redistribute it and/or modify       //
+// it under the terms of the GNU General Public License as published by       //
+// the Free Software Foundation, either version 3 of the License, or          //
+// (at your option) any later version.                                        //
+//                                                                            //
+// This program is distributed in the hope that it will be useful,            //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of             //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              //
+// GNU General Public License for more details.                               //
+//                                                                            //
+// You should have received a copy of the GNU General Public License          //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.      //
+//                                                                            //
+//----------------------------------------------------------------------------//
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+//------------------------------------------------------------------------------
+// _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
+//------------------------------------------------------------------------------
+
+// Syscalls are counted by wrapping the libc calls which batteryinfo.c makes
+// with macros, defined after the system headers have been included (so only
+// batteryinfo.c's, and this file's, calls are affected). Each of them makes
+// exactly one syscall (syscall itself is only used for getdents64).
+
+static unsigned long syscall_count = 0; ///< Amount of syscalls made by batteryinfo.c.
+
+#define open(...)       (syscall_count++, open(__VA_ARGS__))
+#define openat(...)     (syscall_count++, openat(__VA_ARGS__))
+#define read(...)       (syscall_count++, read(__VA_ARGS__))
+#define pread(...)      (syscall_count++, pread(__VA_ARGS__))
+#define write(...)      (syscall_count++, write(__VA_ARGS__))
+#define close(...)      (syscall_count++, close(__VA_ARGS__))
+#define lseek(...)      (syscall_count++, lseek(__VA_ARGS__))
+#define syscall(...)    (syscall_count++, syscall(__VA_ARGS__))
+
+#define main batteryinfo_main
+#include "batteryinfo.c"
+#undef main
+
+//------------------------------------------------------------------------------
+// _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
+//------------------------------------------------------------------------------
+
+#define BENCH_PROGRAM_NAME                      "batteryinfo-bench" ///< Program name.
+
+#define DEFAULT_BENCH_MIN_TIME                  0.25 ///< Default minimum time to run each benchmark for, in seconds.
+#define BENCH_THREADS                           4 ///< Amount of worker threads for the parallel scan benchmark.
+#define BENCH_THREADS_STR                       "4" ///< BENCH_THREADS as a string.
+#define DEFAULT_FIXED2_VALUES                   2000000 ///< Default amount of values in each part of the format_fixed2 sweep.
+#define BENCH_SHM_PATH                          "/dev/shm/batteryinfo-bench" ///< Prefix of the path of the --shm benchmarks' snapshot.
+
+/** Usage information string. */
+static const char bench_usage_str[] =
+        "Usage: " BENCH_PROGRAM_NAME " [-t seconds] [-f values] <fixture dir>...\n"
+        "   -t <seconds>      run each benchmark for at least this long (default 0.25)\n"
+        "   -f <values>       amount of values in each part of the format_fixed2 sweep\n"
+        "                     (default 2000000, 0 to skip it)\n";
+
+/** Structure to hold the state shared by the benchmarks of one fixture. */
+struct bench {
+        struct config config;           ///< Program configuration (plain output, every field).
+        struct supply_cache cache;      ///< A warm supply cache for the fixture.
+        struct scan scan;               ///< Scan structure.
+        struct scan parallel;           ///< Scan structure with a pool of worker threads.
+        struct scan uring;              ///< Scan structure with an io_uring (if uring_ok).
+        int uring_ok;                   ///< Whether io_uring could be set up.
+        struct config by_name;          ///< Program configuration with -n set to the last battery.
+        struct supply_cache by_name_cache; ///< Supply cache for by_name.
+        struct supply **batteries;      ///< The cache entries which are batteries.
+        size_t batteries_n;             ///< Amount of entries in batteries.
+        char **type_paths;              ///< The path of every supply's type file, relative to the fixture.
+        size_t supplies_n;              ///< Amount of supplies in the fixture.
+        struct output_plan plan;        ///< The output sequence, compiled for config.
+        struct batteryinfo_shm *shm;    ///< A --shm snapshot of the scanned batteries.
+        struct batteryinfo_shm_battery shm_batteries[BATTERYINFO_SHM_MAX_BATTERIES]; ///< Where the snapshot is read into.
+};
+
+/** Type of the routine which runs one iteration of a benchmark. */
+typedef void (*bench_fn)(struct bench *b);
+
+static FILE *report = NULL;     ///< Where results are written to (the original stdout).
+static double min_time = DEFAULT_BENCH_MIN_TIME; ///< Minimum time to run each benchmark for, in seconds.
+
+/** Routine to run a benchmark for at least min_time seconds, and report its
+ * time, syscalls and allocations per item.
+ * \param name The benchmark's name.
+ * \param fn The routine which runs one iteration of the benchmark.
+ * \param b A pointer to the benchmark state.
+ * \param items The amount of items each iteration processes.
+ * \param unit What an item is (e.g: "supply").
+ */
+static void
+bench_run(const char *name,
+          bench_fn fn,
+          struct bench *b,
+          size_t items,
+          const char *unit)
+{
+        unsigned long iters = 1, i;
+        int64_t elapsed;
+        unsigned long syscalls, allocs;
+
+        if (items == 0) {
+                fprintf(report, "  %-28s %14s\n", name, "-");
+                return;
+        }
+
+        fn(b); // warm up (and let buffers grow to size)
+
+        for (;;) {
+                syscalls = syscall_count;
+                allocs = alloc_count;
+                int64_t start = monotonic_ns();
+
+                for (i = 0; i < iters; i++) {
+                        fn(b);
+                }
+
+                elapsed = monotonic_ns() - start;
+                syscalls = syscall_count - syscalls;
+                allocs = alloc_count - allocs;
+
+                if (elapsed >= (int64_t) (min_time * NSEC_PER_SEC)) {
+                        break;
+                }
+                iters *= 2;
+        }
+
+        double n = (double) iters * (double) items;
+        fprintf(report, "  %-28s %14.1f %14.2f %14.3f  per %s\n",
+                name, (double) elapsed / n, (double) syscalls / n, (double) allocs / n, unit);
+}
+
+/** Benchmark: classify every supply by its type file. */
+static void
+bench_classify(struct bench *b)
+{
+        size_t i;
+
+        for (i = 0; i < b->supplies_n; i++) {
+                compare_file_contents(b->cache.dir_fd, b->type_paths[i], "Battery");
+        }
+}
+
+/** Benchmark: read and parse every battery. */
+static void
+bench_parse(struct bench *b)
+{
+        struct battery_info *info;
+        size_t i;
+
+        arena_reset(&b->scan.arena);
+
+        for (i = 0; i < b->batteries_n; i++) {
+                info = (struct battery_info*) arena_alloc(&b->scan.arena, sizeof(struct battery_info));
+                battery_info_init(info);
+                get_battery_info(&b->scan.arena, b->batteries[i], b->cache.dir_fd, info, &b->config);
+        }
+}
+
+/** Benchmark: read and parse every battery, with -L. */
+static void
+bench_parse_lazy(struct bench *b)
+{
+        uint64_t configflags = b->config.configflags;
+        uint32_t attrs = b->config.attrs;
+
+        b->config.configflags |= CONFIG_FLAG_LAZY;
+        b->config.attrs = output_sequence_attrs(DEFAULT_OUTPUT_SEQUENCE);
+        bench_parse(b);
+        b->config.configflags = configflags;
+        b->config.attrs = attrs;
+}
+
+/** Benchmark: scan with a new supply cache each time (like a single run). */
+static void
+bench_scan_cold(struct bench *b)
+{
+        struct supply_cache cache;
+
+        supply_cache_init(&cache);
+        scan_battery_info(&cache, &b->scan, &b->config);
+        supply_cache_cleanup(&cache);
+}
+
+/** Benchmark: scan with a warm supply cache (like each sample of -w). */
+static void
+bench_scan_warm(struct bench *b)
+{
+        scan_battery_info(&b->cache, &b->scan, &b->config);
+}
+
+/** Benchmark: scan with a new supply cache each time, with io_uring (like a
+ * single run with -U). */
+static void
+bench_scan_cold_uring(struct bench *b)
+{
+        struct supply_cache cache;
+
+        supply_cache_init(&cache);
+        scan_battery_info(&cache, &b->uring, &b->config);
+        supply_cache_cleanup(&cache);
+}
+
+/** Benchmark: scan with a warm supply cache, with io_uring (like each sample
+ * of -w with -U). */
+static void
+bench_scan_warm_uring(struct bench *b)
+{
+        scan_battery_info(&b->cache, &b->uring, &b->config);
+}
+
+/** Benchmark: scan with a warm supply cache and a pool of worker threads
+ * (like each sample of -w with -P). */
+static void
+bench_scan_parallel(struct bench *b)
+{
+        scan_battery_info(&b->cache, &b->parallel, &b->config);
+}
+
+/** Benchmark: scan for a single battery by name (-n), with a warm cache. */
+static void
+bench_scan_by_name(struct bench *b)
+{
+        scan_battery_info(&b->by_name_cache, &b->scan, &b->by_name);
+}
+
+/** Benchmark: render the scanned batteries, discarding the output. */
+static void
+bench_render(struct bench *b)
+{
+        size_t i;
+
+        battery_info_output_init(&b->config);
+        for (i = 0; i < b->scan.n; i++) {
+                list_battery_info((int) i, b->scan.batteries[i], &b->config);
+        }
+        battery_info_output_deinit(&b->config);
+
+        output.len = 0;
+}
+
+/** Benchmark: list_all_battery_info end-to-end, with a warm supply cache. */
+static void
+bench_list(struct bench *b)
+{
+        list_all_battery_info(&b->cache, &b->scan, &b->config);
+}
+
+/** Benchmark: publish the scanned batteries into a --shm snapshot. */
+static void
+bench_shm_publish(struct bench *b)
+{
+        shm_publish(b->shm, &b->scan);
+}
+
+/** Benchmark: read every battery out of a --shm snapshot. */
+static void
+bench_shm_read(struct bench *b)
+{
+        batteryinfo_shm_read(b->shm, b->shm_batteries, BATTERYINFO_SHM_MAX_BATTERIES, NULL);
+}
+
+/** Routine to run every benchmark against one fixture.
+ * \param path The path of the fixture.
+ * \return 0 on success, -1 on error.
+ */
+static int
+bench_fixture(const char *path)
+{
+        struct bench b;
+        size_t i;
+
+        config_init(&b.config);
+        if (set_sys_fs_path(&b.config, path) < 0) {
+                return -1;
+        }
+        b.config.configflags |= CONFIG_FLAG_OUTPUT_ALL;
+        b.config.attrs = output_sequence_attrs(COMPLETE_OUTPUT_SEQUENCE);
+        if (output_plan_compile(&b.plan, COMPLETE_OUTPUT_SEQUENCE, &b.config) < 0) {
+                return -1;
+        }
+        b.config.plan = &b.plan;
+        supply_cache_init(&b.cache);
+        scan_init(&b.scan);
+
+        scan_battery_info(&b.cache, &b.scan, &b.config);
+
+        b.supplies_n = b.cache.n;
+        b.batteries = (struct supply**) malloc((b.cache.n + 1) * sizeof(struct supply*));
+        b.type_paths = (char**) malloc((b.cache.n + 1) * sizeof(char*));
+        if (b.batteries == NULL || b.type_paths == NULL) {
+                error("out of memory\n");
+                return -1;
+        }
+
+        b.batteries_n = 0;
+        for (i = 0; i < b.cache.n; i++) {
+                if (b.cache.supplies[i]->is_battery) {
+                        b.batteries[b.batteries_n++] = b.cache.supplies[i];
+                }
+                if (asprintf(&b.type_paths[i], "%s/type", b.cache.supplies[i]->name) < 0) {
+                        error("out of memory\n");
+                        return -1;
+                }
+        }
+
+        fprintf(report, "%s: %lu supplies, %lu batteries\n", path,
+                (unsigned long) b.supplies_n, (unsigned long) b.batteries_n);
+        fprintf(report, "  %-28s %14s %14s %14s\n", "benchmark", "ns", "syscalls", "allocs");
+
+        bench_run("classify", bench_classify, &b, b.supplies_n, "supply");
+        bench_run("parse", bench_parse, &b, b.batteries_n, "battery");
+        bench_run("parse -L " DEFAULT_OUTPUT_SEQUENCE, bench_parse_lazy, &b, b.batteries_n, "battery");
+        bench_run("scan cold", bench_scan_cold, &b, b.supplies_n, "supply");
+        bench_run("scan warm", bench_scan_warm, &b, b.supplies_n, "supply");
+
+        b.config.cmdopts.P = BENCH_THREADS;
+        scan_init(&b.parallel);
+        if (scan_pool_init(&b.parallel, &b.config) < 0) {
+                error("couldn't start worker threads: %s\n", strerror(errno));
+                return -1;
+        }
+        bench_run("scan warm -P " BENCH_THREADS_STR, bench_scan_parallel, &b, b.supplies_n, "supply");
+        scan_cleanup(&b.parallel);
+
+        scan_init(&b.uring);
+        b.uring_ok = scan_uring_init(&b.uring) == 0;
+        bench_run("scan cold -U", bench_scan_cold_uring, &b, b.uring_ok ? b.supplies_n : 0, "supply");
+        bench_run("scan warm -U", bench_scan_warm_uring, &b, b.uring_ok ? b.supplies_n : 0, "supply");
+        scan_cleanup(&b.uring);
+
+        if (b.batteries_n > 0) {
+                char *name = strdup(b.batteries[b.batteries_n - 1]->name);
+                b.by_name = b.config;
+                b.by_name.configflags |= CONFIG_FLAG_BY_NAME;
+                if (name == NULL || name_set_add(&b.by_name.cmdopts.n, name) < 0 ||
+                        name_set_build(&b.by_name.cmdopts.n) < 0) {
+                        error("out of memory\n");
+                        return -1;
+                }
+                supply_cache_init(&b.by_name_cache);
+                bench_run("scan -n <last battery>", bench_scan_by_name, &b, 1, "scan");
+                supply_cache_cleanup(&b.by_name_cache);
+                name_set_cleanup(&b.by_name.cmdopts.n);
+                free(name);
+        }
+
+        int format;
+        for (format = 0; format < OUTPUT_FORMAT_NUM; format++) {
+                char row[32];
+
+                b.config.output_format = format;
+                output_plan_cleanup(&b.plan);
+                if (output_plan_compile(&b.plan, COMPLETE_OUTPUT_SEQUENCE, &b.config) < 0) {
+                        return -1;
+                }
+                scan_battery_info(&b.cache, &b.scan, &b.config);
+
+                snprintf(row, sizeof(row), "render %s", output_format_names[format]);
+                bench_run(row, bench_render, &b, b.batteries_n, "battery");
+                snprintf(row, sizeof(row), "list %s", output_format_names[format]);
+                bench_run(row, bench_list, &b, b.supplies_n, "supply");
+        }
+
+        char shm_path[64];
+        snprintf(shm_path, sizeof(shm_path), BENCH_SHM_PATH "-%ld", (long) getpid());
+        if ((b.shm = shm_create(shm_path)) == NULL) {
+                error("couldn't create %s: %s\n", shm_path, strerror(errno));
+                return -1;
+        }
+        size_t shm_n = b.batteries_n < BATTERYINFO_SHM_MAX_BATTERIES ? b.batteries_n : BATTERYINFO_SHM_MAX_BATTERIES;
+        bench_run("shm publish", bench_shm_publish, &b, shm_n, "battery");
+        bench_run("shm read", bench_shm_read, &b, shm_n, "battery");
+        munmap(b.shm, sizeof(struct batteryinfo_shm));
+        unlink(shm_path);
+
+        for (i = 0; i < b.supplies_n; i++) {
+                free(b.type_paths[i]);
+        }
+        free(b.type_paths);
+        free(b.batteries);
+        scan_cleanup(&b.scan);
+        supply_cache_cleanup(&b.cache);
+        output_plan_cleanup(&b.plan);
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
+//------------------------------------------------------------------------------
+
+static uint64_t rng_state = 88172645463325252ULL; ///< State of the sweep's random number generator.
+
+/** Routine to get the next random number (xorshift64).
+ * \return A random number.
+ */
+static uint64_t
+rng_next(void)
+{
+        rng_state ^= rng_state << 13;
+        rng_state ^= rng_state >> 7;
+        rng_state ^= rng_state << 17;
+        return rng_state;
+}
+
+/** Routine to check format_fixed2 against printf for a single value.
+ * \param d The value.
+ * \param fast A pointer to a counter of values which format_fixed2 handled
+ * itself (rather than leaving to printf).
+ * \return 0 if the results match, -1 if they don't.
+ */
+static int
+check_fixed2(double d,
+             unsigned long *fast)
+{
+        char a[64], b[64];
+        int n = format_fixed2(d, a);
+
+        if (n < 0) {
+                return 0;
+        }
+        (*fast)++;
+
+        a[n] = '\0';
+        snprintf(b, sizeof(b), "%.2f", d);
+        if (strcmp(a, b)) {
+                fprintf(report, "format_fixed2 mismatch: %.17g gave \"%s\", printf gave \"%s\"\n", d, a, b);
+                return -1;
+        }
+
+        return 0;
+}
+
+/** Routine to check format_fixed2 against printf's "%.2f" over a sweep of
+ * values: decimal fractions covering the ranges sysfs integers are scaled
+ * from, random ratios (like charge/max_charge) and random bit patterns.
+ * \param values The amount of values in each part of the sweep.
+ * \return 0 if every value matched, -1 otherwise.
+ */
+static int
+bench_fixed2_sweep(long values)
+{
+        unsigned long checked = 0, fast = 0;
+        int ret = 0;
+        long i;
+
+        for (i = -values; i <= values && ret == 0; i++) {
+                ret |= check_fixed2((double) i / 1000.0, &fast);
+                ret |= check_fixed2((double) i / 100000.0, &fast);
+                ret |= check_fixed2((double) i / 10.0, &fast);
+                ret |= check_fixed2((double) i / 1e6, &fast);
+                checked += 4;
+        }
+
+        for (i = 0; i < values && ret == 0; i++) {
+                double d = (double) (rng_next() % 4000000000ULL) / (double) (1 + rng_next() % 100000000ULL);
+                ret |= check_fixed2(rng_next() & 1 ? -d : d, &fast);
+                checked++;
+        }
+
+        for (i = 0; i < values && ret == 0; i++) {
+                union { double d; uint64_t u; } x;
+                x.u = rng_next();
+                ret |= check_fixed2(x.d, &fast);
+                checked++;
+        }
+
+        fprintf(report, "format_fixed2: %lu values checked against printf, %lu formatted without it, %s\n",
+                checked, fast, ret == 0 ? "no mismatches" : "MISMATCH");
+        return ret;
+}
+
+//------------------------------------------------------------------------------
+// _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
+//------------------------------------------------------------------------------
+
+/** Program entry point.
+ * \param argc The amount of command-line arguments.
+ * \param argv An array of the command-line arguments.
+ */
+int
+main(int argc,
+     char **argv)
+{
+        long fixed2_values = DEFAULT_FIXED2_VALUES;
+        char *endptr;
+        int c, ret = 0;
+
+        while ((c = getopt(argc, argv, "ht:f:")) != -1) {
+                switch (c) {
+                        case 't': {
+                                min_time = strtod(optarg, &endptr);
+                                if (*endptr != '\0' || !(min_time >= 0)) {
+                                        fputs(bench_usage_str, stderr);
+                                        return EXIT_FAILURE;
+                                }
+                                break;
+                        }
+                        case 'f': {
+                                if (strtol_helper(optarg, &fixed2_values) < 0 || fixed2_values < 0) {
+                                        fputs(bench_usage_str, stderr);
+                                        return EXIT_FAILURE;
+                                }
+                                break;
+                        }
+                        case 'h': {
+                                fputs(bench_usage_str, stdout);
+                                return 0;
+                        }
+                        default: {
+                                fputs(bench_usage_str, stderr);
+                                return EXIT_FAILURE;
+                        }
+                }
+        }
+
+        // keep the results on stdout, and send batteryinfo's output to /dev/null
+        int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        int report_fd = dup(STDOUT_FILENO);
+        if (null_fd < 0 || report_fd < 0 || (report = fdopen(report_fd, "w")) == NULL ||
+                dup2(null_fd, STDOUT_FILENO) < 0) {
+                error("couldn't redirect stdout: %s\n", strerror(errno));
+                return EXIT_FAILURE;
+        }
+        close(null_fd);
+        setvbuf(report, NULL, _IOLBF, 0);
+
+        for (; optind < argc; optind++) {
+                if (bench_fixture(argv[optind]) < 0) {
+                        ret = EXIT_FAILURE;
+                }
+        }
+
+        if (fixed2_values > 0 && bench_fixed2_sweep(fixed2_values) < 0) {
+                ret = EXIT_FAILURE;
+        }
+
+        free(output.data);
+        fclose(report);
+        return ret;
+}
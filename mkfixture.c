@@ -0,0 +1,424 @@
+//----------------------------------------------------------------------------//
+// -*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-  //
+//                                                                            //
+// mkfixture - generates synthetic /sys/class/power_supply trees for testing  //
+// and benchmarking batteryinfo on machines without batteries.                //
+//                                                                            //
+// Compile with something like:                                               //
+//     gcc mkfixture.c -o mkfixture -O3 -Wall                                 //
+//                                                                            //
+// Usage:                                                                     //
+//     mkfixture <dir> <count> [battery percent] [seed]                       //
+//                                                                            //
+// Creates <count> power supply entries in <dir>, of which roughly            //
+// <battery percent> (default 70) are batteries; the rest are a mix of        //
+// mains adapters, USB ports and UPSes. Each entry gets a type file, a        //
+// uevent file, the individual attribute files matching its uevent           //
+// properties and (usually) a device/uevent file, with contents modelled on   //
+// what real drivers provide. Batteries vary in which properties they have,   //
+// like they do on real systems. The output is deterministic for a given     //
+// seed. Point batteryinfo at the result with --sysfs-root <dir>.             //
+//                                                                            //
+// *-,_,-*'^^'*-,_,-*'^^'*-,_,-*'^^'*-,_,-*'^^'*-,_,-*'^^'*-,_,-*'^^'*-,_,-*  //
+//                                                                            //
+// Copyright (c) 2016 Joe Glancy.                                             //
+//                                                                            //
+// This program is free software: you can redistribute it and/or modify       //
+// it under the terms of the GNU General Public License as published by       //
+// the Free Software Foundation, either version 3 of the License, or          //
+// (at your option) any later version.                                        //
+//                                                                            //
+// This program is distributed in the hope that it will be useful,            //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of             //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              //
+// GNU General Public License for more details.                               //
+//                                                                            //
+// You should have received a copy of the GNU General Public License          //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.      //
+//                                                                            //
+//----------------------------------------------------------------------------//
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define PROGRAM_NAME                            "mkfixture" ///< Program name.
+
+#define DEFAULT_BATTERY_PERCENT                 70 ///< Default percentage of entries which are batteries.
+#define DEFAULT_SEED                            1 ///< Default random seed.
+
+#define UEVENT_KEY_PREFIX                       "POWER_SUPPLY_" ///< Prefix of every power supply property key in uevent files.
+
+#define error(a, b...) fprintf(stderr, PROGRAM_NAME ": " a, ##b)
+
+//------------------------------------------------------------------------------
+// _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
+//------------------------------------------------------------------------------
+
+/** Usage information string. */
+static const char usage_str[] =
+        "Usage: " PROGRAM_NAME " <dir> <count> [battery percent] [seed]\n";
+
+/** Battery drivers to pick from. */
+static const char *battery_drivers[] = {
+        "battery", "sbs-battery", "bq27xxx-battery", "max17042", "test_power"
+};
+
+/** Battery manufacturers to pick from. */
+static const char *battery_manufacturers[] = {
+        "SANYO", "SMP", "LGC", "Panasonic", "Samsung SDI", "SONY"
+};
+
+/** Battery technologies to pick from. */
+static const char *battery_technologies[] = {
+        "Li-ion", "Li-poly", "LiFe", "NiMH"
+};
+
+/** Battery statuses to pick from. */
+static const char *battery_statuses[] = {
+        "Discharging", "Charging", "Full", "Not charging", "Unknown"
+};
+
+#define array_len(a) (sizeof(a) / sizeof((a)[0])) ///< Macro to get the amount of elements in an array.
+
+/** Structure to hold the contents of a file while it's being generated. */
+struct filebuf {
+        char data[4096];        ///< The contents (sysfs limits attributes to a page).
+        size_t len;             ///< Length of the contents.
+};
+
+static uint64_t rng_state; ///< State of the random number generator.
+
+//------------------------------------------------------------------------------
+// _,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^'*-,_
+//------------------------------------------------------------------------------
+
+/** Routine to get the next random number (xorshift64*).
+ * \return A random number.
+ */
+static uint64_t
+rng_next(void)
+{
+        rng_state ^= rng_state >> 12;
+        rng_state ^= rng_state << 25;
+        rng_state ^= rng_state >> 27;
+        return rng_state * 2685821657736338717ULL;
+}
+
+/** Routine to get a random number in a range.
+ * \param lo The lowest possible number.
+ * \param hi The highest possible number.
+ * \return A random number between lo and hi, inclusive.
+ */
+static long
+rng_range(long lo,
+          long hi)
+{
+        return lo + (long) (rng_next() % (uint64_t) (hi - lo + 1));
+}
+
+/** Routine to write a file, replacing it if it already exists.
+ * \param path The path of the file.
+ * \param data The contents.
+ * \param len The length of the contents.
+ * \return 0 on success, -1 on error.
+ */
+static int
+write_file(const char *path,
+           const char *data,
+           size_t len)
+{
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+                error("couldn't create \"%s\": %s\n", path, strerror(errno));
+                return -1;
+        }
+
+        while (len > 0) {
+                ssize_t n = write(fd, data, len);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        error("couldn't write \"%s\": %s\n", path, strerror(errno));
+                        close(fd);
+                        return -1;
+                }
+                data += n;
+                len -= (size_t) n;
+        }
+
+        close(fd);
+        return 0;
+}
+
+/** Routine to create a directory, if it doesn't already exist.
+ * \param path The path of the directory.
+ * \return 0 on success, -1 on error.
+ */
+static int
+make_dir(const char *path)
+{
+        if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+                error("couldn't create \"%s\": %s\n", path, strerror(errno));
+                return -1;
+        }
+
+        return 0;
+}
+
+/** Routine to add a property to an entry's uevent file, and write the
+ * matching individual attribute file (with a lowercase name, as sysfs does).
+ * \param dir The path of the entry's directory.
+ * \param uevent A pointer to the uevent file being generated.
+ * \param key The property's key, without UEVENT_KEY_PREFIX.
+ * \param value The property's value.
+ * \return 0 on success, -1 on error.
+ */
+static int
+add_property(const char *dir,
+             struct filebuf *uevent,
+             const char *key,
+             const char *value)
+{
+        int n = snprintf(uevent->data + uevent->len, sizeof(uevent->data) - uevent->len,
+                         UEVENT_KEY_PREFIX "%s=%s\n", key, value);
+        if (n < 0 || (size_t) n >= sizeof(uevent->data) - uevent->len) {
+                error("uevent for \"%s\" is too long\n", dir);
+                return -1;
+        }
+        uevent->len += (size_t) n;
+
+        if (!strcmp(key, "NAME")) {
+                return 0; // sysfs doesn't have a name attribute
+        }
+
+        char path[PATH_MAX], *p;
+        snprintf(path, sizeof(path), "%s/%s", dir, key);
+        for (p = path + strlen(dir) + 1; *p != '\0'; p++) {
+                *p = (char) tolower((int) *p);
+        }
+
+        char contents[256];
+        n = snprintf(contents, sizeof(contents), "%s\n", value);
+        return write_file(path, contents, (size_t) n);
+}
+
+/** Routine to add a numeric property to an entry (add_property wrapper).
+ * \param dir The path of the entry's directory.
+ * \param uevent A pointer to the uevent file being generated.
+ * \param key The property's key, without UEVENT_KEY_PREFIX.
+ * \param value The property's value.
+ * \return 0 on success, -1 on error.
+ */
+static int
+add_property_long(const char *dir,
+                  struct filebuf *uevent,
+                  const char *key,
+                  long value)
+{
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%ld", value);
+        return add_property(dir, uevent, key, buf);
+}
+
+/** Routine to add the properties of a battery to an entry.
+ * \param dir The path of the entry's directory.
+ * \param uevent A pointer to the uevent file being generated.
+ * \param i The entry's index.
+ * \return 0 on success, -1 on error.
+ */
+static int
+add_battery_properties(const char *dir,
+                       struct filebuf *uevent,
+                       unsigned long i)
+{
+        const char *status = battery_statuses[rng_next() % array_len(battery_statuses)];
+        long full_design = rng_range(2000, 9000) * 1000;
+        long full = full_design / 100 * rng_range(60, 100);
+        long now = full / 100 * rng_range(1, 100);
+        long current = rng_range(100, 3500) * 1000;
+        char buf[64];
+        int ret = 0;
+
+        ret |= add_property(dir, uevent, "STATUS", status);
+        ret |= add_property_long(dir, uevent, "PRESENT", 1);
+        ret |= add_property(dir, uevent, "TECHNOLOGY", battery_technologies[rng_next() % array_len(battery_technologies)]);
+        ret |= add_property_long(dir, uevent, "CYCLE_COUNT", rng_range(0, 1500));
+        ret |= add_property_long(dir, uevent, "VOLTAGE_MIN_DESIGN", 11100000);
+        ret |= add_property_long(dir, uevent, "VOLTAGE_NOW", rng_range(10800, 12600) * 1000);
+        ret |= add_property_long(dir, uevent, "CURRENT_NOW", current);
+
+        // like real drivers, not every battery reports everything
+        if (rng_next() % 4 != 0) {
+                ret |= add_property_long(dir, uevent, "CHARGE_FULL_DESIGN", full_design);
+                ret |= add_property_long(dir, uevent, "CHARGE_FULL", full);
+                ret |= add_property_long(dir, uevent, "CHARGE_NOW", now);
+        }
+        if (rng_next() % 3 != 0) {
+                ret |= add_property_long(dir, uevent, "CAPACITY", now * 100 / full);
+                ret |= add_property(dir, uevent, "CAPACITY_LEVEL", "Normal");
+        }
+        if (rng_next() % 2 == 0) {
+                ret |= add_property_long(dir, uevent, "TEMP", rng_range(150, 450));
+                ret |= add_property(dir, uevent, "HEALTH", "Good");
+        }
+        if (rng_next() % 3 == 0) {
+                ret |= add_property(dir, uevent, "CHARGE_TYPE", "Fast");
+                ret |= add_property(dir, uevent, "CHARGE_RATE", "Normal");
+                ret |= add_property_long(dir, uevent, "CHARGING_ENABLED", !strcmp(status, "Charging"));
+        }
+
+        snprintf(buf, sizeof(buf), "BMS-%05lu", i);
+        ret |= add_property(dir, uevent, "MODEL_NAME", buf);
+        ret |= add_property(dir, uevent, "MANUFACTURER", battery_manufacturers[rng_next() % array_len(battery_manufacturers)]);
+        snprintf(buf, sizeof(buf), "%lu", (unsigned long) (rng_next() % 100000));
+        ret |= add_property(dir, uevent, "SERIAL_NUMBER", buf);
+
+        return ret != 0 ? -1 : 0;
+}
+
+/** Routine to create a single power supply entry.
+ * \param root The path of the directory to create the entry in.
+ * \param i The entry's index.
+ * \param battery_percent The percentage of entries which should be batteries.
+ * \return 0 on success, -1 on error.
+ */
+static int
+make_supply(const char *root,
+            unsigned long i,
+            int battery_percent)
+{
+        const char *type, *prefix;
+        int is_battery = (long) (rng_next() % 100) < battery_percent;
+
+        if (is_battery) {
+                type = "Battery";
+                prefix = "BAT";
+        } else {
+                switch (rng_next() % 3) {
+                        case 0: type = "Mains"; prefix = "AC"; break;
+                        case 1: type = "USB"; prefix = "USB"; break;
+                        default: type = "UPS"; prefix = "UPS"; break;
+                }
+        }
+
+        char name[64], dir[PATH_MAX - 32], path[PATH_MAX];
+        snprintf(name, sizeof(name), "%s%lu", prefix, i);
+        if ((size_t) snprintf(dir, sizeof(dir), "%s/%s", root, name) >= sizeof(dir)) {
+                error("path \"%s/%s\" is too long\n", root, name);
+                return -1;
+        }
+
+        if (make_dir(dir) < 0) {
+                return -1;
+        }
+
+        snprintf(path, sizeof(path), "%s/type", dir);
+        char contents[64];
+        int n = snprintf(contents, sizeof(contents), "%s\n", type);
+        if (write_file(path, contents, (size_t) n) < 0) {
+                return -1;
+        }
+
+        struct filebuf uevent;
+        uevent.len = 0;
+        int ret = add_property(dir, &uevent, "NAME", name);
+
+        if (is_battery) {
+                ret |= add_battery_properties(dir, &uevent, i);
+        } else {
+                ret |= add_property_long(dir, &uevent, "ONLINE", (long) (rng_next() % 2));
+                if (strcmp(type, "Mains")) {
+                        ret |= add_property_long(dir, &uevent, "VOLTAGE_MAX", 5000000);
+                        ret |= add_property_long(dir, &uevent, "CURRENT_MAX", 3000000);
+                }
+        }
+
+        if (ret != 0) {
+                return -1;
+        }
+
+        snprintf(path, sizeof(path), "%s/uevent", dir);
+        if (write_file(path, uevent.data, uevent.len) < 0) {
+                return -1;
+        }
+
+        // some entries (e.g: virtual ones) have no parent device
+        if (rng_next() % 10 != 0) {
+                snprintf(path, sizeof(path), "%s/device", dir);
+                if (make_dir(path) < 0) {
+                        return -1;
+                }
+
+                snprintf(path, sizeof(path), "%s/device/uevent", dir);
+                n = snprintf(contents, sizeof(contents), "DRIVER=%s\n",
+                             is_battery ? battery_drivers[rng_next() % array_len(battery_drivers)] : "ac");
+                if (write_file(path, contents, (size_t) n) < 0) {
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+/** Utility routine for converting a string into a non-negative integer.
+ * \param s The string to convert.
+ * \param dest A pointer to the unsigned long in which to place the result.
+ * \return 0 on success, -1 on error.
+ */
+static int
+parse_ulong(const char *s,
+            unsigned long *dest)
+{
+        errno = 0;
+        char *endptr;
+
+        if (*s == '-') {
+                return -1;
+        }
+
+        *dest = strtoul(s, &endptr, 10);
+        return (errno != 0 || endptr == s || *endptr != '\0') ? -1 : 0;
+}
+
+/** Program entry point.
+ * \param argc The amount of command-line arguments.
+ * \param argv An array of the command-line arguments.
+ */
+int
+main(int argc,
+     char **argv)
+{
+        unsigned long count, battery_percent = DEFAULT_BATTERY_PERCENT, seed = DEFAULT_SEED, i;
+
+        if (argc < 3 || argc > 5 ||
+                parse_ulong(argv[2], &count) < 0 ||
+                (argc > 3 && (parse_ulong(argv[3], &battery_percent) < 0 || battery_percent > 100)) ||
+                (argc > 4 && parse_ulong(argv[4], &seed) < 0)) {
+                fputs(usage_str, stderr);
+                return EXIT_FAILURE;
+        }
+
+        rng_state = seed * 0x9E3779B97F4A7C15ULL + 1;
+
+        if (make_dir(argv[1]) < 0) {
+                return EXIT_FAILURE;
+        }
+
+        for (i = 0; i < count; i++) {
+                if (make_supply(argv[1], i, (int) battery_percent) < 0) {
+                        return EXIT_FAILURE;
+                }
+        }
+
+        return 0;
+}